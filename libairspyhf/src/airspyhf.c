@@ -28,12 +28,32 @@ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSI
 #define _CRT_SECURE_NO_WARNINGS
 #endif
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* pthread_setaffinity_np, pthread_setname_np */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <libusb.h>
 #include <pthread.h>
 #include <math.h>
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#if defined(__ARM_FP) && (__ARM_FP & 2)
+#define USE_NEON_FP16
+#endif
+#if defined(__aarch64__)
+#define USE_NEON_A64
+#endif
+#endif
 
 #include "iqbalancer.h"
 #include "airspyhf.h"
@@ -53,9 +73,15 @@ typedef int bool;
 #define MIN(a,b) ((a) < (b) ? a : b)
 
 #define SAMPLES_TO_TRANSFER (1024 * 4)
+#define MAX_TRANSFER_DEPTH (32)
+#define DEFAULT_TRANSFER_DEPTH (16)
+#define MIN_TRANSFER_DEPTH (2)
+#define DEPTH_WINDOW (256) /* Completions between two depth decisions */
+#define DEPTH_SHRINK_WINDOWS (8) /* Calm windows in a row before giving one transfer back */
 #define SERIAL_NUMBER_UNUSED (0)
 #define FILE_DESCRIPTOR_UNUSED (-1)
 #define RAW_BUFFER_COUNT (8)
+#define RETUNE_FIFO_TRANSFERS (1) /* Samples the receiver may still hold from the previous LO, in transfers */
 #define AIRSPYHF_SERIAL_SIZE (28)
 
 #define MAX_SAMPLERATE_INDEX (100)
@@ -67,6 +93,7 @@ typedef int bool;
 #define CALIBRATION_MAGIC (0xA5CA71B0)
 
 #define DEFAULT_IF_SHIFT (5000)
+#define TUNING_WINDOW_BANDWIDTH (0.8) /* Share of the Nyquist band the DSP shift may reach, the edges are filtered out */
 #define MIN_ZERO_IF_LO (180)
 #define MIN_LOW_IF_LO (84)
 
@@ -79,25 +106,67 @@ static const char str_prefix_serial_airspyhf[STR_PREFIX_SERIAL_AIRSPYHF_SIZE] =
 
 #define LIBUSB_CTRL_TIMEOUT_MS (500)
 
+#define NCO_TABLE_BITS (12)
+#define NCO_TABLE_SIZE (1 << NCO_TABLE_BITS)
+#define NCO_FRACTION_BITS (32 - NCO_TABLE_BITS)
+#define NCO_PHASE_SCALE (4294967296.0)
+
+#define FREQ_DELTA_CACHE_BITS (12)
+#define FREQ_DELTA_CACHE_SIZE (1 << FREQ_DELTA_CACHE_BITS)
+#define FREQ_DELTA_CACHE_MAGIC "AHFFDC1"
+
+#define CAPABILITY_CACHE_MAGIC "AHFCAP1"
+#define CAPABILITY_CACHE_MAX_COUNT (256)
+
 #pragma pack(push,1)
 
 typedef struct {
 	int16_t im;
 	int16_t re;
-} airspyhf_complex_int16_t;
+} airspyhf_raw_sample_t;
 
 #pragma pack(pop)
 
+// GET_FREQ_DELTA answer for an LO setting, the delta only depends on the firmware
+typedef struct
+{
+	uint32_t freq_khz; /* 0 = empty */
+	uint32_t samplerate;
+	uint32_t frontend_options;
+	uint8_t raw[4];
+} freq_delta_entry_t;
+
+typedef struct airspyhf_command
+{
+	struct airspyhf_command* next;
+	uint8_t request; /* AIRSPYHF_SET_FREQ becomes AIRSPYHF_GET_FREQ_DELTA once the LO moved */
+	uint16_t value;
+	double freq_hz;
+	double adjusted_freq_hz;
+	uint32_t freq_khz;
+	airspyhf_command_cb_fn callback;
+	void* ctx;
+} airspyhf_command_t;
+
 typedef struct airspyhf_device
 {
 	libusb_context* usb_context;
 	libusb_device_handle* usb_device;
+	pthread_mutex_t handle_mp; /* Held around the control transfers and the handle swap on reattach */
+	airspyhf_hub_t* hub; /* Owns usb_context and runs the I/O when set */
+	struct airspyhf_device* hub_next;
+	bool hub_queued; /* In the hub ready list or being consumed, guarded by the hub mutex */
 	struct libusb_transfer** transfers;
 	airspyhf_sample_block_cb_fn callback;
 	pthread_t transfer_thread;
 	pthread_t consumer_thread;
 	bool transfer_thread_running;
 	bool consumer_thread_running;
+	bool transfer_thread_parked; /* Waiting for the next start, guarded by consumer_mp */
+	bool consumer_thread_parked;
+	bool io_threads_exit;
+	pthread_cond_t io_cv;
+	airspyhf_thread_policy_t thread_policy[2]; /* Indexed by enum airspyhf_thread */
 	pthread_cond_t consumer_cv;
 	pthread_mutex_t consumer_mp;
 	uint32_t supported_samplerate_count;
@@ -110,6 +179,15 @@ typedef struct airspyhf_device
 	volatile uint32_t freq_khz;
 	volatile double freq_delta_hz;
 	volatile double freq_shift;
+	double applied_freq_shift; /* Consumer side, NCO offset of the previous block */
+	bool nco_retuned;
+	volatile bool retune_pending; /* The LO moved, flag the block ending at retune_transfer */
+	uint64_t retune_transfer;
+	uint64_t completed_transfers;
+	uint64_t sample_index;
+	volatile uint32_t tuning_window_hz;
+	freq_delta_entry_t *freq_delta_cache;
+	volatile bool freq_delta_cache_enabled;
 	volatile int32_t calibration_ppb;
 	volatile int32_t calibration_vctcxo;
 	volatile uint32_t frontend_options;
@@ -118,22 +196,85 @@ typedef struct airspyhf_device
 	uint8_t is_low_if;
 	float filter_gain;
 	airspyhf_complex_float_t vec;
+	enum airspyhf_nco_mode nco_mode;
+	uint32_t nco_phase;
+	airspyhf_complex_float_t *nco_table;
 	struct iq_balancer_t *iq_balancer;
 	uint32_t transfer_count;
-	int32_t transfer_live;
+	int32_t transfer_live; /* Submitted and not called back yet, guarded by consumer_mp, io_cv is signalled at zero */
+	volatile uint32_t transfer_depth; /* Transfers kept in flight, the others are parked */
+	uint32_t transfer_depth_min;
+	uint32_t transfer_depth_max;
+	struct libusb_transfer* idle_transfers[MAX_TRANSFER_DEPTH]; /* Guarded by consumer_mp */
+	uint32_t idle_transfer_count;
+	uint64_t last_completion_us;
+	uint32_t window_completions;
+	uint32_t window_max_gap_us;
+	uint32_t window_queue_peak;
+	uint32_t calm_windows;
+	uint32_t completion_jitter_us;
+	uint32_t queue_peak;
+	uint64_t total_dropped_buffers;
 	uint32_t buffer_size;
 	uint32_t dropped_buffers;
 	uint32_t dropped_buffers_queue[RAW_BUFFER_COUNT];
-	airspyhf_complex_int16_t *received_samples_queue[RAW_BUFFER_COUNT];
+	uint32_t transfer_flags; /* AIRSPYHF_TRANSFER_FLAG_* for the next queued buffer */
+	uint32_t transfer_flags_queue[RAW_BUFFER_COUNT];
+	airspyhf_raw_sample_t *received_samples_queue[RAW_BUFFER_COUNT];
 	volatile bool streaming;
 	volatile bool stop_requested;
 	volatile int received_samples_queue_head;
 	volatile int received_samples_queue_tail;
 	volatile int received_buffer_count;
 	airspyhf_complex_float_t *output_buffer;
+	void *packed_buffer;
+	volatile enum airspyhf_sample_type sample_type;
+	volatile bool squelch_enabled;
+	volatile float squelch_open_level;
+	volatile float squelch_close_level;
+	volatile uint32_t squelch_hang_time_ms;
+	bool squelch_open;
+	uint64_t squelch_hang_remaining;
+	uint64_t gated_samples;
+	uint64_t gated_dropped_samples;
+	uint32_t gated_flags;
+	uint64_t serial_number; /* SERIAL_NUMBER_UNUSED until known */
+	volatile bool auto_recovery;
+	volatile bool device_lost;
+	bool hotplug_registered;
+	libusb_hotplug_callback_handle hotplug_handle;
+	bool vctcxo_applied;
+	bool frontend_options_applied;
+	int32_t att_index; /* Last value sent for each setting, -1 when never set, replayed after a recovery */
+	int32_t hf_agc;
+	int32_t hf_agc_threshold;
+	int32_t hf_lna;
+	int32_t bias_tee;
+	struct libusb_transfer* command_transfer;
+	uint8_t command_buffer[LIBUSB_CONTROL_SETUP_SIZE + 4];
+	airspyhf_command_t* command_head; /* In flight when command_busy is set */
+	airspyhf_command_t* command_tail;
+	volatile bool command_busy;
+	pthread_cond_t command_cv;
+	pthread_mutex_t command_mp;
 	void* ctx;
 } airspyhf_device_t;
 
+typedef struct airspyhf_hub
+{
+	libusb_context* usb_context;
+	pthread_t event_thread;
+	pthread_t* consumer_threads;
+	int consumer_count;
+	int device_count;
+	volatile bool exit_requested;
+	pthread_mutex_t mp;
+	pthread_cond_t ready_cv;
+	pthread_cond_t idle_cv;
+	airspyhf_device_t* ready_head; /* Devices with buffers waiting, each one is consumed by a single thread at a time */
+	airspyhf_device_t* ready_tail;
+} airspyhf_hub_t;
+
 typedef struct flash_config
 {
 	uint32_t magic_number;
@@ -146,6 +287,8 @@ static const uint16_t airspyhf_usb_vid = 0x03EB;
 static const uint16_t airspyhf_usb_pid = 0x800C;
 
 static int airspyhf_config_read(airspyhf_device_t* device, uint8_t *buffer, uint16_t length);
+static void command_cancel(airspyhf_device_t* device);
+static void command_drain(airspyhf_device_t* device);
 
 static int cancel_transfers(airspyhf_device_t* device)
 {
@@ -183,6 +326,9 @@ static int free_transfers(airspyhf_device_t* device)
 		free(device->output_buffer);
 		device->output_buffer = NULL;
 
+		free(device->packed_buffer);
+		device->packed_buffer = NULL;
+
 		for (transfer_index = 0; transfer_index < device->transfer_count; transfer_index++)
 		{
 			if (device->transfers[transfer_index] != NULL)
@@ -215,11 +361,18 @@ static int allocate_transfers(airspyhf_device_t* const device)
 
 	if (device->transfers == NULL)
 	{
-		device->output_buffer = (airspyhf_complex_float_t *) malloc((device->buffer_size / sizeof(airspyhf_complex_int16_t)) * sizeof(airspyhf_complex_float_t));
+		device->output_buffer = (airspyhf_complex_float_t *) malloc((device->buffer_size / sizeof(airspyhf_raw_sample_t)) * sizeof(airspyhf_complex_float_t));
+
+		// Large enough for any of the output sample types
+		device->packed_buffer = malloc((device->buffer_size / sizeof(airspyhf_raw_sample_t)) * sizeof(airspyhf_complex_float_t));
+		if (device->output_buffer == NULL || device->packed_buffer == NULL)
+		{
+			return AIRSPYHF_ERROR;
+		}
 
 		for (i = 0; i < RAW_BUFFER_COUNT; i++)
 		{
-			device->received_samples_queue[i] = (airspyhf_complex_int16_t *) malloc(device->buffer_size);
+			device->received_samples_queue[i] = (airspyhf_raw_sample_t *) malloc(device->buffer_size);
 			if (device->received_samples_queue[i] == NULL)
 			{
 				return AIRSPYHF_ERROR;
@@ -265,6 +418,16 @@ static int allocate_transfers(airspyhf_device_t* const device)
 	}
 }
 
+// Called with consumer_mp held once a transfer is no longer in flight
+static void transfer_released(airspyhf_device_t* device)
+{
+	device->transfer_live--;
+	if (device->transfer_live == 0)
+	{
+		pthread_cond_broadcast(&device->io_cv);
+	}
+}
+
 static int prepare_transfers(airspyhf_device_t* device, const uint_fast8_t endpoint_address, libusb_transfer_cb_fn callback)
 {
 	int error;
@@ -272,19 +435,37 @@ static int prepare_transfers(airspyhf_device_t* device, const uint_fast8_t endpo
 
 	if (device->transfers != NULL)
 	{
-		for (transfer_index = 0; transfer_index<device->transfer_count; transfer_index++)
+		device->last_completion_us = 0;
+		device->window_completions = 0;
+		device->window_max_gap_us = 0;
+		device->window_queue_peak = 0;
+		device->calm_windows = 0;
+
+		// Parked before anything is submitted, a hub event thread may already run the callback
+		pthread_mutex_lock(&device->consumer_mp);
+		device->idle_transfer_count = 0;
+		for (transfer_index = device->transfer_depth; transfer_index < device->transfer_count; transfer_index++)
+		{
+			device->transfers[transfer_index]->endpoint = endpoint_address;
+			device->transfers[transfer_index]->callback = callback;
+			device->idle_transfers[device->idle_transfer_count++] = device->transfers[transfer_index];
+		}
+
+		for (transfer_index = 0; transfer_index < device->transfer_depth; transfer_index++)
 		{
 			device->transfers[transfer_index]->endpoint = endpoint_address;
 			device->transfers[transfer_index]->callback = callback;
 
+			device->transfer_live++;
 			error = libusb_submit_transfer(device->transfers[transfer_index]);
 			if (error != 0)
 			{
+				transfer_released(device);
+				pthread_mutex_unlock(&device->consumer_mp);
 				return AIRSPYHF_ERROR;
 			}
-			else
-				device->transfer_live++;
 		}
+		pthread_mutex_unlock(&device->consumer_mp);
 		return AIRSPYHF_SUCCESS;
 	}
 
@@ -313,22 +494,89 @@ static inline void rotate_complex(airspyhf_complex_float_t *vec, const airspyhf_
 	multiply_complex_real(vec, norm);
 }
 
-static void convert_samples(airspyhf_device_t* device, airspyhf_complex_int16_t *src, airspyhf_complex_float_t *dest, int count)
+static void nco_table_init(airspyhf_complex_float_t *table)
+{
+	int i;
+	double angle;
+
+	for (i = 0; i < NCO_TABLE_SIZE; i++)
+	{
+		angle = 2.0 * M_PI * i / NCO_TABLE_SIZE;
+		table[i].re = (float) cos(angle);
+		table[i].im = (float) -sin(angle);
+	}
+}
+
+static uint32_t nco_phase_increment(double freq_shift, uint32_t samplerate)
+{
+	return (uint32_t) (int64_t) floor(freq_shift / samplerate * NCO_PHASE_SCALE + 0.5);
+}
+
+static void rotate_samples_nco(airspyhf_device_t* device, airspyhf_complex_float_t *dest, int count, uint32_t phase_inc)
+{
+	// Each phase is derived from the accumulator, not from the previous sample,
+	// so the loop carries no dependency and the oscillator never drifts.
+	// The table holds e^-j(coarse phase); a first order term corrects for the residual.
+
+	const float residual_scale = (float) (2.0 * M_PI / NCO_PHASE_SCALE);
+	const airspyhf_complex_float_t *table = device->nco_table;
+	const uint32_t phase = device->nco_phase;
+
+	int i;
+	uint32_t p;
+	uint32_t index;
+	float delta;
+	airspyhf_complex_float_t vec;
+
+	for (i = 0; i < count; i++)
+	{
+		p = phase + (uint32_t) (i + 1) * phase_inc;
+		index = (p + (1u << (NCO_FRACTION_BITS - 1))) >> NCO_FRACTION_BITS;
+		delta = (int32_t) (p - (index << NCO_FRACTION_BITS)) * residual_scale;
+
+		vec = table[index & (NCO_TABLE_SIZE - 1)];
+		vec.re += table[index & (NCO_TABLE_SIZE - 1)].im * delta;
+		vec.im -= table[index & (NCO_TABLE_SIZE - 1)].re * delta;
+
+		multiply_complex_complex(&dest[i], &vec);
+	}
+
+	device->nco_phase = phase + (uint32_t) count * phase_inc;
+}
+
+static float convert_samples(airspyhf_device_t* device, airspyhf_raw_sample_t *src, airspyhf_complex_float_t *dest, int count, bool squelch_enabled)
 {
+	// Returns the mean power of the block when the squelch needs it, 0 otherwise
+
 	const float scale = 1.0f / 32768;
 
 	int i;
 	airspyhf_complex_float_t vec;
 	airspyhf_complex_float_t rot;
 	double angle;
+	double freq_shift;
 	float conversion_gain;
+	float power = 0.0f;
 
 	conversion_gain = scale * device->filter_gain;
 
-	for (i = 0; i < count; i++)
+	if (squelch_enabled)
+	{
+		for (i = 0; i < count; i++)
+		{
+			dest[i].re = src[i].re * conversion_gain;
+			dest[i].im = src[i].im * conversion_gain;
+			power += dest[i].re * dest[i].re + dest[i].im * dest[i].im;
+		}
+		power /= count;
+	}
+	else
 	{
-		dest[i].re = src[i].re * conversion_gain;
-		dest[i].im = src[i].im * conversion_gain;
+		for (i = 0; i < count; i++)
+		{
+			dest[i].re = src[i].re * conversion_gain;
+			dest[i].im = src[i].im * conversion_gain;
+		}
 	}
 
 	if (device->enable_dsp)
@@ -340,226 +588,1163 @@ static void convert_samples(airspyhf_device_t* device, airspyhf_complex_int16_t
 		}
 
 		// Fine tuning
-		if (device->freq_shift != 0)
+		freq_shift = device->freq_shift;
+		if (freq_shift != device->applied_freq_shift)
+		{
+			device->applied_freq_shift = freq_shift;
+			device->nco_retuned = true;
+		}
+		if (freq_shift != 0)
 		{
-			angle = 2.0 * M_PI * device->freq_shift / (double) device->current_samplerate;
+			if (device->nco_mode == AIRSPYHF_NCO_PHASE_ACCUMULATOR)
+			{
+				rotate_samples_nco(device, dest, count, nco_phase_increment(freq_shift, device->current_samplerate));
+			}
+			else
+			{
+				angle = 2.0 * M_PI * freq_shift / (double) device->current_samplerate;
 
-			vec = device->vec;
+				vec = device->vec;
 
-			rot.re = (float) cos(angle);
-			rot.im = (float) -sin(angle);
+				rot.re = (float) cos(angle);
+				rot.im = (float) -sin(angle);
 
-			for (i = 0; i < count; i++)
-			{
-				rotate_complex(&vec, &rot);
-				multiply_complex_complex(&dest[i], &vec);
-			}
+				for (i = 0; i < count; i++)
+				{
+					rotate_complex(&vec, &rot);
+					multiply_complex_complex(&dest[i], &vec);
+				}
 
-			device->vec = vec;
+				device->vec = vec;
+			}
 		}
 	}
+
+	return power;
 }
 
-static void* consumer_threadproc(void *arg)
+static uint16_t float_to_half(float value)
 {
-	int sample_count;
-	airspyhf_complex_int16_t *input_samples;
-	uint32_t dropped_buffers;
-	airspyhf_device_t* device = (airspyhf_device_t*) arg;
-	airspyhf_transfer_t transfer;
+	// Round to nearest even, with subnormals, Inf and NaN handled.
+	union { float f; uint32_t u; } in, magic;
+	uint32_t sign;
+	uint32_t mant_odd;
+	uint16_t out;
 
-#ifdef _WIN32
+	in.f = value;
+	sign = in.u & 0x80000000u;
+	in.u ^= sign;
 
-	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+	if (in.u >= 0x47800000u)
+	{
+		// Out of range: Inf, or NaN kept quiet
+		out = (in.u > 0x7f800000u) ? 0x7e00 : 0x7c00;
+	}
+	else if (in.u < 0x38800000u)
+	{
+		// Subnormal or zero: let the FPU do the rounding
+		magic.u = 0x3f000000u;
+		in.f += magic.f;
+		out = (uint16_t) (in.u - magic.u);
+	}
+	else
+	{
+		mant_odd = (in.u >> 13) & 1;
+		in.u += 0xc8000fffu + mant_odd; // Rebias the exponent from 127 to 15 and round
+		out = (uint16_t) (in.u >> 13);
+	}
 
-#endif
+	return out | (uint16_t) (sign >> 16);
+}
 
-	pthread_mutex_lock(&device->consumer_mp);
+static void convert_float16(const float *src, uint16_t *dest, int count)
+{
+	int i = 0;
 
-	while (device->streaming && !device->stop_requested)
+#if defined(USE_SSE2) && defined(__F16C__)
+	for (; i + 8 <= count; i += 8)
 	{
-		while (device->received_buffer_count == 0 && device->streaming && !device->stop_requested)
-		{
-			pthread_cond_wait(&device->consumer_cv, &device->consumer_mp);
-		}
-		if (!device->streaming || device->stop_requested)
-		{
-			break;
-		}
+		_mm_storeu_si128((__m128i *) (dest + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+	}
+#elif defined(USE_NEON_FP16)
+	for (; i + 4 <= count; i += 4)
+	{
+		vst1_u16(dest + i, vreinterpret_u16_f16(vcvt_f16_f32(vld1q_f32(src + i))));
+	}
+#endif
 
-		input_samples = (airspyhf_complex_int16_t *) device->received_samples_queue[device->received_samples_queue_tail];
-		dropped_buffers = device->dropped_buffers_queue[device->received_samples_queue_tail];
-		device->received_samples_queue_tail = (device->received_samples_queue_tail + 1) & (RAW_BUFFER_COUNT - 1);
+	for (; i < count; i++)
+	{
+		dest[i] = float_to_half(src[i]);
+	}
+}
 
-		pthread_mutex_unlock(&device->consumer_mp);
+static float peak_magnitude(const float *src, int count)
+{
+	int i = 0;
+	float peak = 0.0f;
 
-		sample_count = device->buffer_size / sizeof(airspyhf_complex_int16_t);
+#if defined(USE_SSE2)
+	const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	__m128 peak4 = _mm_setzero_ps();
+	float lanes[4];
 
-		convert_samples(device, input_samples, device->output_buffer, sample_count);
+	for (; i + 4 <= count; i += 4)
+	{
+		peak4 = _mm_max_ps(peak4, _mm_and_ps(_mm_loadu_ps(src + i), abs_mask));
+	}
+	_mm_storeu_ps(lanes, peak4);
+	peak = MAX(MAX(lanes[0], lanes[1]), MAX(lanes[2], lanes[3]));
+#elif defined(USE_NEON_A64)
+	float32x4_t peak4 = vdupq_n_f32(0.0f);
 
-		transfer.device = device;
-		transfer.ctx = device->ctx;
-		transfer.samples = device->output_buffer;
-		transfer.sample_count = sample_count;
-		transfer.dropped_samples = (uint64_t) dropped_buffers * (uint64_t) sample_count;
+	for (; i + 4 <= count; i += 4)
+	{
+		peak4 = vmaxq_f32(peak4, vabsq_f32(vld1q_f32(src + i)));
+	}
+	peak = vmaxvq_f32(peak4);
+#endif
 
-		if (device->callback(&transfer) != 0)
-		{
-			device->streaming = false;
-		}
+	for (; i < count; i++)
+	{
+		peak = MAX(peak, fabsf(src[i]));
+	}
 
-		pthread_mutex_lock(&device->consumer_mp);
-		device->received_buffer_count--;
+	return peak;
+}
+
+static int convert_int8_block_scaled(const float *src, int8_t *dest, int count)
+{
+	// The block is scaled by a power of two that brings its peak just below full scale,
+	// so weak signals keep their resolution. Returns the exponent that restores the
+	// original amplitude: value = sample * 2^exponent
+	int i = 0;
+	int exponent;
+	long value;
+	float scale;
+
+	frexpf(peak_magnitude(src, count), &exponent);
+	scale = ldexpf(1.0f, 7 - exponent);
+
+#if defined(USE_SSE2)
+	const __m128 scale4 = _mm_set1_ps(scale);
+	__m128i lo;
+	__m128i hi;
+
+	for (; i + 16 <= count; i += 16)
+	{
+		lo = _mm_packs_epi32(
+			_mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(src + i), scale4)),
+			_mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(src + i + 4), scale4)));
+		hi = _mm_packs_epi32(
+			_mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(src + i + 8), scale4)),
+			_mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(src + i + 12), scale4)));
+		_mm_storeu_si128((__m128i *) (dest + i), _mm_packs_epi16(lo, hi));
 	}
+#elif defined(USE_NEON_A64)
+	int16x8_t lo;
+	int16x8_t hi;
 
-	device->streaming = false;
+	for (; i + 16 <= count; i += 16)
+	{
+		lo = vcombine_s16(
+			vqmovn_s32(vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(src + i), scale))),
+			vqmovn_s32(vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(src + i + 4), scale))));
+		hi = vcombine_s16(
+			vqmovn_s32(vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(src + i + 8), scale))),
+			vqmovn_s32(vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(src + i + 12), scale))));
+		vst1q_s8(dest + i, vcombine_s8(vqmovn_s16(lo), vqmovn_s16(hi)));
+	}
+#endif
 
-	pthread_mutex_unlock(&device->consumer_mp);
+	for (; i < count; i++)
+	{
+		value = lrintf(src[i] * scale);
+		dest[i] = (int8_t) MAX(-128, MIN(127, value));
+	}
 
-	return NULL;
+	return exponent - 7;
 }
 
-static void LIBUSB_CALL airspyhf_libusb_transfer_callback(struct libusb_transfer* usb_transfer)
+static void convert_int16(const float *src, int16_t *dest, int count)
 {
-	airspyhf_complex_int16_t *temp;
-	airspyhf_device_t* device = (airspyhf_device_t*) usb_transfer->user_data;
-	
-	device->transfer_live--;
-	if (!device->streaming || device->stop_requested)
+	// Fixed scale, full scale 1.0 maps to 32768 and out of range values saturate
+	const float scale = 32768.0f;
+
+	int i = 0;
+	long value;
+
+#if defined(USE_SSE2)
+	const __m128 scale4 = _mm_set1_ps(scale);
+
+	for (; i + 8 <= count; i += 8)
 	{
-		return;
+		_mm_storeu_si128((__m128i *) (dest + i), _mm_packs_epi32(
+			_mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(src + i), scale4)),
+			_mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(src + i + 4), scale4))));
+	}
+#elif defined(USE_NEON_A64)
+	for (; i + 8 <= count; i += 8)
+	{
+		vst1q_s16(dest + i, vcombine_s16(
+			vqmovn_s32(vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(src + i), scale))),
+			vqmovn_s32(vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(src + i + 4), scale)))));
 	}
+#endif
 
-	if (usb_transfer->status == LIBUSB_TRANSFER_COMPLETED && usb_transfer->actual_length == usb_transfer->length)
+	for (; i < count; i++)
 	{
-		pthread_mutex_lock(&device->consumer_mp);
+		value = lrintf(src[i] * scale);
+		dest[i] = (int16_t) MAX(-32768, MIN(32767, value));
+	}
+}
 
-		if (device->received_buffer_count < RAW_BUFFER_COUNT)
-		{
-			temp = device->received_samples_queue[device->received_samples_queue_head];
-			device->received_samples_queue[device->received_samples_queue_head] = (airspyhf_complex_int16_t *) usb_transfer->buffer;
-			usb_transfer->buffer = (uint8_t *) temp;
+static void pack_samples(airspyhf_device_t* device, airspyhf_transfer_t* transfer)
+{
+	transfer->samples = device->output_buffer;
+	transfer->scale_exponent = 0;
 
-			device->dropped_buffers_queue[device->received_samples_queue_head] = device->dropped_buffers;
-			device->dropped_buffers = 0;
-			
-			device->received_samples_queue_head = (device->received_samples_queue_head + 1) & (RAW_BUFFER_COUNT - 1);
-			device->received_buffer_count++;
+	switch (transfer->sample_type)
+	{
+	case AIRSPYHF_SAMPLE_FLOAT16_IQ:
+		convert_float16((float *) device->output_buffer, (uint16_t *) device->packed_buffer, transfer->sample_count * 2);
+		transfer->samples = (airspyhf_complex_float_t *) device->packed_buffer;
+		break;
+
+	case AIRSPYHF_SAMPLE_INT8_IQ:
+		transfer->scale_exponent = convert_int8_block_scaled((float *) device->output_buffer, (int8_t *) device->packed_buffer, transfer->sample_count * 2);
+		transfer->samples = (airspyhf_complex_float_t *) device->packed_buffer;
+		break;
+
+	case AIRSPYHF_SAMPLE_INT16_IQ:
+		convert_int16((float *) device->output_buffer, (int16_t *) device->packed_buffer, transfer->sample_count * 2);
+		transfer->samples = (airspyhf_complex_float_t *) device->packed_buffer;
+		transfer->scale_exponent = -15;
+		break;
+
+	default:
+		break;
+	}
+}
 
-			pthread_cond_signal(&device->consumer_cv);
-		}
-		else
+static bool squelch_update(airspyhf_device_t* device, float power, int sample_count)
+{
+	// Opens at the threshold, closes once the power stayed below threshold - hysteresis for the hang time
+
+	if (power >= device->squelch_open_level)
+	{
+		device->squelch_open = true;
+		device->squelch_hang_remaining = (uint64_t) device->squelch_hang_time_ms * device->current_samplerate / 1000;
+	}
+	else if (device->squelch_open)
+	{
+		if (power >= device->squelch_close_level)
 		{
-			device->dropped_buffers++;
+			device->squelch_hang_remaining = (uint64_t) device->squelch_hang_time_ms * device->current_samplerate / 1000;
 		}
-
-		pthread_mutex_unlock(&device->consumer_mp);
-
-		if (libusb_submit_transfer(usb_transfer) != 0)
+		else if (device->squelch_hang_remaining > (uint64_t) sample_count)
 		{
-			device->streaming = false;
+			device->squelch_hang_remaining -= sample_count;
 		}
 		else
-			device->transfer_live ++;
-	}
-	else
-	{
-		device->streaming = false;
+		{
+			device->squelch_hang_remaining = 0;
+			device->squelch_open = false;
+		}
 	}
+
+	return device->squelch_open;
 }
 
-static void* transfer_threadproc(void* arg)
+// Converts one raw buffer and hands it to the application
+static void consume_buffer(airspyhf_device_t* device, airspyhf_raw_sample_t* input_samples, uint32_t dropped_buffers, uint32_t flags)
 {
-	airspyhf_device_t* device = (struct  airspyhf_device*) arg;
-	int error;
-	struct timeval timeout = { 0, 500000 };
+	int sample_count;
+	float power;
+	airspyhf_transfer_t transfer;
+	uint64_t sample_index;
+	bool squelch_enabled;
 
-#ifdef _WIN32
+	sample_count = device->buffer_size / sizeof(airspyhf_raw_sample_t);
 
-	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+	device->sample_index += (uint64_t) dropped_buffers * (uint64_t) sample_count;
+	sample_index = device->sample_index;
+	device->sample_index += sample_count;
 
-#endif
+	// Read once, the power is only measured when the squelch is on
+	squelch_enabled = device->squelch_enabled;
+	power = convert_samples(device, input_samples, device->output_buffer, sample_count, squelch_enabled);
 
-	while (device->streaming && !device->stop_requested)
+	// A host side retune applies from the first block converted with the new offset.
+	// While the LO moves, the offset changes on stale blocks, the LO marker comes later.
+	if (device->nco_retuned)
 	{
-		error = libusb_handle_events_timeout_completed(device->usb_context, &timeout, NULL);
-		if (error < 0)
+		device->nco_retuned = false;
+		if (!device->retune_pending)
 		{
-			if (error != LIBUSB_ERROR_INTERRUPTED)
-				device->streaming = false;
+			flags |= AIRSPYHF_TRANSFER_FLAG_RETUNE;
 		}
 	}
 
-	device->streaming = false;
+	if (squelch_enabled && !squelch_update(device, power, sample_count))
+	{
+		device->gated_samples += sample_count;
+		device->gated_dropped_samples += (uint64_t) dropped_buffers * (uint64_t) sample_count;
+		device->gated_flags |= flags;
+	}
+	else
+	{
+		transfer.device = device;
+		transfer.ctx = device->ctx;
+		transfer.sample_count = sample_count;
+		transfer.dropped_samples = (uint64_t) dropped_buffers * (uint64_t) sample_count + device->gated_dropped_samples;
+		transfer.sample_type = device->sample_type;
+		transfer.gated_samples = device->gated_samples;
+		transfer.flags = flags | device->gated_flags;
+		transfer.sample_index = sample_index;
+
+		device->gated_samples = 0;
+		device->gated_dropped_samples = 0;
+		device->gated_flags = 0;
 
-	return NULL;
+		pack_samples(device, &transfer);
+
+		if (device->callback(&transfer) != 0)
+		{
+			device->streaming = false;
+		}
+	}
 }
 
-static int kill_io_threads(airspyhf_device_t* device)
+// Zero fields leave the matching setting alone
+static int apply_thread_policy(pthread_t thread, const airspyhf_thread_policy_t* policy)
 {
-	struct timeval timeout = { 0, 0 };
+#if defined(__linux__) && !defined(__ANDROID__)
+	struct sched_param param;
+	cpu_set_t cpus;
+	int cpu;
+	int result = AIRSPYHF_SUCCESS;
 
-	if (device->stop_requested)
+	if (policy->policy != AIRSPYHF_SCHED_DEFAULT)
 	{
-		device->stop_requested = false;
-		device->streaming = false;
-		cancel_transfers(device);
-
-		pthread_mutex_lock(&device->consumer_mp);
-		pthread_cond_signal(&device->consumer_cv);
-		pthread_mutex_unlock(&device->consumer_mp);
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = policy->priority;
+		if (pthread_setschedparam(thread, policy->policy == AIRSPYHF_SCHED_RR ? SCHED_RR : SCHED_FIFO, &param) != 0)
+		{
+			result = AIRSPYHF_ERROR;
+		}
+	}
 
-		if (device->transfer_thread_running) {
-			pthread_join(device->transfer_thread, NULL);
-			device->transfer_thread_running = false;
+	if (policy->cpu_mask != 0)
+	{
+		CPU_ZERO(&cpus);
+		for (cpu = 0; cpu < 64; cpu++)
+		{
+			if (policy->cpu_mask & ((uint64_t) 1 << cpu))
+			{
+				CPU_SET(cpu, &cpus);
+			}
 		}
-		if (device->consumer_thread_running) {
-			pthread_join(device->consumer_thread, NULL);
-			device->consumer_thread_running = false;
+		if (pthread_setaffinity_np(thread, sizeof(cpus), &cpus) != 0)
+		{
+			result = AIRSPYHF_ERROR;
 		}
+	}
 
-		libusb_handle_events_timeout_completed(device->usb_context, &timeout, NULL);
+	if (policy->name[0] != 0 && pthread_setname_np(thread, policy->name) != 0)
+	{
+		result = AIRSPYHF_ERROR;
 	}
 
-	return AIRSPYHF_SUCCESS;
+	return result;
+#else
+	return policy->policy == AIRSPYHF_SCHED_DEFAULT && policy->cpu_mask == 0 && policy->name[0] == 0 ? AIRSPYHF_SUCCESS : AIRSPYHF_ERROR;
+#endif
 }
 
-static int create_io_threads(airspyhf_device_t* device, airspyhf_sample_block_cb_fn callback)
+// Between two streaming sessions the I/O threads wait here instead of exiting, so a start
+// only has to resubmit the transfers. Called with consumer_mp held, false once the device closes.
+static bool park_io_thread(airspyhf_device_t* device, bool* parked)
 {
-	int result;
-	pthread_attr_t attr;
+	*parked = true;
+	pthread_cond_broadcast(&device->io_cv);
 
-	if (!device->streaming && !device->stop_requested)
+	while (!device->io_threads_exit && !(device->streaming && !device->stop_requested))
 	{
-		device->callback = callback;
-		device->streaming = true;
+		pthread_cond_wait(&device->io_cv, &device->consumer_mp);
+	}
 
-		result = prepare_transfers(device, LIBUSB_ENDPOINT_IN | AIRSPYHF_ENDPOINT_IN, (libusb_transfer_cb_fn)airspyhf_libusb_transfer_callback);
-		if (result != AIRSPYHF_SUCCESS)
-		{
-			return result;
+	*parked = false;
+	return !device->io_threads_exit;
+}
+
+static void* consumer_threadproc(void *arg)
+{
+	airspyhf_raw_sample_t *input_samples;
+	uint32_t dropped_buffers;
+	uint32_t flags;
+	airspyhf_device_t* device = (airspyhf_device_t*) arg;
+
+#ifdef _WIN32
+
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+
+#endif
+
+	apply_thread_policy(pthread_self(), &device->thread_policy[AIRSPYHF_THREAD_CONSUMER]);
+
+	pthread_mutex_lock(&device->consumer_mp);
+
+	do
+	{
+		while (device->streaming && !device->stop_requested)
+		{
+			while (device->received_buffer_count == 0 && device->streaming && !device->stop_requested)
+			{
+				pthread_cond_wait(&device->consumer_cv, &device->consumer_mp);
+			}
+			if (!device->streaming || device->stop_requested)
+			{
+				break;
+			}
+
+			input_samples = (airspyhf_raw_sample_t *) device->received_samples_queue[device->received_samples_queue_tail];
+			dropped_buffers = device->dropped_buffers_queue[device->received_samples_queue_tail];
+			flags = device->transfer_flags_queue[device->received_samples_queue_tail];
+			device->received_samples_queue_tail = (device->received_samples_queue_tail + 1) & (RAW_BUFFER_COUNT - 1);
+
+			pthread_mutex_unlock(&device->consumer_mp);
+
+			consume_buffer(device, input_samples, dropped_buffers, flags);
+
+			pthread_mutex_lock(&device->consumer_mp);
+			device->received_buffer_count--;
+		}
+
+		device->streaming = false;
+	} while (park_io_thread(device, &device->consumer_thread_parked));
+
+	pthread_mutex_unlock(&device->consumer_mp);
+
+	return NULL;
+}
+
+static void hub_schedule(airspyhf_hub_t* hub, airspyhf_device_t* device)
+{
+	pthread_mutex_lock(&hub->mp);
+	if (!device->hub_queued)
+	{
+		device->hub_queued = true;
+		device->hub_next = NULL;
+		if (hub->ready_tail != NULL)
+		{
+			hub->ready_tail->hub_next = device;
+		}
+		else
+		{
+			hub->ready_head = device;
+		}
+		hub->ready_tail = device;
+		pthread_cond_signal(&hub->ready_cv);
+	}
+	pthread_mutex_unlock(&hub->mp);
+}
+
+// Pool thread: takes one buffer from the device at the head of the ready list, then
+// puts the device back at the tail if it has more, so busy devices take turns
+static void* hub_consumer_threadproc(void *arg)
+{
+	airspyhf_hub_t* hub = (airspyhf_hub_t*) arg;
+	airspyhf_device_t* device;
+	airspyhf_raw_sample_t *input_samples;
+	uint32_t dropped_buffers;
+	uint32_t flags;
+	bool pending;
+
+#ifdef _WIN32
+
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+
+#endif
+
+	pthread_mutex_lock(&hub->mp);
+
+	while (!hub->exit_requested)
+	{
+		device = hub->ready_head;
+		if (device == NULL)
+		{
+			pthread_cond_wait(&hub->ready_cv, &hub->mp);
+			continue;
+		}
+		hub->ready_head = device->hub_next;
+		if (hub->ready_head == NULL)
+		{
+			hub->ready_tail = NULL;
+		}
+
+		pthread_mutex_unlock(&hub->mp);
+
+		if (device->streaming && !device->stop_requested)
+		{
+			pthread_mutex_lock(&device->consumer_mp);
+			input_samples = (airspyhf_raw_sample_t *) device->received_samples_queue[device->received_samples_queue_tail];
+			dropped_buffers = device->dropped_buffers_queue[device->received_samples_queue_tail];
+			flags = device->transfer_flags_queue[device->received_samples_queue_tail];
+			device->received_samples_queue_tail = (device->received_samples_queue_tail + 1) & (RAW_BUFFER_COUNT - 1);
+			pthread_mutex_unlock(&device->consumer_mp);
+
+			consume_buffer(device, input_samples, dropped_buffers, flags);
+
+			pthread_mutex_lock(&device->consumer_mp);
+			device->received_buffer_count--;
+			pthread_mutex_unlock(&device->consumer_mp);
+		}
+
+		pthread_mutex_lock(&hub->mp);
+
+		// The USB callback doesn't queue the device again until hub_queued is cleared,
+		// it bumps the buffer count before taking the hub mutex so no buffer is missed
+		pthread_mutex_lock(&device->consumer_mp);
+		pending = device->received_buffer_count > 0 && device->streaming && !device->stop_requested;
+		pthread_mutex_unlock(&device->consumer_mp);
+
+		if (pending)
+		{
+			device->hub_next = NULL;
+			if (hub->ready_tail != NULL)
+			{
+				hub->ready_tail->hub_next = device;
+			}
+			else
+			{
+				hub->ready_head = device;
+			}
+			hub->ready_tail = device;
+		}
+		else
+		{
+			device->hub_queued = false;
+			pthread_cond_broadcast(&hub->idle_cv);
+		}
+	}
+
+	pthread_mutex_unlock(&hub->mp);
+
+	return NULL;
+}
+
+static uint64_t monotonic_us(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER counter;
+	LARGE_INTEGER frequency;
+
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (uint64_t) (counter.QuadPart / frequency.QuadPart) * 1000000 + (uint64_t) (counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
+
+// Called with consumer_mp held for every completed transfer. The in-flight transfers are what
+// covers the event thread being late, so the depth grows when the worst completion delay of a
+// window eats half of that margin and shrinks back slowly once it stays well within it.
+// A busy consumer queue means a loaded host, the depth is not lowered then.
+static void transfer_depth_update(airspyhf_device_t* device)
+{
+	uint64_t now = monotonic_us();
+	uint32_t period_us;
+	uint32_t margin_us;
+	uint32_t jitter_us;
+	uint32_t depth;
+
+	if (device->last_completion_us != 0)
+	{
+		device->window_max_gap_us = (uint32_t) MAX(device->window_max_gap_us, MIN(now - device->last_completion_us, UINT32_MAX));
+	}
+	device->last_completion_us = now;
+	device->window_queue_peak = MAX(device->window_queue_peak, (uint32_t) device->received_buffer_count);
+
+	if (++device->window_completions < DEPTH_WINDOW || device->current_samplerate == 0)
+	{
+		return;
+	}
+
+	period_us = (uint32_t) ((uint64_t) (device->buffer_size / sizeof(airspyhf_raw_sample_t)) * 1000000 / device->current_samplerate);
+	jitter_us = device->window_max_gap_us > period_us ? device->window_max_gap_us - period_us : 0;
+	depth = device->transfer_depth;
+	margin_us = depth * period_us;
+
+	if (jitter_us * 2 > margin_us && depth < device->transfer_depth_max)
+	{
+		depth = MIN(device->transfer_depth_max, depth + MAX(depth / 4, 1));
+		device->calm_windows = 0;
+	}
+	else if (jitter_us * 4 < margin_us && depth > device->transfer_depth_min && device->window_queue_peak <= RAW_BUFFER_COUNT / 2)
+	{
+		if (++device->calm_windows >= DEPTH_SHRINK_WINDOWS)
+		{
+			depth--;
+			device->calm_windows = 0;
+		}
+	}
+	else
+	{
+		device->calm_windows = 0;
+	}
+
+	device->transfer_depth = depth;
+	device->completion_jitter_us = jitter_us;
+	device->queue_peak = device->window_queue_peak;
+
+	device->window_completions = 0;
+	device->window_max_gap_us = 0;
+	device->window_queue_peak = 0;
+}
+
+// Called once the receiver acknowledged a new LO. Every transfer in flight at that point may hold
+// samples from the previous frequency, some more are still in the receiver FIFO. The bound errs
+// on the late side: the flagged block may not be the first one at the new frequency.
+static void retune_mark_lo(airspyhf_device_t* device)
+{
+	pthread_mutex_lock(&device->consumer_mp);
+	device->retune_transfer = device->completed_transfers + device->transfer_live + 1 + RETUNE_FIFO_TRANSFERS;
+	device->retune_pending = device->streaming;
+	pthread_mutex_unlock(&device->consumer_mp);
+}
+
+// The transfer thread takes over when auto recovery is on
+static void stream_failed(airspyhf_device_t* device)
+{
+	if (device->auto_recovery)
+	{
+		device->device_lost = true;
+	}
+	else
+	{
+		device->streaming = false;
+	}
+}
+
+static void LIBUSB_CALL airspyhf_libusb_transfer_callback(struct libusb_transfer* usb_transfer)
+{
+	airspyhf_raw_sample_t *temp;
+	struct libusb_transfer* temp_transfer;
+	airspyhf_device_t* device = (airspyhf_device_t*) usb_transfer->user_data;
+	bool queued = false;
+
+	pthread_mutex_lock(&device->consumer_mp);
+
+	// A stop waits for the cancelled transfers to call back before the device can go away
+	transfer_released(device);
+	if (!device->streaming || device->stop_requested || device->device_lost)
+	{
+		pthread_mutex_unlock(&device->consumer_mp);
+		return;
+	}
+
+	if (usb_transfer->status == LIBUSB_TRANSFER_COMPLETED && usb_transfer->actual_length == usb_transfer->length)
+	{
+		device->completed_transfers++;
+		transfer_depth_update(device);
+		if (device->retune_pending && device->completed_transfers >= device->retune_transfer)
+		{
+			device->retune_pending = false;
+			device->transfer_flags |= AIRSPYHF_TRANSFER_FLAG_RETUNE;
+		}
+
+		if (device->received_buffer_count < RAW_BUFFER_COUNT)
+		{
+			temp = device->received_samples_queue[device->received_samples_queue_head];
+			device->received_samples_queue[device->received_samples_queue_head] = (airspyhf_raw_sample_t *) usb_transfer->buffer;
+			usb_transfer->buffer = (uint8_t *) temp;
+
+			device->dropped_buffers_queue[device->received_samples_queue_head] = device->dropped_buffers;
+			device->dropped_buffers = 0;
+			device->transfer_flags_queue[device->received_samples_queue_head] = device->transfer_flags;
+			device->transfer_flags = 0;
+			
+			device->received_samples_queue_head = (device->received_samples_queue_head + 1) & (RAW_BUFFER_COUNT - 1);
+			device->received_buffer_count++;
+			queued = true;
+
+			pthread_cond_signal(&device->consumer_cv);
+		}
+		else
+		{
+			device->dropped_buffers++;
+			device->total_dropped_buffers++;
+		}
+
+		pthread_mutex_unlock(&device->consumer_mp);
+
+		if (queued && device->hub != NULL)
+		{
+			hub_schedule(device->hub, device);
+		}
+
+		pthread_mutex_lock(&device->consumer_mp);
+
+		// Growing puts parked transfers back in flight, shrinking parks this one
+		while (device->idle_transfer_count > 0 && device->transfer_live + 1 < (int32_t) device->transfer_depth)
+		{
+			temp_transfer = device->idle_transfers[device->idle_transfer_count - 1];
+			device->transfer_live++;
+			if (libusb_submit_transfer(temp_transfer) != 0)
+			{
+				transfer_released(device);
+				break;
+			}
+			device->idle_transfer_count--;
+		}
+
+		if (device->transfer_live >= (int32_t) device->transfer_depth)
+		{
+			device->idle_transfers[device->idle_transfer_count++] = usb_transfer;
+		}
+		else
+		{
+			device->transfer_live++;
+			if (libusb_submit_transfer(usb_transfer) != 0)
+			{
+				transfer_released(device);
+				stream_failed(device);
+			}
+		}
+	}
+	else
+	{
+		stream_failed(device);
+	}
+
+	pthread_mutex_unlock(&device->consumer_mp);
+}
+
+static void airspyhf_open_device(airspyhf_device_t* device, int* ret, uint16_t vid, uint16_t pid, uint64_t serial_number_val);
+int ADDCALL airspyhf_set_receiver_mode(airspyhf_device_t* device, receiver_mode_t value);
+
+// The transfer thread swaps the handle when the receiver is reattached, the application
+// may be calling these at the same time.
+static int device_control_transfer(airspyhf_device_t* device, uint8_t request_type, uint8_t request, uint16_t value, uint16_t index, unsigned char* data, uint16_t length, unsigned int timeout)
+{
+	int result;
+
+	pthread_mutex_lock(&device->handle_mp);
+	result = libusb_control_transfer(device->usb_device, request_type, request, value, index, data, length, timeout);
+	pthread_mutex_unlock(&device->handle_mp);
+
+	return result;
+}
+
+static int device_clear_halt(airspyhf_device_t* device, unsigned char endpoint)
+{
+	int result;
+
+	pthread_mutex_lock(&device->handle_mp);
+	result = libusb_clear_halt(device->usb_device, endpoint);
+	pthread_mutex_unlock(&device->handle_mp);
+
+	return result;
+}
+
+static void remember_setting(airspyhf_device_t* device, uint8_t request, uint16_t value)
+{
+	switch (request)
+	{
+	case AIRSPYHF_SET_ATT:
+		device->att_index = value;
+		break;
+	case AIRSPYHF_SET_AGC:
+		device->hf_agc = value;
+		break;
+	case AIRSPYHF_SET_AGC_THRESHOLD:
+		device->hf_agc_threshold = value;
+		break;
+	case AIRSPYHF_SET_LNA:
+		device->hf_lna = value;
+		break;
+	case AIRSPYHF_SET_BIAS_TEE:
+		device->bias_tee = value;
+		break;
+	default:
+		break;
+	}
+}
+
+static void replay_setting(airspyhf_device_t* device, uint8_t request, int32_t value)
+{
+	if (value >= 0)
+	{
+		device_control_transfer(
+			device,
+			LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+			request,
+			(uint16_t) value,
+			0,
+			NULL,
+			0,
+			LIBUSB_CTRL_TIMEOUT_MS);
+	}
+}
+
+// Puts a reattached receiver back in the state the application left it in.
+// The IQ balancer, NCO and squelch live on the host and carry over as is.
+static int restore_device_state(airspyhf_device_t* device)
+{
+	if (airspyhf_set_receiver_mode(device, RECEIVER_MODE_OFF) != AIRSPYHF_SUCCESS)
+	{
+		return AIRSPYHF_ERROR;
+	}
+
+	if (device->vctcxo_applied)
+	{
+		airspyhf_set_vctcxo_calibration(device, (uint16_t) device->calibration_vctcxo);
+	}
+	if (device->frontend_options_applied)
+	{
+		airspyhf_set_frontend_options(device, device->frontend_options);
+	}
+
+	// Also retunes, the LO is sent again since the device lost it
+	device->freq_khz = 0;
+	if (airspyhf_set_samplerate(device, device->current_samplerate) != AIRSPYHF_SUCCESS)
+	{
+		return AIRSPYHF_ERROR;
+	}
+
+	replay_setting(device, AIRSPYHF_SET_ATT, device->att_index);
+	replay_setting(device, AIRSPYHF_SET_AGC, device->hf_agc);
+	replay_setting(device, AIRSPYHF_SET_AGC_THRESHOLD, device->hf_agc_threshold);
+	replay_setting(device, AIRSPYHF_SET_LNA, device->hf_lna);
+	replay_setting(device, AIRSPYHF_SET_BIAS_TEE, device->bias_tee);
+
+	device_clear_halt(device, LIBUSB_ENDPOINT_IN | AIRSPYHF_ENDPOINT_IN);
+
+	return airspyhf_set_receiver_mode(device, RECEIVER_MODE_ON);
+}
+
+static bool command_on_handle(airspyhf_device_t* device, libusb_device_handle* handle)
+{
+	bool result;
+
+	pthread_mutex_lock(&device->handle_mp);
+	result = device->command_busy && device->command_transfer->dev_handle == handle;
+	pthread_mutex_unlock(&device->handle_mp);
+
+	return result;
+}
+
+// Only wakes the event loop so the reattach is attempted right away
+static int LIBUSB_CALL hotplug_arrived_callback(libusb_context* context, libusb_device* usb_device, libusb_hotplug_event event, void* user_data)
+{
+	(void) context;
+	(void) usb_device;
+	(void) event;
+	(void) user_data;
+	return 0;
+}
+
+// Runs on the transfer thread once the stream failed: waits for the receiver with the same
+// serial number to show up again, swaps the handle and resumes the transfers. The old handle
+// stays open meanwhile so the application can keep calling the API, it just gets errors.
+static int recover_device(airspyhf_device_t* device)
+{
+	airspyhf_device_t reattached;
+	libusb_device_handle* lost_handle = device->usb_device;
+	struct timeval timeout = { 0, 250000 };
+	struct timeval drain = { 0, 10000 };
+	uint32_t transfer_index;
+	int result = AIRSPYHF_ERROR;
+	int tries;
+
+	cancel_transfers(device);
+	for (tries = 0; device->transfer_live > 0 && tries < 100; tries++)
+	{
+		libusb_handle_events_timeout_completed(device->usb_context, &drain, NULL);
+	}
+	if (device->transfer_live > 0)
+	{
+		return AIRSPYHF_ERROR;
+	}
+
+	// Frees the interface in case the receiver only glitched and is still there
+	libusb_release_interface(lost_handle, 0);
+
+	while (device->streaming && !device->stop_requested)
+	{
+		memset(&reattached, 0, sizeof(reattached));
+		reattached.usb_context = device->usb_context;
+		airspyhf_open_device(&reattached, &result, airspyhf_usb_vid, airspyhf_usb_pid, device->serial_number);
+		if (result == AIRSPYHF_SUCCESS)
+		{
+			break;
+		}
+
+		// Returns early on a hotplug arrival
+		libusb_handle_events_timeout_completed(device->usb_context, &timeout, NULL);
+	}
+
+	if (result != AIRSPYHF_SUCCESS)
+	{
+		return AIRSPYHF_ERROR;
+	}
+
+	// Waits for a control transfer of the application still using the lost handle
+	pthread_mutex_lock(&device->handle_mp);
+	device->usb_device = reattached.usb_device;
+	pthread_mutex_unlock(&device->handle_mp);
+
+	// A command submitted before the swap has to complete before the handle goes away
+	while (command_on_handle(device, lost_handle))
+	{
+		libusb_cancel_transfer(device->command_transfer);
+		libusb_handle_events_timeout_completed(device->usb_context, &drain, NULL);
+	}
+	libusb_close(lost_handle);
+
+	for (transfer_index = 0; transfer_index < device->transfer_count; transfer_index++)
+	{
+		device->transfers[transfer_index]->dev_handle = device->usb_device;
+	}
+
+	if (restore_device_state(device) != AIRSPYHF_SUCCESS)
+	{
+		return AIRSPYHF_ERROR;
+	}
+
+	device->device_lost = false;
+
+	pthread_mutex_lock(&device->consumer_mp);
+	device->retune_pending = false;
+	device->transfer_flags |= AIRSPYHF_TRANSFER_FLAG_GAP;
+	pthread_mutex_unlock(&device->consumer_mp);
+
+	return prepare_transfers(device, LIBUSB_ENDPOINT_IN | AIRSPYHF_ENDPOINT_IN, (libusb_transfer_cb_fn)airspyhf_libusb_transfer_callback);
+}
+
+static void* transfer_threadproc(void* arg)
+{
+	airspyhf_device_t* device = (struct  airspyhf_device*) arg;
+	int error;
+	struct timeval timeout = { 0, 500000 };
+
+#ifdef _WIN32
+
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+
+#endif
+
+	apply_thread_policy(pthread_self(), &device->thread_policy[AIRSPYHF_THREAD_TRANSFER]);
+
+	pthread_mutex_lock(&device->consumer_mp);
+
+	do
+	{
+		pthread_mutex_unlock(&device->consumer_mp);
+
+		while (device->streaming && !device->stop_requested)
+		{
+			error = libusb_handle_events_timeout_completed(device->usb_context, &timeout, NULL);
+			if (error < 0)
+			{
+				if (error != LIBUSB_ERROR_INTERRUPTED)
+					device->streaming = false;
+			}
+
+			if (device->device_lost && recover_device(device) != AIRSPYHF_SUCCESS)
+			{
+				device->streaming = false;
+			}
+		}
+
+		device->streaming = false;
+
+		// Nothing runs the event loop while parked, the queued commands would never complete
+		command_drain(device);
+
+		pthread_mutex_lock(&device->consumer_mp);
+	} while (park_io_thread(device, &device->transfer_thread_parked));
+
+	pthread_mutex_unlock(&device->consumer_mp);
+
+	return NULL;
+}
+
+static void* hub_event_threadproc(void* arg)
+{
+	airspyhf_hub_t* hub = (airspyhf_hub_t*) arg;
+	struct timeval timeout = { 0, 500000 };
+
+#ifdef _WIN32
+
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+
+#endif
+
+	// Errors are per transfer here, each device stops on its own in its transfer callback
+	while (!hub->exit_requested)
+	{
+		libusb_handle_events_timeout_completed(hub->usb_context, &timeout, NULL);
+	}
+
+	return NULL;
+}
+
+// A cancelled transfer still calls back, neither the next start nor airspyhf_close() may touch
+// the transfers before. The hub event thread reaps them for a hub device.
+static void wait_transfers_released(airspyhf_device_t* device)
+{
+	struct timeval timeout = { 0, 10000 };
+
+	pthread_mutex_lock(&device->consumer_mp);
+	while (device->transfer_live > 0)
+	{
+		if (device->hub != NULL)
+		{
+			pthread_cond_wait(&device->io_cv, &device->consumer_mp);
+		}
+		else
+		{
+			pthread_mutex_unlock(&device->consumer_mp);
+			libusb_handle_events_timeout_completed(device->usb_context, &timeout, NULL);
+			pthread_mutex_lock(&device->consumer_mp);
+		}
+	}
+	pthread_mutex_unlock(&device->consumer_mp);
+}
+
+static int kill_io_threads(airspyhf_device_t* device)
+{
+	if (device->stop_requested)
+	{
+		device->stop_requested = false;
+		device->streaming = false;
+		cancel_transfers(device);
+
+		pthread_mutex_lock(&device->consumer_mp);
+		pthread_cond_signal(&device->consumer_cv);
+		pthread_mutex_unlock(&device->consumer_mp);
+
+		if (device->hub != NULL)
+		{
+			// Wait for the pool to let go of the device
+			pthread_mutex_lock(&device->hub->mp);
+			while (device->hub_queued)
+			{
+				pthread_cond_wait(&device->hub->idle_cv, &device->hub->mp);
+			}
+			pthread_mutex_unlock(&device->hub->mp);
+		}
+
+#ifndef _WIN32
+		libusb_interrupt_event_handler(device->usb_context);
+#endif
+
+		// The threads are kept for the next start, see exit_io_threads()
+		pthread_mutex_lock(&device->consumer_mp);
+		while ((device->transfer_thread_running && !device->transfer_thread_parked) ||
+			(device->consumer_thread_running && !device->consumer_thread_parked))
+		{
+			pthread_cond_wait(&device->io_cv, &device->consumer_mp);
+		}
+		pthread_mutex_unlock(&device->consumer_mp);
+
+		wait_transfers_released(device);
+	}
+
+	return AIRSPYHF_SUCCESS;
+}
+
+static void exit_io_threads(airspyhf_device_t* device)
+{
+	pthread_mutex_lock(&device->consumer_mp);
+	device->io_threads_exit = true;
+	pthread_cond_broadcast(&device->io_cv);
+	pthread_cond_signal(&device->consumer_cv);
+	pthread_mutex_unlock(&device->consumer_mp);
+
+	if (device->transfer_thread_running) {
+		pthread_join(device->transfer_thread, NULL);
+		device->transfer_thread_running = false;
+	}
+	if (device->consumer_thread_running) {
+		pthread_join(device->consumer_thread, NULL);
+		device->consumer_thread_running = false;
+	}
+}
+
+static int create_io_threads(airspyhf_device_t* device, airspyhf_sample_block_cb_fn callback)
+{
+	int result;
+	pthread_attr_t attr;
+
+	if (!device->streaming && !device->stop_requested)
+	{
+		device->callback = callback;
+
+		// airspyhf_stop() leaves nothing in flight, a session that ended on its own may have.
+		// Submitting a transfer before its cancellation was reaped fails with LIBUSB_ERROR_BUSY.
+		if (device->transfer_live > 0)
+		{
+			cancel_transfers(device);
+			wait_transfers_released(device);
 		}
 
+		pthread_mutex_lock(&device->consumer_mp);
 		device->received_samples_queue_head = 0;
 		device->received_samples_queue_tail = 0;
 		device->received_buffer_count = 0;
+		device->streaming = true;
+		pthread_mutex_unlock(&device->consumer_mp);
+
+		result = prepare_transfers(device, LIBUSB_ENDPOINT_IN | AIRSPYHF_ENDPOINT_IN, (libusb_transfer_cb_fn)airspyhf_libusb_transfer_callback);
+		if (result != AIRSPYHF_SUCCESS)
+		{
+			return result;
+		}
+
+		if (device->hub != NULL)
+		{
+			// The hub event thread and consumer pool take it from here
+			return AIRSPYHF_SUCCESS;
+		}
+
+		if (device->transfer_thread_running && device->consumer_thread_running)
+		{
+			// Parked since the previous session
+			pthread_mutex_lock(&device->consumer_mp);
+			pthread_cond_broadcast(&device->io_cv);
+			pthread_mutex_unlock(&device->consumer_mp);
+			return AIRSPYHF_SUCCESS;
+		}
 
 		pthread_attr_init(&attr);
 		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
 
-		result = pthread_create(&device->consumer_thread, &attr, consumer_threadproc, device);
-		if (result != 0)
+		if (!device->consumer_thread_running)
 		{
-			return AIRSPYHF_ERROR;
+			result = pthread_create(&device->consumer_thread, &attr, consumer_threadproc, device);
+			if (result != 0)
+			{
+				return AIRSPYHF_ERROR;
+			}
+			device->consumer_thread_running = true;
 		}
-		device->consumer_thread_running = true;
 
-		result = pthread_create(&device->transfer_thread, &attr, transfer_threadproc, device);
-		if (result != 0)
+		if (!device->transfer_thread_running)
 		{
-			return AIRSPYHF_ERROR;
+			result = pthread_create(&device->transfer_thread, &attr, transfer_threadproc, device);
+			if (result != 0)
+			{
+				return AIRSPYHF_ERROR;
+			}
+			device->transfer_thread_running = true;
 		}
-		device->transfer_thread_running = true;
 
 		pthread_attr_destroy(&attr);
 	}
@@ -578,16 +1763,20 @@ static void airspyhf_open_exit(airspyhf_device_t* device)
 		libusb_close(device->usb_device);
 		device->usb_device = NULL;
 	}
-	libusb_exit(device->usb_context);
+	if (device->hub == NULL)
+	{
+		libusb_exit(device->usb_context);
+	}
 	device->usb_context = NULL;
+	pthread_mutex_destroy(&device->handle_mp);
 }
 
 static int airspyhf_read_samplerates_from_fw(airspyhf_device_t* device, uint32_t* buffer, const uint32_t len)
 {
 	int result;
 
-	result = libusb_control_transfer(
-		device->usb_device,
+	result = device_control_transfer(
+		device,
 		LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
 		AIRSPYHF_GET_SAMPLERATES,
 		0,
@@ -607,8 +1796,8 @@ static int airspyhf_read_att_steps_from_fw(airspyhf_device_t* device, void* buff
 {
 	int result;
 
-	result = libusb_control_transfer(
-		device->usb_device,
+	result = device_control_transfer(
+		device,
 		LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
 		AIRSPYHF_GET_ATT_STEPS,
 		0,
@@ -628,8 +1817,8 @@ static int airspyhf_read_samplerate_architectures_from_fw(airspyhf_device_t* dev
 {
 	int result;
 
-	result = libusb_control_transfer(
-		device->usb_device,
+	result = device_control_transfer(
+		device,
 		LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
 		AIRSPYHF_GET_SAMPLERATE_ARCHITECTURES,
 		0,
@@ -646,6 +1835,94 @@ static int airspyhf_read_samplerate_architectures_from_fw(airspyhf_device_t* dev
 	return AIRSPYHF_SUCCESS;
 }
 
+// Enumeration reuses one context for the lifetime of the process
+static libusb_context* enumeration_context = NULL;
+static pthread_mutex_t enumeration_mp = PTHREAD_MUTEX_INITIALIZER;
+
+static libusb_context* airspyhf_enumeration_context(void)
+{
+	pthread_mutex_lock(&enumeration_mp);
+	if (enumeration_context == NULL)
+	{
+#ifdef __ANDROID__
+		// LibUSB does not support device discovery on android
+		libusb_set_option(NULL, LIBUSB_OPTION_NO_DEVICE_DISCOVERY, NULL);
+#endif
+
+		if (libusb_init(&enumeration_context) != 0)
+		{
+			enumeration_context = NULL;
+		}
+	}
+	pthread_mutex_unlock(&enumeration_mp);
+
+	return enumeration_context;
+}
+
+// Parses the "AIRSPYHF SN:" serial number string descriptor
+static bool airspyhf_parse_serial(const unsigned char* serial_number, int length, uint64_t* serial)
+{
+	char buffer[AIRSPYHF_SERIAL_SIZE + 1];
+	char *start, *end;
+
+	if (length != AIRSPYHF_SERIAL_SIZE || memcmp(str_prefix_serial_airspyhf, serial_number, STR_PREFIX_SERIAL_AIRSPYHF_SIZE))
+	{
+		return false;
+	}
+
+	memcpy(buffer, serial_number, AIRSPYHF_SERIAL_SIZE);
+	buffer[AIRSPYHF_SERIAL_SIZE] = 0;
+	start = buffer + STR_PREFIX_SERIAL_AIRSPYHF_SIZE;
+	end = NULL;
+	*serial = strtoull(start, &end, 16);
+
+	return !(*serial == 0 && start == end);
+}
+
+// The kernel keeps the serial string read at enumeration, so the device doesn't need to be opened
+static bool airspyhf_read_sysfs_serial(libusb_device* dev, uint64_t* serial)
+{
+#if defined(__linux__) && !defined(__ANDROID__)
+	uint8_t ports[8];
+	char path[128];
+	unsigned char serial_number[AIRSPYHF_SERIAL_SIZE + 2];
+	FILE* file;
+	int port_count;
+	int length;
+
+	port_count = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	if (port_count <= 0)
+	{
+		return false;
+	}
+
+	length = snprintf(path, sizeof(path), "/sys/bus/usb/devices/%u-%u", libusb_get_bus_number(dev), ports[0]);
+	for (int i = 1; i < port_count; i++)
+	{
+		length += snprintf(path + length, sizeof(path) - length, ".%u", ports[i]);
+	}
+	snprintf(path + length, sizeof(path) - length, "/serial");
+
+	file = fopen(path, "r");
+	if (file == NULL)
+	{
+		return false;
+	}
+	length = (int) fread(serial_number, 1, sizeof(serial_number), file);
+	fclose(file);
+
+	while (length > 0 && (serial_number[length - 1] == '\n' || serial_number[length - 1] == 0))
+	{
+		length--;
+	}
+
+	return airspyhf_parse_serial(serial_number, length, serial);
+#else
+	(void) dev;
+	(void) serial;
+	return false;
+#endif
+}
 
 static void airspyhf_open_device(airspyhf_device_t* device,
 	int* ret,
@@ -686,6 +1963,14 @@ static void airspyhf_open_device(airspyhf_device_t* device,
 		{
 			if (serial_number_val != SERIAL_NUMBER_UNUSED)
 			{
+				uint64_t sysfs_serial;
+
+				// Leave the other receivers alone, they may be streaming in another process
+				if (airspyhf_read_sysfs_serial(dev, &sysfs_serial) && sysfs_serial != serial_number_val)
+				{
+					continue;
+				}
+
 				serial_descriptor_index = device_descriptor.iSerialNumber;
 				if (serial_descriptor_index > 0)
 				{
@@ -844,102 +2129,312 @@ static void airspyhf_open_device_fd(airspyhf_device_t* device,
 		return;
 	}
 
-	*ret = AIRSPYHF_SUCCESS;
-	return;
+	*ret = AIRSPYHF_SUCCESS;
+	return;
+}
+
+int airspyhf_list_devices(uint64_t *serials, int count)
+{
+	libusb_device_handle* libusb_dev_handle;
+	struct libusb_context *context;
+	libusb_device** devices = NULL;
+	libusb_device *dev;
+	struct libusb_device_descriptor device_descriptor;
+
+	int serial_descriptor_index;
+	int serial_number_len;
+	int output_count;
+	int i;
+	uint64_t serial;
+	unsigned char serial_number[AIRSPYHF_SERIAL_SIZE + 1];
+
+	if (serials)
+	{
+		memset(serials, 0, sizeof(uint64_t) * count);
+	}
+
+	context = airspyhf_enumeration_context();
+	if (context == NULL)
+	{
+		return AIRSPYHF_ERROR;
+	}
+
+	if (libusb_get_device_list(context, &devices) < 0)
+	{
+		return AIRSPYHF_ERROR;
+	}
+
+	i = 0;
+	output_count = 0;
+	while ((dev = devices[i++]) != NULL && (!serials || output_count < count))
+	{
+		libusb_get_device_descriptor(dev, &device_descriptor);
+
+		if ((device_descriptor.idVendor == airspyhf_usb_vid) &&
+			(device_descriptor.idProduct == airspyhf_usb_pid))
+		{
+			if (!airspyhf_read_sysfs_serial(dev, &serial))
+			{
+				serial_descriptor_index = device_descriptor.iSerialNumber;
+				if (serial_descriptor_index <= 0)
+				{
+					continue;
+				}
+
+				if (libusb_open(dev, &libusb_dev_handle) != 0)
+				{
+					continue;
+				}
+
+				serial_number_len = libusb_get_string_descriptor_ascii(libusb_dev_handle,
+					serial_descriptor_index,
+					serial_number,
+					sizeof(serial_number));
+
+				libusb_close(libusb_dev_handle);
+
+				if (!airspyhf_parse_serial(serial_number, serial_number_len, &serial))
+				{
+					continue;
+				}
+			}
+
+			if (serials)
+			{
+				serials[output_count] = serial;
+			}
+			output_count++;
+		}
+	}
+
+	libusb_free_device_list(devices, 1);
+	return output_count;
+}
+
+static void airspyhf_read_capabilities(airspyhf_device_t* device)
+{
+	int result;
+
+	result = airspyhf_read_samplerates_from_fw(device, &device->supported_samplerate_count, 0);
+	if (result == AIRSPYHF_SUCCESS)
+	{
+		device->supported_samplerates = (uint32_t *)malloc(device->supported_samplerate_count * sizeof(uint32_t));
+		result = airspyhf_read_samplerates_from_fw(device, device->supported_samplerates, device->supported_samplerate_count);
+		if (result == AIRSPYHF_SUCCESS)
+		{
+			device->samplerate_architectures = (uint8_t *)malloc(device->supported_samplerate_count * sizeof(uint8_t));
+			result = airspyhf_read_samplerate_architectures_from_fw(device, device->samplerate_architectures, device->supported_samplerate_count);
+			if (result != AIRSPYHF_SUCCESS)
+			{
+				memset(device->samplerate_architectures, 0, device->supported_samplerate_count * sizeof(uint8_t)); // Assume Zero IF for all
+				result = AIRSPYHF_SUCCESS; // Clear this error for backward compatibility.
+			}
+		}
+		else
+		{
+			free(device->supported_samplerates);
+			device->supported_samplerates = NULL;
+		}
+	}
+
+	if (result != AIRSPYHF_SUCCESS)
+	{
+		// Assume one default sample rate with Zero IF
+
+		device->supported_samplerate_count = 1;
+		device->supported_samplerates = (uint32_t *) malloc(device->supported_samplerate_count * sizeof(uint32_t));
+		device->supported_samplerates[0] = DEFAULT_SAMPLERATE;
+
+		device->samplerate_architectures = (uint8_t *) malloc(device->supported_samplerate_count * sizeof(uint8_t));
+		device->samplerate_architectures[0] = 0;
+	}
+
+	result = airspyhf_read_att_steps_from_fw(device, &device->supported_att_step_count, 0);
+	if (result == AIRSPYHF_SUCCESS)
+	{
+		device->supported_att_steps = (float*)malloc(device->supported_att_step_count * sizeof(float));
+		result = airspyhf_read_att_steps_from_fw(device, device->supported_att_steps, device->supported_att_step_count);
+		if (result != AIRSPYHF_SUCCESS)
+		{
+			free(device->supported_att_steps);
+			device->supported_att_steps = NULL;
+			device->supported_att_step_count = 0;
+		}
+	}
+
+	if (result != AIRSPYHF_SUCCESS)
+	{
+		// Assume ATT steps of the Airspy HF+ Discovery
+
+		device->supported_att_step_count = DEFAULT_ATT_STEP_COUNT;
+		device->supported_att_steps = (float*)malloc(device->supported_att_step_count * sizeof(float));
+		for (uint32_t i = 0; i < device->supported_att_step_count; i++)
+		{
+			device->supported_att_steps[i] = i * DEFAULT_ATT_STEP_INCREMENT;
+		}
+	}
+}
+
+// The capabilities only depend on the firmware, they are cached per serial number to spare
+// the open sequence the samplerate and attenuator queries
+static char* capability_cache_dir = NULL;
+
+// Serial number of an open device, read once
+static bool airspyhf_device_serial(airspyhf_device_t* device, uint64_t* serial_number)
+{
+	struct libusb_device_descriptor device_descriptor;
+	unsigned char serial_descriptor[AIRSPYHF_SERIAL_SIZE + 1];
+	int serial_descriptor_len;
+
+	if (device->serial_number == SERIAL_NUMBER_UNUSED &&
+		!airspyhf_read_sysfs_serial(libusb_get_device(device->usb_device), &device->serial_number))
+	{
+		if (libusb_get_device_descriptor(libusb_get_device(device->usb_device), &device_descriptor) != 0 ||
+			device_descriptor.iSerialNumber == 0)
+		{
+			return false;
+		}
+
+		serial_descriptor_len = libusb_get_string_descriptor_ascii(device->usb_device,
+			device_descriptor.iSerialNumber,
+			serial_descriptor,
+			sizeof(serial_descriptor));
+
+		if (!airspyhf_parse_serial(serial_descriptor, serial_descriptor_len, &device->serial_number))
+		{
+			device->serial_number = SERIAL_NUMBER_UNUSED;
+			return false;
+		}
+	}
+
+	*serial_number = device->serial_number;
+	return true;
 }
 
-int airspyhf_list_devices(uint64_t *serials, int count)
+static bool airspyhf_capability_path(airspyhf_device_t* device, char* path, size_t length)
 {
-	libusb_device_handle* libusb_dev_handle;
-	struct libusb_context *context;
-	libusb_device** devices = NULL;
-	libusb_device *dev;
-	struct libusb_device_descriptor device_descriptor;
+	uint64_t serial_number;
 
-	int serial_descriptor_index;
-	int serial_number_len;
-	int output_count;
-	int i;
-	unsigned char serial_number[AIRSPYHF_SERIAL_SIZE + 1];
-
-	if (serials)
+	if (capability_cache_dir == NULL || !airspyhf_device_serial(device, &serial_number))
 	{
-		memset(serials, 0, sizeof(uint64_t) * count);
+		return false;
 	}
 
-#ifdef __ANDROID__
-	// LibUSB does not support device discovery on android
-	libusb_set_option(NULL, LIBUSB_OPTION_NO_DEVICE_DISCOVERY, NULL);
-#endif
+	return snprintf(path, length, "%s/airspyhf-%016llx.cap", capability_cache_dir, (unsigned long long) serial_number) < (int) length;
+}
 
-	if (libusb_init(&context) != 0)
+// File layout: magic, firmware version string, samplerate count, att step count,
+// samplerates, samplerate architectures, att steps, in host byte order
+static int airspyhf_load_capabilities(airspyhf_device_t* device, const char* path, const char* version)
+{
+	char magic[sizeof(CAPABILITY_CACHE_MAGIC)];
+	char file_version[MAX_VERSION_STRING_SIZE];
+	uint32_t counts[2];
+	FILE* file;
+	int result = AIRSPYHF_ERROR;
+
+	file = fopen(path, "rb");
+	if (file == NULL)
 	{
 		return AIRSPYHF_ERROR;
 	}
 
-	if (libusb_get_device_list(context, &devices) < 0)
+	if (fread(magic, sizeof(magic), 1, file) == 1 &&
+		fread(file_version, sizeof(file_version), 1, file) == 1 &&
+		fread(counts, sizeof(counts), 1, file) == 1 &&
+		memcmp(magic, CAPABILITY_CACHE_MAGIC, sizeof(magic)) == 0 &&
+		strncmp(file_version, version, sizeof(file_version)) == 0 &&
+		counts[0] > 0 && counts[0] <= CAPABILITY_CACHE_MAX_COUNT &&
+		counts[1] > 0 && counts[1] <= CAPABILITY_CACHE_MAX_COUNT)
 	{
-		return AIRSPYHF_ERROR;
+		device->supported_samplerates = (uint32_t *) malloc(counts[0] * sizeof(uint32_t));
+		device->samplerate_architectures = (uint8_t *) malloc(counts[0] * sizeof(uint8_t));
+		device->supported_att_steps = (float *) malloc(counts[1] * sizeof(float));
+
+		if (device->supported_samplerates != NULL &&
+			device->samplerate_architectures != NULL &&
+			device->supported_att_steps != NULL &&
+			fread(device->supported_samplerates, sizeof(uint32_t), counts[0], file) == counts[0] &&
+			fread(device->samplerate_architectures, sizeof(uint8_t), counts[0], file) == counts[0] &&
+			fread(device->supported_att_steps, sizeof(float), counts[1], file) == counts[1])
+		{
+			device->supported_samplerate_count = counts[0];
+			device->supported_att_step_count = counts[1];
+			result = AIRSPYHF_SUCCESS;
+		}
+		else
+		{
+			free(device->supported_samplerates);
+			free(device->samplerate_architectures);
+			free(device->supported_att_steps);
+			device->supported_samplerates = NULL;
+			device->samplerate_architectures = NULL;
+			device->supported_att_steps = NULL;
+		}
 	}
 
-	i = 0;
-	output_count = 0;
-	while ((dev = devices[i++]) != NULL && (!serials || output_count < count))
-	{
-		libusb_get_device_descriptor(dev, &device_descriptor);
+	fclose(file);
+	return result;
+}
 
-		if ((device_descriptor.idVendor == airspyhf_usb_vid) &&
-			(device_descriptor.idProduct == airspyhf_usb_pid))
-		{
-			serial_descriptor_index = device_descriptor.iSerialNumber;
-			if (serial_descriptor_index > 0)
-			{
-				if (libusb_open(dev, &libusb_dev_handle) != 0)
-				{
-					continue;
-				}
+static void airspyhf_save_capabilities(airspyhf_device_t* device, const char* path, const char* version)
+{
+	char file_version[MAX_VERSION_STRING_SIZE];
+	uint32_t counts[2];
+	FILE* file;
+	bool written;
+
+	memset(file_version, 0, sizeof(file_version));
+	snprintf(file_version, sizeof(file_version), "%s", version);
+	counts[0] = device->supported_samplerate_count;
+	counts[1] = device->supported_att_step_count;
+
+	file = fopen(path, "wb");
+	if (file == NULL)
+	{
+		return;
+	}
 
-				serial_number_len = libusb_get_string_descriptor_ascii(libusb_dev_handle,
-					serial_descriptor_index,
-					serial_number,
-					sizeof(serial_number));
+	written = fwrite(CAPABILITY_CACHE_MAGIC, sizeof(CAPABILITY_CACHE_MAGIC), 1, file) == 1 &&
+		fwrite(file_version, sizeof(file_version), 1, file) == 1 &&
+		fwrite(counts, sizeof(counts), 1, file) == 1 &&
+		fwrite(device->supported_samplerates, sizeof(uint32_t), counts[0], file) == counts[0] &&
+		fwrite(device->samplerate_architectures, sizeof(uint8_t), counts[0], file) == counts[0] &&
+		fwrite(device->supported_att_steps, sizeof(float), counts[1], file) == counts[1];
 
-				if (serial_number_len == AIRSPYHF_SERIAL_SIZE && !memcmp(str_prefix_serial_airspyhf, serial_number, STR_PREFIX_SERIAL_AIRSPYHF_SIZE))
-				{
-					char *start, *end;
-					uint64_t serial;
-
-					serial_number[AIRSPYHF_SERIAL_SIZE] = 0;
-					start = (char*)(serial_number + STR_PREFIX_SERIAL_AIRSPYHF_SIZE);
-					end = NULL;
-					serial = strtoull(start, &end, 16);
-					if (serial == 0 && start == end)
-					{
-						libusb_close(libusb_dev_handle);
-						continue;
-					}
+	// A partial file would only fail validation, but don't leave it behind
+	if (fclose(file) != 0 || !written)
+	{
+		remove(path);
+	}
+}
 
-					if (serials)
-					{
-						serials[output_count] = serial;
-					}
-					output_count++;
-				}
+int ADDCALL airspyhf_set_capability_cache_dir(const char* path)
+{
+	char* dir = NULL;
 
-				libusb_close(libusb_dev_handle);
-			}
+	if (path != NULL)
+	{
+		dir = (char *) malloc(strlen(path) + 1);
+		if (dir == NULL)
+		{
+			return AIRSPYHF_ERROR;
 		}
+		strcpy(dir, path);
 	}
 
-	libusb_free_device_list(devices, 1);
-	libusb_exit(context);
-	return output_count;
+	free(capability_cache_dir);
+	capability_cache_dir = dir;
+
+	return AIRSPYHF_SUCCESS;
 }
 
-static int airspyhf_open_init(airspyhf_device_t** device, uint64_t serial_number, int fd)
+static int airspyhf_open_init(airspyhf_device_t** device, uint64_t serial_number, int fd, airspyhf_hub_t* hub)
 {
 	airspyhf_device_t* lib_device;
 	flash_config_t config;
+	char capability_path[512];
+	char firmware_version[MAX_VERSION_STRING_SIZE];
 	int libusb_error;
 	int result;
 
@@ -951,18 +2446,28 @@ static int airspyhf_open_init(airspyhf_device_t** device, uint64_t serial_number
 		return AIRSPYHF_ERROR;
 	}
 
+	if (hub != NULL)
+	{
+		lib_device->hub = hub;
+		lib_device->usb_context = hub->usb_context;
+	}
+	else
+	{
 #ifdef __ANDROID__
-	// LibUSB does not support device discovery on android
-	libusb_set_option(NULL, LIBUSB_OPTION_NO_DEVICE_DISCOVERY, NULL);
+		// LibUSB does not support device discovery on android
+		libusb_set_option(NULL, LIBUSB_OPTION_NO_DEVICE_DISCOVERY, NULL);
 #endif
 
-	libusb_error = libusb_init(&lib_device->usb_context);
-	if (libusb_error != 0)
-	{
-		free(lib_device);
-		return AIRSPYHF_ERROR;
+		libusb_error = libusb_init(&lib_device->usb_context);
+		if (libusb_error != 0)
+		{
+			free(lib_device);
+			return AIRSPYHF_ERROR;
+		}
 	}
 
+	pthread_mutex_init(&lib_device->handle_mp, NULL);
+
 	if (fd == FILE_DESCRIPTOR_UNUSED) {
 		airspyhf_open_device(lib_device,
 			&result,
@@ -978,188 +2483,388 @@ static int airspyhf_open_init(airspyhf_device_t** device, uint64_t serial_number
 
 	if (lib_device->usb_device == NULL)
 	{
-		libusb_exit(lib_device->usb_context);
+		airspyhf_open_exit(lib_device);
 		free(lib_device);
 		return result;
 	}
 
 	lib_device->transfers = NULL;
 	lib_device->callback = NULL;
-	lib_device->transfer_count = 16;
-	lib_device->buffer_size = SAMPLES_TO_TRANSFER * sizeof(airspyhf_complex_int16_t);
+	lib_device->sample_type = AIRSPYHF_SAMPLE_FLOAT32_IQ;
+	lib_device->transfer_count = MAX_TRANSFER_DEPTH;
+	lib_device->transfer_depth = DEFAULT_TRANSFER_DEPTH;
+	lib_device->transfer_depth_min = DEFAULT_TRANSFER_DEPTH;
+	lib_device->transfer_depth_max = MAX_TRANSFER_DEPTH;
+	lib_device->buffer_size = SAMPLES_TO_TRANSFER * sizeof(airspyhf_raw_sample_t);
 	lib_device->streaming = false;
 	lib_device->stop_requested = false;
 
 	lib_device->supported_samplerates = NULL;
 	lib_device->samplerate_architectures = NULL;
+	lib_device->serial_number = serial_number;
+	lib_device->att_index = -1;
+	lib_device->hf_agc = -1;
+	lib_device->hf_agc_threshold = -1;
+	lib_device->hf_lna = -1;
+	lib_device->bias_tee = -1;
+
+	if (!airspyhf_capability_path(lib_device, capability_path, sizeof(capability_path)) ||
+		airspyhf_version_string_read(lib_device, firmware_version, sizeof(firmware_version)) != AIRSPYHF_SUCCESS)
+	{
+		airspyhf_read_capabilities(lib_device);
+	}
+	else if (airspyhf_load_capabilities(lib_device, capability_path, firmware_version) != AIRSPYHF_SUCCESS)
+	{
+		airspyhf_read_capabilities(lib_device);
+		airspyhf_save_capabilities(lib_device, capability_path, firmware_version);
+	}
 
-	result = airspyhf_read_samplerates_from_fw(lib_device, &lib_device->supported_samplerate_count, 0);
-	if (result == AIRSPYHF_SUCCESS)
+	lib_device->current_samplerate = lib_device->supported_samplerates[0];
+	lib_device->is_low_if = lib_device->samplerate_architectures[0];
+
+	result = allocate_transfers(lib_device);
+	if (result != 0)
 	{
-		lib_device->supported_samplerates = (uint32_t *)malloc(lib_device->supported_samplerate_count * sizeof(uint32_t));
-		result = airspyhf_read_samplerates_from_fw(lib_device, lib_device->supported_samplerates, lib_device->supported_samplerate_count);
-		if (result == AIRSPYHF_SUCCESS)
+		airspyhf_open_exit(lib_device);
+		free(lib_device);
+		return AIRSPYHF_ERROR;
+	}
+
+	lib_device->nco_table = (airspyhf_complex_float_t *) malloc(NCO_TABLE_SIZE * sizeof(airspyhf_complex_float_t));
+	if (lib_device->nco_table == NULL)
+	{
+		free_transfers(lib_device);
+		airspyhf_open_exit(lib_device);
+		free(lib_device);
+		return AIRSPYHF_ERROR;
+	}
+	nco_table_init(lib_device->nco_table);
+
+	lib_device->freq_delta_cache = (freq_delta_entry_t *) calloc(FREQ_DELTA_CACHE_SIZE, sizeof(freq_delta_entry_t));
+	lib_device->freq_delta_cache_enabled = true;
+	lib_device->command_transfer = libusb_alloc_transfer(0);
+	if (lib_device->command_transfer == NULL || lib_device->freq_delta_cache == NULL)
+	{
+		libusb_free_transfer(lib_device->command_transfer);
+		free(lib_device->freq_delta_cache);
+		free(lib_device->nco_table);
+		free_transfers(lib_device);
+		airspyhf_open_exit(lib_device);
+		free(lib_device);
+		return AIRSPYHF_ERROR;
+	}
+
+	pthread_cond_init(&lib_device->consumer_cv, NULL);
+	pthread_mutex_init(&lib_device->consumer_mp, NULL);
+	pthread_cond_init(&lib_device->io_cv, NULL);
+	pthread_cond_init(&lib_device->command_cv, NULL);
+	pthread_mutex_init(&lib_device->command_mp, NULL);
+
+	lib_device->freq_hz = 0;
+	lib_device->freq_khz = 0;
+	lib_device->freq_delta_hz = 0;
+	lib_device->freq_shift = 0;
+	lib_device->vec.re = 1.0f;
+	lib_device->vec.im = 0.0f;
+	lib_device->nco_mode = AIRSPYHF_NCO_RECURSIVE;
+	lib_device->nco_phase = 0;
+	lib_device->optimal_point = 0.0f;
+	lib_device->filter_gain = 1.0f;
+	lib_device->enable_dsp = 1;
+
+	if (airspyhf_config_read(lib_device, (uint8_t *) &config, sizeof(config)) == AIRSPYHF_SUCCESS)
+	{
+		if (config.magic_number == CALIBRATION_MAGIC)
 		{
-			lib_device->samplerate_architectures = (uint8_t *)malloc(lib_device->supported_samplerate_count * sizeof(uint8_t));
-			result = airspyhf_read_samplerate_architectures_from_fw(lib_device, lib_device->samplerate_architectures, lib_device->supported_samplerate_count);
-			if (result != AIRSPYHF_SUCCESS)
-			{
-				memset(lib_device->samplerate_architectures, 0, lib_device->supported_samplerate_count * sizeof(uint8_t)); // Assume Zero IF for all
-				result = AIRSPYHF_SUCCESS; // Clear this error for backward compatibility.
-			}
+			lib_device->calibration_ppb = config.calibration_ppb;
+			airspyhf_set_vctcxo_calibration(lib_device, config.calibration_vctcxo);
+			airspyhf_set_frontend_options(lib_device, config.frontend_options);
 		}
 		else
 		{
-			free(lib_device->supported_samplerates);
-			lib_device->supported_samplerates = NULL;
+			lib_device->calibration_ppb = 0;
+			lib_device->calibration_vctcxo = 0;
+			lib_device->frontend_options = 0;
 		}
 	}
+	else
+	{
+		lib_device->calibration_ppb = 0;
+		lib_device->calibration_vctcxo = 0;
+		lib_device->frontend_options = 0;
+	}
 
-	if (result != AIRSPYHF_SUCCESS)
+	lib_device->iq_balancer = iq_balancer_create(INITIAL_PHASE, INITIAL_AMPLITUDE);
+
+	if (hub != NULL)
 	{
-		// Assume one default sample rate with Zero IF
+		pthread_mutex_lock(&hub->mp);
+		hub->device_count++;
+		pthread_mutex_unlock(&hub->mp);
+	}
+
+	*device = lib_device;
+
+	return AIRSPYHF_SUCCESS;
+}
+
+void ADDCALL airspyhf_lib_version(airspyhf_lib_version_t* lib_version)
+{
+	lib_version->major_version = AIRSPYHF_VER_MAJOR;
+	lib_version->minor_version = AIRSPYHF_VER_MINOR;
+	lib_version->revision = AIRSPYHF_VER_REVISION;
+}
+
+int ADDCALL airspyhf_open_sn(airspyhf_device_t** device, uint64_t serial_number)
+{
+	int result;
+
+	result = airspyhf_open_init(device, serial_number, FILE_DESCRIPTOR_UNUSED, NULL);
+	return result;
+}
+
+int ADDCALL airspyhf_open_fd(airspyhf_device_t** device, int fd)
+{
+	int result;
+
+	result = airspyhf_open_init(device, SERIAL_NUMBER_UNUSED, fd, NULL);
+	return result;
+}
+
+int ADDCALL airspyhf_open(airspyhf_device_t** device)
+{
+	int result;
+
+	result = airspyhf_open_init(device, SERIAL_NUMBER_UNUSED, FILE_DESCRIPTOR_UNUSED, NULL);
+	return result;
+}
 
-		lib_device->supported_samplerate_count = 1;
-		lib_device->supported_samplerates = (uint32_t *) malloc(lib_device->supported_samplerate_count * sizeof(uint32_t));
-		lib_device->supported_samplerates[0] = DEFAULT_SAMPLERATE;
+int ADDCALL airspyhf_close(airspyhf_device_t* device)
+{
+	int result;
+
+	result = AIRSPYHF_SUCCESS;
+
+	if (device != NULL)
+	{
+		result = airspyhf_stop(device);
+		exit_io_threads(device);
+		airspyhf_set_auto_recovery(device, 0);
+		free_transfers(device);
+
+		while (device->command_head != NULL)
+		{
+			airspyhf_command_t* command = device->command_head;
+			device->command_head = command->next;
+			free(command);
+		}
+		libusb_free_transfer(device->command_transfer);
+
+		airspyhf_open_exit(device);
+
+		if (device->hub != NULL)
+		{
+			pthread_mutex_lock(&device->hub->mp);
+			device->hub->device_count--;
+			pthread_mutex_unlock(&device->hub->mp);
+		}
+
+		free(device->supported_samplerates);
+		free(device->samplerate_architectures);
+		free(device->supported_att_steps);
+		free(device->nco_table);
+		free(device->freq_delta_cache);
+		iq_balancer_destroy(device->iq_balancer);
+
+		pthread_cond_destroy(&device->consumer_cv);
+		pthread_mutex_destroy(&device->consumer_mp);
+		pthread_cond_destroy(&device->io_cv);
+		pthread_cond_destroy(&device->command_cv);
+		pthread_mutex_destroy(&device->command_mp);
 
-		lib_device->samplerate_architectures = (uint8_t *) malloc(lib_device->supported_samplerate_count * sizeof(uint8_t));
-		lib_device->samplerate_architectures[0] = 0;
+		free(device);
 	}
 
-	lib_device->current_samplerate = lib_device->supported_samplerates[0];
-	lib_device->is_low_if = lib_device->samplerate_architectures[0];
+	return result;
+}
 
-	result = airspyhf_read_att_steps_from_fw(lib_device, &lib_device->supported_att_step_count, 0);
-	if (result == AIRSPYHF_SUCCESS)
+int ADDCALL airspyhf_hub_create(airspyhf_hub_t** hub, int consumer_threads)
+{
+	airspyhf_hub_t* lib_hub;
+	int i;
+
+	*hub = NULL;
+
+	lib_hub = (airspyhf_hub_t*) calloc(1, sizeof(airspyhf_hub_t));
+	if (lib_hub == NULL)
 	{
-		lib_device->supported_att_steps = (float*)malloc(lib_device->supported_att_step_count * sizeof(float));
-		result = airspyhf_read_att_steps_from_fw(lib_device, lib_device->supported_att_steps, lib_device->supported_att_step_count);
-		if (result != AIRSPYHF_SUCCESS)
+		return AIRSPYHF_ERROR;
+	}
+
+	lib_hub->consumer_count = consumer_threads > 0 ? consumer_threads : 1;
+	lib_hub->consumer_threads = (pthread_t*) calloc(lib_hub->consumer_count, sizeof(pthread_t));
+	if (lib_hub->consumer_threads == NULL)
+	{
+		free(lib_hub);
+		return AIRSPYHF_ERROR;
+	}
+
+#ifdef __ANDROID__
+	// LibUSB does not support device discovery on android
+	libusb_set_option(NULL, LIBUSB_OPTION_NO_DEVICE_DISCOVERY, NULL);
+#endif
+
+	if (libusb_init(&lib_hub->usb_context) != 0)
+	{
+		free(lib_hub->consumer_threads);
+		free(lib_hub);
+		return AIRSPYHF_ERROR;
+	}
+
+	pthread_mutex_init(&lib_hub->mp, NULL);
+	pthread_cond_init(&lib_hub->ready_cv, NULL);
+	pthread_cond_init(&lib_hub->idle_cv, NULL);
+
+	if (pthread_create(&lib_hub->event_thread, NULL, hub_event_threadproc, lib_hub) != 0)
+	{
+		lib_hub->consumer_count = 0;
+		lib_hub->exit_requested = true;
+		airspyhf_hub_destroy(lib_hub);
+		return AIRSPYHF_ERROR;
+	}
+
+	for (i = 0; i < lib_hub->consumer_count; i++)
+	{
+		if (pthread_create(&lib_hub->consumer_threads[i], NULL, hub_consumer_threadproc, lib_hub) != 0)
 		{
-			free(lib_device->supported_att_steps);
-			lib_device->supported_att_steps = NULL;
-			lib_device->supported_att_step_count = 0;
+			lib_hub->consumer_count = i;
+			airspyhf_hub_destroy(lib_hub);
+			return AIRSPYHF_ERROR;
 		}
 	}
 
-	if (result != AIRSPYHF_SUCCESS)
-	{
-		// Assume ATT steps of the Airspy HF+ Discovery
+	*hub = lib_hub;
+
+	return AIRSPYHF_SUCCESS;
+}
+
+int ADDCALL airspyhf_hub_destroy(airspyhf_hub_t* hub)
+{
+	bool event_thread_running;
+	int i;
 
-		lib_device->supported_att_step_count = DEFAULT_ATT_STEP_COUNT;
-		lib_device->supported_att_steps = (float*)malloc(lib_device->supported_att_step_count * sizeof(float));
-		for (uint32_t i = 0; i < lib_device->supported_att_step_count; i++)
-		{
-			lib_device->supported_att_steps[i] = i * DEFAULT_ATT_STEP_INCREMENT;
-		}
+	if (hub == NULL)
+	{
+		return AIRSPYHF_SUCCESS;
 	}
-	
-	result = allocate_transfers(lib_device);
-	if (result != 0)
+
+	pthread_mutex_lock(&hub->mp);
+	if (hub->device_count > 0)
 	{
-		airspyhf_open_exit(lib_device);
-		free(lib_device);
+		pthread_mutex_unlock(&hub->mp);
 		return AIRSPYHF_ERROR;
 	}
+	event_thread_running = !hub->exit_requested;
+	hub->exit_requested = true;
+	pthread_cond_broadcast(&hub->ready_cv);
+	pthread_mutex_unlock(&hub->mp);
 
-	pthread_cond_init(&lib_device->consumer_cv, NULL);
-	pthread_mutex_init(&lib_device->consumer_mp, NULL);
-
-	lib_device->freq_hz = 0;
-	lib_device->freq_khz = 0;
-	lib_device->freq_delta_hz = 0;
-	lib_device->freq_shift = 0;
-	lib_device->vec.re = 1.0f;
-	lib_device->vec.im = 0.0f;
-	lib_device->optimal_point = 0.0f;
-	lib_device->filter_gain = 1.0f;
-	lib_device->enable_dsp = 1;
-
-	if (airspyhf_config_read(lib_device, (uint8_t *) &config, sizeof(config)) == AIRSPYHF_SUCCESS)
+	if (event_thread_running)
 	{
-		if (config.magic_number == CALIBRATION_MAGIC)
-		{
-			lib_device->calibration_ppb = config.calibration_ppb;
-			airspyhf_set_vctcxo_calibration(lib_device, config.calibration_vctcxo);
-			airspyhf_set_frontend_options(lib_device, config.frontend_options);
-		}
-		else
-		{
-			lib_device->calibration_ppb = 0;
-			lib_device->calibration_vctcxo = 0;
-			lib_device->frontend_options = 0;
-		}
+#ifndef _WIN32
+		libusb_interrupt_event_handler(hub->usb_context);
+#endif
+		pthread_join(hub->event_thread, NULL);
 	}
-	else
+	for (i = 0; i < hub->consumer_count; i++)
 	{
-		lib_device->calibration_ppb = 0;
-		lib_device->calibration_vctcxo = 0;
-		lib_device->frontend_options = 0;
+		pthread_join(hub->consumer_threads[i], NULL);
 	}
 
-	lib_device->iq_balancer = iq_balancer_create(INITIAL_PHASE, INITIAL_AMPLITUDE);
+	libusb_exit(hub->usb_context);
 
-	*device = lib_device;
+	pthread_cond_destroy(&hub->idle_cv);
+	pthread_cond_destroy(&hub->ready_cv);
+	pthread_mutex_destroy(&hub->mp);
+
+	free(hub->consumer_threads);
+	free(hub);
 
 	return AIRSPYHF_SUCCESS;
 }
 
-void ADDCALL airspyhf_lib_version(airspyhf_lib_version_t* lib_version)
+int ADDCALL airspyhf_hub_open(airspyhf_hub_t* hub, airspyhf_device_t** device)
 {
-	lib_version->major_version = AIRSPYHF_VER_MAJOR;
-	lib_version->minor_version = AIRSPYHF_VER_MINOR;
-	lib_version->revision = AIRSPYHF_VER_REVISION;
+	return airspyhf_open_init(device, SERIAL_NUMBER_UNUSED, FILE_DESCRIPTOR_UNUSED, hub);
 }
 
-int ADDCALL airspyhf_open_sn(airspyhf_device_t** device, uint64_t serial_number)
+int ADDCALL airspyhf_hub_open_sn(airspyhf_hub_t* hub, airspyhf_device_t** device, uint64_t serial_number)
 {
-	int result;
-
-	result = airspyhf_open_init(device, serial_number, FILE_DESCRIPTOR_UNUSED);
-	return result;
+	return airspyhf_open_init(device, serial_number, FILE_DESCRIPTOR_UNUSED, hub);
 }
 
-int ADDCALL airspyhf_open_fd(airspyhf_device_t** device, int fd)
+int ADDCALL airspyhf_set_thread_policy(airspyhf_device_t* device, enum airspyhf_thread thread, const airspyhf_thread_policy_t* policy)
 {
-	int result;
+	airspyhf_thread_policy_t checked;
 
-	result = airspyhf_open_init(device, SERIAL_NUMBER_UNUSED, fd);
-	return result;
-}
+	if ((thread != AIRSPYHF_THREAD_TRANSFER && thread != AIRSPYHF_THREAD_CONSUMER) || device->hub != NULL)
+	{
+		return AIRSPYHF_ERROR;
+	}
 
-int ADDCALL airspyhf_open(airspyhf_device_t** device)
-{
-	int result;
+	checked = *policy;
+	checked.name[sizeof(checked.name) - 1] = 0;
 
-	result = airspyhf_open_init(device, SERIAL_NUMBER_UNUSED, FILE_DESCRIPTOR_UNUSED);
-	return result;
-}
+	if (checked.policy != AIRSPYHF_SCHED_DEFAULT && checked.policy != AIRSPYHF_SCHED_FIFO && checked.policy != AIRSPYHF_SCHED_RR)
+	{
+		return AIRSPYHF_ERROR;
+	}
 
-int ADDCALL airspyhf_close(airspyhf_device_t* device)
-{
-	int result;
+	device->thread_policy[thread] = checked;
 
-	result = AIRSPYHF_SUCCESS;
+	// Otherwise the thread applies it itself when streaming starts
+	if (thread == AIRSPYHF_THREAD_TRANSFER && device->transfer_thread_running)
+	{
+		return apply_thread_policy(device->transfer_thread, &checked);
+	}
+	if (thread == AIRSPYHF_THREAD_CONSUMER && device->consumer_thread_running)
+	{
+		return apply_thread_policy(device->consumer_thread, &checked);
+	}
 
-	if (device != NULL)
+	return AIRSPYHF_SUCCESS;
+}
+
+int ADDCALL airspyhf_set_transfer_depth(airspyhf_device_t* device, uint32_t min_depth, uint32_t max_depth)
+{
+	if (min_depth < MIN_TRANSFER_DEPTH || min_depth > max_depth || max_depth > device->transfer_count)
 	{
-		result = airspyhf_stop(device);
-		free_transfers(device);
-		airspyhf_open_exit(device);
+		return AIRSPYHF_ERROR;
+	}
 
-		free(device->supported_samplerates);
-		free(device->samplerate_architectures);
-		free(device->supported_att_steps);
-		iq_balancer_destroy(device->iq_balancer);
+	pthread_mutex_lock(&device->consumer_mp);
+	device->transfer_depth_min = min_depth;
+	device->transfer_depth_max = max_depth;
+	device->transfer_depth = MIN(MAX(device->transfer_depth, min_depth), max_depth);
+	device->calm_windows = 0;
+	pthread_mutex_unlock(&device->consumer_mp);
 
-		pthread_cond_destroy(&device->consumer_cv);
-		pthread_mutex_destroy(&device->consumer_mp);
+	return AIRSPYHF_SUCCESS;
+}
 
-		free(device);
-	}
+int ADDCALL airspyhf_get_stats(airspyhf_device_t* device, airspyhf_stats_t* stats)
+{
+	pthread_mutex_lock(&device->consumer_mp);
+	stats->transfer_depth = device->transfer_depth;
+	stats->transfer_depth_min = device->transfer_depth_min;
+	stats->transfer_depth_max = device->transfer_depth_max;
+	stats->completion_jitter_us = device->completion_jitter_us;
+	stats->queue_peak = device->queue_peak;
+	stats->transfers_completed = device->completed_transfers;
+	stats->dropped_buffers = device->total_dropped_buffers;
+	pthread_mutex_unlock(&device->consumer_mp);
 
-	return result;
+	return AIRSPYHF_SUCCESS;
 }
 
 int ADDCALL airspyhf_get_output_size(airspyhf_device_t * device)
@@ -1217,7 +2922,7 @@ int ADDCALL airspyhf_set_samplerate(airspyhf_device_t* device, uint32_t samplera
 	device->current_samplerate = device->supported_samplerates[samplerate];
 	device->is_low_if = device->samplerate_architectures[samplerate];
 
-	libusb_clear_halt(device->usb_device, LIBUSB_ENDPOINT_IN | 1);
+	device_clear_halt(device, LIBUSB_ENDPOINT_IN | 1);
 
 	if (!device->is_low_if && device->freq_khz < MIN_ZERO_IF_LO)
 	{
@@ -1227,8 +2932,8 @@ int ADDCALL airspyhf_set_samplerate(airspyhf_device_t* device, uint32_t samplera
 		buf[2] = (uint8_t)((MIN_ZERO_IF_LO >> 8) & 0xff);
 		buf[3] = (uint8_t)((MIN_ZERO_IF_LO) & 0xff);
 
-		result = libusb_control_transfer(
-			device->usb_device,
+		result = device_control_transfer(
+			device,
 			LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
 			AIRSPYHF_SET_FREQ,
 			0,
@@ -1245,8 +2950,8 @@ int ADDCALL airspyhf_set_samplerate(airspyhf_device_t* device, uint32_t samplera
 		device->freq_khz = MIN_ZERO_IF_LO;
 	}
 
-	result = libusb_control_transfer(
-		device->usb_device,
+	result = device_control_transfer(
+		device,
 		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
 		AIRSPYHF_SET_SAMPLERATE,
 		0,
@@ -1260,8 +2965,8 @@ int ADDCALL airspyhf_set_samplerate(airspyhf_device_t* device, uint32_t samplera
 		return AIRSPYHF_ERROR;
 	}
 
-	result = libusb_control_transfer(
-		device->usb_device,
+	result = device_control_transfer(
+		device,
 		LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
 		AIRSPYHF_GET_FILTER_GAIN,
 		0,
@@ -1287,8 +2992,8 @@ int ADDCALL airspyhf_set_samplerate(airspyhf_device_t* device, uint32_t samplera
 int ADDCALL airspyhf_set_receiver_mode(airspyhf_device_t* device, receiver_mode_t value)
 {
 	int result;
-	result = libusb_control_transfer(
-		device->usb_device,
+	result = device_control_transfer(
+		device,
 		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
 		AIRSPYHF_RECEIVER_MODE,
 		value,
@@ -1305,6 +3010,22 @@ int ADDCALL airspyhf_set_receiver_mode(airspyhf_device_t* device, receiver_mode_
 	return AIRSPYHF_SUCCESS;
 }
 
+int ADDCALL airspyhf_set_sample_type(airspyhf_device_t* device, enum airspyhf_sample_type sample_type)
+{
+	switch (sample_type)
+	{
+	case AIRSPYHF_SAMPLE_FLOAT32_IQ:
+	case AIRSPYHF_SAMPLE_FLOAT16_IQ:
+	case AIRSPYHF_SAMPLE_INT8_IQ:
+	case AIRSPYHF_SAMPLE_INT16_IQ:
+		device->sample_type = sample_type;
+		return AIRSPYHF_SUCCESS;
+
+	default:
+		return AIRSPYHF_ERROR;
+	}
+}
+
 int ADDCALL airspyhf_start(airspyhf_device_t* device, airspyhf_sample_block_cb_fn callback, void* ctx)
 {
 	int result;
@@ -1314,6 +3035,23 @@ int ADDCALL airspyhf_start(airspyhf_device_t* device, airspyhf_sample_block_cb_f
 
 	device->vec.re = 1.0f;
 	device->vec.im = 0.0f;
+	device->nco_phase = 0;
+
+	device->squelch_open = false;
+	device->squelch_hang_remaining = 0;
+	device->gated_samples = 0;
+	device->gated_dropped_samples = 0;
+	device->gated_flags = 0;
+	device->transfer_flags = 0;
+	device->device_lost = false;
+	device->retune_pending = false;
+	device->completed_transfers = 0;
+	device->total_dropped_buffers = 0;
+	device->completion_jitter_us = 0;
+	device->queue_peak = 0;
+	device->sample_index = 0;
+	device->applied_freq_shift = device->freq_shift;
+	device->nco_retuned = false;
 
 	result = airspyhf_set_receiver_mode(device, RECEIVER_MODE_OFF);
 	if (result != AIRSPYHF_SUCCESS)
@@ -1321,7 +3059,7 @@ int ADDCALL airspyhf_start(airspyhf_device_t* device, airspyhf_sample_block_cb_f
 		return result;
 	}
 
-	libusb_clear_halt(device->usb_device, LIBUSB_ENDPOINT_IN | AIRSPYHF_ENDPOINT_IN);
+	device_clear_halt(device, LIBUSB_ENDPOINT_IN | AIRSPYHF_ENDPOINT_IN);
 
 	result = airspyhf_set_receiver_mode(device, RECEIVER_MODE_ON);
 	if (result == AIRSPYHF_SUCCESS)
@@ -1333,90 +3071,338 @@ int ADDCALL airspyhf_start(airspyhf_device_t* device, airspyhf_sample_block_cb_f
 	return result;
 }
 
+int ADDCALL airspyhf_set_auto_recovery(airspyhf_device_t* device, uint8_t flag)
+{
+	uint64_t serial_number;
+
+	if (flag == 0)
+	{
+		device->auto_recovery = false;
+		if (device->hotplug_registered)
+		{
+			libusb_hotplug_deregister_callback(device->usb_context, device->hotplug_handle);
+			device->hotplug_registered = false;
+		}
+		return AIRSPYHF_SUCCESS;
+	}
+
+	// The reattach runs on the device's own transfer thread and looks the receiver up by serial number
+	if (device->hub != NULL || !airspyhf_device_serial(device, &serial_number))
+	{
+		return AIRSPYHF_ERROR;
+	}
+
+	if (!device->hotplug_registered && libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+	{
+		device->hotplug_registered = libusb_hotplug_register_callback(
+			device->usb_context,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+			LIBUSB_HOTPLUG_NO_FLAGS,
+			airspyhf_usb_vid,
+			airspyhf_usb_pid,
+			LIBUSB_HOTPLUG_MATCH_ANY,
+			hotplug_arrived_callback,
+			device,
+			&device->hotplug_handle) == LIBUSB_SUCCESS;
+	}
+
+	device->auto_recovery = true;
+	return AIRSPYHF_SUCCESS;
+}
+
 int ADDCALL airspyhf_is_streaming(airspyhf_device_t* device)
 {
 	return device->streaming && !device->stop_requested;
 }
 
-int ADDCALL airspyhf_stop(airspyhf_device_t* device)
+int ADDCALL airspyhf_stop(airspyhf_device_t* device)
+{
+	int result1, result2;
+	device->stop_requested = true;
+	result1 = airspyhf_set_receiver_mode(device, RECEIVER_MODE_OFF);
+	result2 = kill_io_threads(device);
+	command_cancel(device);
+
+#ifndef _WIN32
+	libusb_interrupt_event_handler(device->usb_context);
+#endif
+
+	if (result2 != AIRSPYHF_SUCCESS)
+	{
+		return result2;
+	}
+	return result1;
+}
+
+
+int ADDCALL airspyhf_set_freq(airspyhf_device_t* device, const uint32_t freq_hz)
+{
+	return airspyhf_set_freq_double(device, freq_hz);
+}
+
+// The DSP shift reaches the window plus the IF shift, both have to fit in the usable bandwidth
+static bool tuning_window_fits(airspyhf_device_t* device, uint32_t window_hz)
+{
+	double if_shift = (device->enable_dsp && !device->is_low_if) ? DEFAULT_IF_SHIFT : 0;
+
+	return window_hz + if_shift < device->current_samplerate * TUNING_WINDOW_BANDWIDTH / 2;
+}
+
+static uint32_t freq_lo_khz(airspyhf_device_t* device, const double freq_hz, double* adjusted_freq_hz)
+{
+	double if_shift = (device->enable_dsp && !device->is_low_if) ? DEFAULT_IF_SHIFT : 0;
+	uint32_t lo_low_khz = device->is_low_if ? MIN_LOW_IF_LO : MIN_ZERO_IF_LO;
+	uint32_t freq_khz;
+
+	*adjusted_freq_hz = freq_hz * (1.0e9 + device->calibration_ppb) * 1.0e-9;
+	freq_khz = MAX(lo_low_khz, (uint32_t)round((*adjusted_freq_hz + if_shift) * 1e-3));
+
+	// Within the tuning window the LO stays put and only the fine tuning moves,
+	// which takes effect at the next block without any USB traffic.
+	// The samplerate or the IF mode may have changed since the window was set.
+	// In zero IF, a target closer to the LO than the IF shift would sit on DC.
+	if (device->tuning_window_hz > 0 &&
+		tuning_window_fits(device, device->tuning_window_hz) &&
+		device->enable_dsp &&
+		device->freq_khz >= lo_low_khz &&
+		fabs(*adjusted_freq_hz + if_shift - device->freq_khz * 1e3) <= device->tuning_window_hz &&
+		fabs(*adjusted_freq_hz - device->freq_khz * 1e3) >= if_shift)
+	{
+		freq_khz = device->freq_khz;
+	}
+
+	return freq_khz;
+}
+
+static void freq_delta_update(airspyhf_device_t* device, const uint8_t* buf)
+{
+	device->freq_delta_hz = (((int8_t)buf[3] << 16) | (buf[2] << 8) | buf[1]) * 1e3 / (1 << buf[0]);
+}
+
+static freq_delta_entry_t* freq_delta_slot(airspyhf_device_t* device, uint32_t freq_khz, uint32_t samplerate, uint32_t frontend_options)
+{
+	uint32_t hash = (freq_khz ^ (samplerate << 7) ^ (frontend_options << 3)) * 2654435761u;
+
+	return &device->freq_delta_cache[hash >> (32 - FREQ_DELTA_CACHE_BITS)];
+}
+
+static void freq_delta_store(airspyhf_device_t* device, uint32_t freq_khz, const uint8_t* buf)
+{
+	freq_delta_entry_t* entry;
+
+	if (device->freq_delta_cache_enabled)
+	{
+		entry = freq_delta_slot(device, freq_khz, device->current_samplerate, device->frontend_options);
+		entry->freq_khz = freq_khz;
+		entry->samplerate = device->current_samplerate;
+		entry->frontend_options = device->frontend_options;
+		memcpy(entry->raw, buf, sizeof(entry->raw));
+	}
+}
+
+// Saves the GET_FREQ_DELTA round trip for an LO setting seen before
+static bool freq_delta_lookup(airspyhf_device_t* device, uint32_t freq_khz)
+{
+	freq_delta_entry_t* entry;
+
+	if (!device->freq_delta_cache_enabled)
+	{
+		return false;
+	}
+
+	entry = freq_delta_slot(device, freq_khz, device->current_samplerate, device->frontend_options);
+	if (entry->freq_khz != freq_khz ||
+		entry->samplerate != device->current_samplerate ||
+		entry->frontend_options != device->frontend_options)
+	{
+		return false;
+	}
+
+	freq_delta_update(device, entry->raw);
+	return true;
+}
+
+static void freq_apply(airspyhf_device_t* device, const double freq_hz, const double adjusted_freq_hz, const uint32_t freq_khz)
+{
+	device->freq_hz = freq_hz;
+	device->freq_shift = adjusted_freq_hz - freq_khz * 1e3 + device->freq_delta_hz;
+}
+
+int ADDCALL airspyhf_set_freq_double(airspyhf_device_t* device, const double freq_hz)
+{
+	int result;
+	uint8_t buf[4];
+	double adjusted_freq_hz;
+	uint32_t freq_khz = freq_lo_khz(device, freq_hz, &adjusted_freq_hz);
+
+	if (device->freq_khz != freq_khz)
+	{
+		buf[0] = (uint8_t)((freq_khz >> 24) & 0xff);
+		buf[1] = (uint8_t)((freq_khz >> 16) & 0xff);
+		buf[2] = (uint8_t)((freq_khz >> 8) & 0xff);
+		buf[3] = (uint8_t)((freq_khz) & 0xff);
+
+		result = device_control_transfer(
+			device,
+			LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+			AIRSPYHF_SET_FREQ,
+			0,
+			0,
+			(unsigned char*)&buf,
+			sizeof(buf),
+			LIBUSB_CTRL_TIMEOUT_MS);
+
+		if (result < sizeof(buf))
+		{
+			return AIRSPYHF_ERROR;
+		}
+
+		device->freq_khz = freq_khz;
+		retune_mark_lo(device);
+
+		if (!freq_delta_lookup(device, freq_khz))
+		{
+			result = device_control_transfer(
+				device,
+				LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+				AIRSPYHF_GET_FREQ_DELTA,
+				0,
+				0,
+				(unsigned char*)&buf,
+				sizeof(buf),
+				LIBUSB_CTRL_TIMEOUT_MS);
+
+			if (result == sizeof(buf))
+			{
+				freq_delta_update(device, buf);
+				freq_delta_store(device, freq_khz, buf);
+			}
+		}
+
+		iq_balancer_set_optimal_point(device->iq_balancer, device->optimal_point);
+	}
+
+	freq_apply(device, freq_hz, adjusted_freq_hz, freq_khz);
+
+	return AIRSPYHF_SUCCESS;
+}
+
+int ADDCALL airspyhf_set_tuning_window(airspyhf_device_t* device, uint32_t window_hz)
+{
+	if (window_hz > 0 && !tuning_window_fits(device, window_hz))
+	{
+		return AIRSPYHF_ERROR;
+	}
+
+	device->tuning_window_hz = window_hz;
+	return AIRSPYHF_SUCCESS;
+}
+
+int ADDCALL airspyhf_set_freq_delta_cache(airspyhf_device_t* device, uint8_t flag)
+{
+	device->freq_delta_cache_enabled = false;
+	memset(device->freq_delta_cache, 0, FREQ_DELTA_CACHE_SIZE * sizeof(freq_delta_entry_t));
+	device->freq_delta_cache_enabled = flag != 0;
+
+	return AIRSPYHF_SUCCESS;
+}
+
+// File layout: magic, firmware version string, entry count, entries in host byte order
+int ADDCALL airspyhf_load_freq_delta_cache(airspyhf_device_t* device, const char* path)
 {
-	int result1, result2;
-	device->stop_requested = true;
-	result1 = airspyhf_set_receiver_mode(device, RECEIVER_MODE_OFF);
-	result2 = kill_io_threads(device);
-
-#ifndef _WIN32
-	libusb_interrupt_event_handler(device->usb_context);
-#endif
+	char magic[sizeof(FREQ_DELTA_CACHE_MAGIC)];
+	char version[MAX_VERSION_STRING_SIZE];
+	char file_version[MAX_VERSION_STRING_SIZE];
+	freq_delta_entry_t entry;
+	uint32_t count;
+	FILE* file;
+	int result = AIRSPYHF_ERROR;
+
+	memset(version, 0, sizeof(version));
+	if (!device->freq_delta_cache_enabled ||
+		airspyhf_version_string_read(device, version, sizeof(version)) != AIRSPYHF_SUCCESS)
+	{
+		return AIRSPYHF_ERROR;
+	}
 
-	if (result2 != AIRSPYHF_SUCCESS)
+	file = fopen(path, "rb");
+	if (file == NULL)
 	{
-		return result2;
+		return AIRSPYHF_ERROR;
 	}
-	return result1;
-}
 
+	if (fread(magic, sizeof(magic), 1, file) == 1 &&
+		fread(file_version, sizeof(file_version), 1, file) == 1 &&
+		fread(&count, sizeof(count), 1, file) == 1 &&
+		memcmp(magic, FREQ_DELTA_CACHE_MAGIC, sizeof(magic)) == 0 &&
+		strncmp(file_version, version, sizeof(version)) == 0 &&
+		count <= FREQ_DELTA_CACHE_SIZE)
+	{
+		while (count > 0 && fread(&entry, sizeof(entry), 1, file) == 1)
+		{
+			if (entry.freq_khz != 0)
+			{
+				*freq_delta_slot(device, entry.freq_khz, entry.samplerate, entry.frontend_options) = entry;
+			}
+			count--;
+		}
+		result = count == 0 ? AIRSPYHF_SUCCESS : AIRSPYHF_ERROR;
+	}
 
-int ADDCALL airspyhf_set_freq(airspyhf_device_t* device, const uint32_t freq_hz)
-{
-	return airspyhf_set_freq_double(device, freq_hz);
+	fclose(file);
+	return result;
 }
 
-int ADDCALL airspyhf_set_freq_double(airspyhf_device_t* device, const double freq_hz)
+int ADDCALL airspyhf_save_freq_delta_cache(airspyhf_device_t* device, const char* path)
 {
-	int result;
-	uint8_t buf[4];
-	double if_shift = (device->enable_dsp && !device->is_low_if) ? DEFAULT_IF_SHIFT : 0;
-	double adjusted_freq_hz = freq_hz * (1.0e9 + device->calibration_ppb) * 1.0e-9;
-	uint32_t lo_low_khz = device->is_low_if ? MIN_LOW_IF_LO : MIN_ZERO_IF_LO;
-	uint32_t freq_khz = MAX(lo_low_khz, (uint32_t)round((adjusted_freq_hz + if_shift) * 1e-3));
+	char version[MAX_VERSION_STRING_SIZE];
+	uint32_t count = 0;
+	FILE* file;
+	int result = AIRSPYHF_SUCCESS;
 
-	if (device->freq_khz != freq_khz)
+	memset(version, 0, sizeof(version));
+	if (airspyhf_version_string_read(device, version, sizeof(version)) != AIRSPYHF_SUCCESS)
 	{
-		buf[0] = (uint8_t)((freq_khz >> 24) & 0xff);
-		buf[1] = (uint8_t)((freq_khz >> 16) & 0xff);
-		buf[2] = (uint8_t)((freq_khz >> 8) & 0xff);
-		buf[3] = (uint8_t)((freq_khz) & 0xff);
-
-		result = libusb_control_transfer(
-			device->usb_device,
-			LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-			AIRSPYHF_SET_FREQ,
-			0,
-			0,
-			(unsigned char*)&buf,
-			sizeof(buf),
-			LIBUSB_CTRL_TIMEOUT_MS);
+		return AIRSPYHF_ERROR;
+	}
+	memset(version + strlen(version), 0, sizeof(version) - strlen(version));
 
-		if (result < sizeof(buf))
+	for (uint32_t i = 0; i < FREQ_DELTA_CACHE_SIZE; i++)
+	{
+		if (device->freq_delta_cache[i].freq_khz != 0)
 		{
-			return AIRSPYHF_ERROR;
+			count++;
 		}
+	}
 
-		device->freq_khz = freq_khz;
+	file = fopen(path, "wb");
+	if (file == NULL)
+	{
+		return AIRSPYHF_ERROR;
+	}
 
-		result = libusb_control_transfer(
-			device->usb_device,
-			LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-			AIRSPYHF_GET_FREQ_DELTA,
-			0,
-			0,
-			(unsigned char*)&buf,
-			sizeof(buf),
-			LIBUSB_CTRL_TIMEOUT_MS);
+	if (fwrite(FREQ_DELTA_CACHE_MAGIC, sizeof(FREQ_DELTA_CACHE_MAGIC), 1, file) != 1 ||
+		fwrite(version, sizeof(version), 1, file) != 1 ||
+		fwrite(&count, sizeof(count), 1, file) != 1)
+	{
+		result = AIRSPYHF_ERROR;
+	}
 
-		if (result == sizeof(buf))
+	for (uint32_t i = 0; i < FREQ_DELTA_CACHE_SIZE && result == AIRSPYHF_SUCCESS; i++)
+	{
+		if (device->freq_delta_cache[i].freq_khz != 0 &&
+			fwrite(&device->freq_delta_cache[i], sizeof(freq_delta_entry_t), 1, file) != 1)
 		{
-			device->freq_delta_hz = (((int8_t)buf[3] << 16) | (buf[2] << 8) | buf[1]) * 1e3 / (1 << buf[0]);
+			result = AIRSPYHF_ERROR;
 		}
-
-		iq_balancer_set_optimal_point(device->iq_balancer, device->optimal_point);
 	}
 
-	device->freq_hz = freq_hz;
-	device->freq_shift = adjusted_freq_hz - freq_khz * 1e3 + device->freq_delta_hz;
+	if (fclose(file) != 0)
+	{
+		result = AIRSPYHF_ERROR;
+	}
 
-	return AIRSPYHF_SUCCESS;
+	return result;
 }
 
 int ADDCALL airspyhf_get_frontend_options(airspyhf_device_t* device, uint32_t* flags)
@@ -1435,9 +3421,10 @@ int ADDCALL airspyhf_set_frontend_options(airspyhf_device_t* device, uint32_t fl
 	int result;
 
 	device->frontend_options = flags;
+	device->frontend_options_applied = true;
 
-	result = libusb_control_transfer(
-		device->usb_device,
+	result = device_control_transfer(
+		device,
 		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
 		AIRSPYHF_SET_FRONTEND_OPTIONS,
 		(uint16_t)(flags & 0xffff),
@@ -1462,8 +3449,8 @@ static int airspyhf_config_write(airspyhf_device_t* device, uint8_t *buffer, uin
 
 	memcpy(buf, buffer, MIN(length, sizeof(buf)));
 
-	result = libusb_control_transfer(
-		device->usb_device,
+	result = device_control_transfer(
+		device,
 		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
 		AIRSPYHF_CONFIG_WRITE,
 		0,
@@ -1485,8 +3472,8 @@ static int airspyhf_config_read(airspyhf_device_t* device, uint8_t *buffer, uint
 	uint8_t buf[256];
 	int result;
 
-	result = libusb_control_transfer(
-		device->usb_device,
+	result = device_control_transfer(
+		device,
 		LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
 		AIRSPYHF_CONFIG_READ,
 		0,
@@ -1537,9 +3524,10 @@ int ADDCALL airspyhf_set_vctcxo_calibration(airspyhf_device_t* device, uint16_t
 {
 	int result;
 	device->calibration_vctcxo = vc;
+	device->vctcxo_applied = true;
 
-	result = libusb_control_transfer(
-		device->usb_device,
+	result = device_control_transfer(
+		device,
 		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
 		AIRSPYHF_SET_VCTCXO_CALIBRATION,
 		vc,
@@ -1595,14 +3583,40 @@ int ADDCALL airspyhf_set_lib_dsp(airspyhf_device_t* device, const uint8_t flag)
 	return AIRSPYHF_SUCCESS;
 }
 
+int ADDCALL airspyhf_set_nco_mode(airspyhf_device_t* device, enum airspyhf_nco_mode mode)
+{
+	if (mode != AIRSPYHF_NCO_RECURSIVE && mode != AIRSPYHF_NCO_PHASE_ACCUMULATOR)
+	{
+		return AIRSPYHF_ERROR;
+	}
+
+	device->nco_mode = mode;
+	return AIRSPYHF_SUCCESS;
+}
+
+int ADDCALL airspyhf_set_squelch(airspyhf_device_t* device, const uint8_t flag, float threshold_db, float hysteresis_db, uint32_t hang_time_ms)
+{
+	if (hysteresis_db < 0)
+	{
+		return AIRSPYHF_ERROR;
+	}
+
+	device->squelch_open_level = powf(10.0f, threshold_db * 0.1f);
+	device->squelch_close_level = powf(10.0f, (threshold_db - hysteresis_db) * 0.1f);
+	device->squelch_hang_time_ms = hang_time_ms;
+	device->squelch_enabled = flag != 0;
+
+	return AIRSPYHF_SUCCESS;
+}
+
 int ADDCALL airspyhf_board_partid_serialno_read(airspyhf_device_t* device, airspyhf_read_partid_serialno_t* read_partid_serialno)
 {
 	uint8_t length;
 	int result;
 
 	length = sizeof(airspyhf_read_partid_serialno_t);
-	result = libusb_control_transfer(
-		device->usb_device,
+	result = device_control_transfer(
+		device,
 		LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
 		AIRSPYHF_GET_SERIALNO_BOARDID,
 		0,
@@ -1624,8 +3638,8 @@ int ADDCALL airspyhf_version_string_read(airspyhf_device_t* device, char* versio
 	int result;
 	char version_local[MAX_VERSION_STRING_SIZE];
 
-	result = libusb_control_transfer(
-		device->usb_device,
+	result = device_control_transfer(
+		device,
 		LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
 		AIRSPYHF_GET_VERSION_STRING,
 		0,
@@ -1671,22 +3685,26 @@ int ADDCALL airspyhf_get_att_steps(airspyhf_device_t* device, void* buffer, cons
 	return AIRSPYHF_SUCCESS;
 }
 
-int ADDCALL airspyhf_set_att(airspyhf_device_t* device, float att)
+static uint16_t att_step_index(airspyhf_device_t* device, float att)
 {
-	int result;
-	uint16_t att_index = 0;
-
 	for (uint32_t i = 0; i < device->supported_att_step_count; i++)
 	{
 		if (device->supported_att_steps[i] >= att)
 		{
-			att_index = i;
-			break;
+			return (uint16_t) i;
 		}
 	}
 
-	result = libusb_control_transfer(
-		device->usb_device,
+	return 0;
+}
+
+int ADDCALL airspyhf_set_att(airspyhf_device_t* device, float att)
+{
+	int result;
+	uint16_t att_index = att_step_index(device, att);
+
+	result = device_control_transfer(
+		device,
 		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
 		AIRSPYHF_SET_ATT,
 		att_index,
@@ -1700,6 +3718,8 @@ int ADDCALL airspyhf_set_att(airspyhf_device_t* device, float att)
 		return AIRSPYHF_ERROR;
 	}
 
+	remember_setting(device, AIRSPYHF_SET_ATT, att_index);
+
 	return AIRSPYHF_SUCCESS;
 }
 
@@ -1707,8 +3727,8 @@ int ADDCALL airspyhf_set_bias_tee(airspyhf_device_t* device, int8_t value)
 {
 	int result;
 
-	result = libusb_control_transfer(
-		device->usb_device,
+	result = device_control_transfer(
+		device,
 		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
 		AIRSPYHF_SET_BIAS_TEE,
 		(uint16_t)value,
@@ -1722,6 +3742,8 @@ int ADDCALL airspyhf_set_bias_tee(airspyhf_device_t* device, int8_t value)
 		return AIRSPYHF_ERROR;
 	}
 
+	remember_setting(device, AIRSPYHF_SET_BIAS_TEE, (uint16_t) value);
+
 	return AIRSPYHF_SUCCESS;
 }
 
@@ -1731,8 +3753,8 @@ int ADDCALL airspyhf_get_bias_tee_count(airspyhf_device_t* device, int32_t* valu
 	int result;
 
 	length = sizeof(int32_t);
-	result = libusb_control_transfer(
-		device->usb_device,
+	result = device_control_transfer(
+		device,
 		LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
 		AIRSPYHF_GET_BIAS_TEE_COUNT,
 		0,
@@ -1755,8 +3777,8 @@ int ADDCALL airspyhf_get_bias_tee_name(airspyhf_device_t* device, int32_t index,
 	int result;
 	char name_local[MAX_NAME_STRING_SIZE];
 
-	result = libusb_control_transfer(
-		device->usb_device,
+	result = device_control_transfer(
+		device,
 		LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
 		AIRSPYHF_GET_BIAS_TEE_NAME,
 		0,
@@ -1790,8 +3812,8 @@ int ADDCALL airspyhf_set_hf_att(airspyhf_device_t* device, uint8_t att_index)
 {
 	int result;
 
-	result = libusb_control_transfer(
-		device->usb_device,
+	result = device_control_transfer(
+		device,
 		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
 		AIRSPYHF_SET_ATT,
 		(uint16_t)att_index,
@@ -1805,6 +3827,8 @@ int ADDCALL airspyhf_set_hf_att(airspyhf_device_t* device, uint8_t att_index)
 		return AIRSPYHF_ERROR;
 	}
 
+	remember_setting(device, AIRSPYHF_SET_ATT, att_index);
+
 	return AIRSPYHF_SUCCESS;
 }
 
@@ -1812,8 +3836,8 @@ int ADDCALL airspyhf_set_hf_lna(airspyhf_device_t* device, uint8_t flag)
 {
 	int result;
 
-	result = libusb_control_transfer(
-		device->usb_device,
+	result = device_control_transfer(
+		device,
 		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
 		AIRSPYHF_SET_LNA,
 		(uint16_t) flag,
@@ -1827,6 +3851,8 @@ int ADDCALL airspyhf_set_hf_lna(airspyhf_device_t* device, uint8_t flag)
 		return AIRSPYHF_ERROR;
 	}
 
+	remember_setting(device, AIRSPYHF_SET_LNA, flag);
+
 	return AIRSPYHF_SUCCESS;
 }
 
@@ -1834,8 +3860,8 @@ int ADDCALL airspyhf_set_user_output(airspyhf_device_t* device, airspyhf_user_ou
 {
 	int result;
 
-	result = libusb_control_transfer(
-		device->usb_device,
+	result = device_control_transfer(
+		device,
 		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
 		AIRSPYHF_SET_USER_OUTPUT,
 		(uint16_t)pin,
@@ -1856,8 +3882,8 @@ int ADDCALL airspyhf_set_hf_agc(airspyhf_device_t* device, uint8_t flag)
 {
 	int result;
 
-	result = libusb_control_transfer(
-		device->usb_device,
+	result = device_control_transfer(
+		device,
 		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
 		AIRSPYHF_SET_AGC,
 		(uint16_t)flag,
@@ -1871,6 +3897,8 @@ int ADDCALL airspyhf_set_hf_agc(airspyhf_device_t* device, uint8_t flag)
 		return AIRSPYHF_ERROR;
 	}
 
+	remember_setting(device, AIRSPYHF_SET_AGC, flag);
+
 	return AIRSPYHF_SUCCESS;
 }
 
@@ -1878,8 +3906,8 @@ int ADDCALL airspyhf_set_hf_agc_threshold(airspyhf_device_t* device, uint8_t fla
 {
 	int result;
 
-	result = libusb_control_transfer(
-		device->usb_device,
+	result = device_control_transfer(
+		device,
 		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
 		AIRSPYHF_SET_AGC_THRESHOLD,
 		(uint16_t)flag,
@@ -1893,5 +3921,310 @@ int ADDCALL airspyhf_set_hf_agc_threshold(airspyhf_device_t* device, uint8_t fla
 		return AIRSPYHF_ERROR;
 	}
 
+	remember_setting(device, AIRSPYHF_SET_AGC_THRESHOLD, flag);
+
+	return AIRSPYHF_SUCCESS;
+}
+
+// Asynchronous commands
+//
+// While streaming, the commands are queued and sent one at a time as asynchronous control
+// transfers. The transfer thread completes them and runs the callbacks, which must not block.
+// When not streaming, nothing drives the event loop and the command runs on the caller's thread.
+
+#define COMMAND_PENDING (1)
+
+static void LIBUSB_CALL command_transfer_callback(struct libusb_transfer* transfer);
+
+static int command_submit(airspyhf_device_t* device, uint8_t request_type, uint8_t request, uint16_t value, const uint8_t* data, uint16_t length)
+{
+	int result;
+
+	libusb_fill_control_setup(device->command_buffer, request_type | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE, request, value, 0, length);
+	if (data != NULL)
+	{
+		memcpy(device->command_buffer + LIBUSB_CONTROL_SETUP_SIZE, data, length);
+	}
+
+	pthread_mutex_lock(&device->handle_mp);
+	libusb_fill_control_transfer(device->command_transfer, device->usb_device, device->command_buffer, command_transfer_callback, device, LIBUSB_CTRL_TIMEOUT_MS);
+	result = libusb_submit_transfer(device->command_transfer);
+	pthread_mutex_unlock(&device->handle_mp);
+
+	return result == 0 ? COMMAND_PENDING : AIRSPYHF_ERROR;
+}
+
+// Returns COMMAND_PENDING once a transfer is in flight, or the result of the command
+static int command_start(airspyhf_device_t* device, airspyhf_command_t* command)
+{
+	uint8_t buf[4];
+
+	if (!device->streaming || device->stop_requested)
+	{
+		return AIRSPYHF_ERROR;
+	}
+
+	if (command->request != AIRSPYHF_SET_FREQ)
+	{
+		return command_submit(device, LIBUSB_ENDPOINT_OUT, command->request, command->value, NULL, 0);
+	}
+
+	command->freq_khz = freq_lo_khz(device, command->freq_hz, &command->adjusted_freq_hz);
+	if (device->freq_khz == command->freq_khz)
+	{
+		freq_apply(device, command->freq_hz, command->adjusted_freq_hz, command->freq_khz);
+		return AIRSPYHF_SUCCESS;
+	}
+
+	buf[0] = (uint8_t)((command->freq_khz >> 24) & 0xff);
+	buf[1] = (uint8_t)((command->freq_khz >> 16) & 0xff);
+	buf[2] = (uint8_t)((command->freq_khz >> 8) & 0xff);
+	buf[3] = (uint8_t)((command->freq_khz) & 0xff);
+
+	return command_submit(device, LIBUSB_ENDPOINT_OUT, AIRSPYHF_SET_FREQ, 0, buf, sizeof(buf));
+}
+
+static void command_finish(airspyhf_device_t* device, airspyhf_command_t* command, int result)
+{
+	if (result == AIRSPYHF_SUCCESS)
+	{
+		remember_setting(device, command->request, command->value);
+	}
+
+	pthread_mutex_lock(&device->command_mp);
+	device->command_head = command->next;
+	if (device->command_head == NULL)
+	{
+		device->command_tail = NULL;
+	}
+	device->command_busy = false;
+	pthread_cond_broadcast(&device->command_cv);
+	pthread_mutex_unlock(&device->command_mp);
+
+	if (command->callback != NULL)
+	{
+		command->callback(device, result, command->ctx);
+	}
+	free(command);
+}
+
+// Starts the commands at the head of the queue until one needs a transfer
+static void command_pump(airspyhf_device_t* device)
+{
+	airspyhf_command_t* command;
+	int result;
+
+	while (true)
+	{
+		pthread_mutex_lock(&device->command_mp);
+		command = device->command_head;
+		if (device->command_busy || command == NULL)
+		{
+			pthread_mutex_unlock(&device->command_mp);
+			return;
+		}
+		device->command_busy = true;
+		pthread_mutex_unlock(&device->command_mp);
+
+		result = command_start(device, command);
+		if (result == COMMAND_PENDING)
+		{
+			return;
+		}
+		command_finish(device, command, result);
+	}
+}
+
+static void LIBUSB_CALL command_transfer_callback(struct libusb_transfer* transfer)
+{
+	airspyhf_device_t* device = (airspyhf_device_t*) transfer->user_data;
+	airspyhf_command_t* command = device->command_head;
+	int result = transfer->status == LIBUSB_TRANSFER_COMPLETED ? AIRSPYHF_SUCCESS : AIRSPYHF_ERROR;
+
+	if (command->request == AIRSPYHF_SET_FREQ && result == AIRSPYHF_SUCCESS)
+	{
+		device->freq_khz = command->freq_khz;
+		retune_mark_lo(device);
+		command->request = AIRSPYHF_GET_FREQ_DELTA;
+		if (freq_delta_lookup(device, command->freq_khz))
+		{
+			iq_balancer_set_optimal_point(device->iq_balancer, device->optimal_point);
+			freq_apply(device, command->freq_hz, command->adjusted_freq_hz, command->freq_khz);
+			command_finish(device, command, AIRSPYHF_SUCCESS);
+			command_pump(device);
+			return;
+		}
+		if (command_submit(device, LIBUSB_ENDPOINT_IN, AIRSPYHF_GET_FREQ_DELTA, 0, NULL, 4) == COMMAND_PENDING)
+		{
+			return;
+		}
+		result = AIRSPYHF_ERROR;
+	}
+
+	if (command->request == AIRSPYHF_GET_FREQ_DELTA)
+	{
+		// Same as the blocking path, the previous delta is kept when it can't be read
+		if (result == AIRSPYHF_SUCCESS && transfer->actual_length == 4)
+		{
+			freq_delta_update(device, libusb_control_transfer_get_data(transfer));
+			freq_delta_store(device, command->freq_khz, libusb_control_transfer_get_data(transfer));
+		}
+		iq_balancer_set_optimal_point(device->iq_balancer, device->optimal_point);
+		freq_apply(device, command->freq_hz, command->adjusted_freq_hz, command->freq_khz);
+		result = AIRSPYHF_SUCCESS;
+	}
+
+	command_finish(device, command, result);
+	command_pump(device);
+}
+
+// Runs on the transfer thread once it left the streaming loop, as it owns the event loop.
+// The remaining commands complete with AIRSPYHF_ERROR.
+static void command_drain(airspyhf_device_t* device)
+{
+	struct timeval timeout = { 0, 10000 };
+
+	if (device->command_busy)
+	{
+		libusb_cancel_transfer(device->command_transfer);
+		while (device->command_busy)
+		{
+			libusb_handle_events_timeout_completed(device->usb_context, &timeout, NULL);
+		}
+	}
+
+	command_pump(device);
+
+	// Wakes the waiters even when the queue was already empty
+	pthread_mutex_lock(&device->command_mp);
+	pthread_cond_broadcast(&device->command_cv);
+	pthread_mutex_unlock(&device->command_mp);
+}
+
+// Called once streaming stopped. The thread running the event loop fails the remaining commands,
+// command_drain() for a device of its own or the callback for a hub device, this only waits for it.
+static void command_cancel(airspyhf_device_t* device)
+{
+	pthread_mutex_lock(&device->command_mp);
+	if (device->command_busy)
+	{
+		libusb_cancel_transfer(device->command_transfer);
+	}
+	while (device->command_head != NULL)
+	{
+		pthread_cond_wait(&device->command_cv, &device->command_mp);
+	}
+	pthread_mutex_unlock(&device->command_mp);
+}
+
+static int command_enqueue(airspyhf_device_t* device, uint8_t request, uint16_t value, double freq_hz, airspyhf_command_cb_fn callback, void* ctx)
+{
+	airspyhf_command_t* command;
+	int result;
+
+	if (!device->streaming || device->stop_requested)
+	{
+		if (request == AIRSPYHF_SET_FREQ)
+		{
+			result = airspyhf_set_freq_double(device, freq_hz);
+		}
+		else
+		{
+			result = device_control_transfer(
+				device,
+				LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+				request,
+				value,
+				0,
+				NULL,
+				0,
+				LIBUSB_CTRL_TIMEOUT_MS) < 0 ? AIRSPYHF_ERROR : AIRSPYHF_SUCCESS;
+			if (result == AIRSPYHF_SUCCESS)
+			{
+				remember_setting(device, request, value);
+			}
+		}
+
+		if (callback != NULL)
+		{
+			callback(device, result, ctx);
+		}
+		return AIRSPYHF_SUCCESS;
+	}
+
+	command = (airspyhf_command_t *) malloc(sizeof(airspyhf_command_t));
+	if (command == NULL)
+	{
+		return AIRSPYHF_ERROR;
+	}
+	command->next = NULL;
+	command->request = request;
+	command->value = value;
+	command->freq_hz = freq_hz;
+	command->callback = callback;
+	command->ctx = ctx;
+
+	pthread_mutex_lock(&device->command_mp);
+	if (device->command_tail != NULL)
+	{
+		device->command_tail->next = command;
+	}
+	else
+	{
+		device->command_head = command;
+	}
+	device->command_tail = command;
+	pthread_mutex_unlock(&device->command_mp);
+
+	command_pump(device);
+
+	return AIRSPYHF_SUCCESS;
+}
+
+int ADDCALL airspyhf_set_freq_async(airspyhf_device_t* device, const double freq_hz, airspyhf_command_cb_fn callback, void* ctx)
+{
+	return command_enqueue(device, AIRSPYHF_SET_FREQ, 0, freq_hz, callback, ctx);
+}
+
+int ADDCALL airspyhf_set_att_async(airspyhf_device_t* device, float value, airspyhf_command_cb_fn callback, void* ctx)
+{
+	return command_enqueue(device, AIRSPYHF_SET_ATT, att_step_index(device, value), 0, callback, ctx);
+}
+
+int ADDCALL airspyhf_set_bias_tee_async(airspyhf_device_t* device, int8_t value, airspyhf_command_cb_fn callback, void* ctx)
+{
+	return command_enqueue(device, AIRSPYHF_SET_BIAS_TEE, (uint16_t) value, 0, callback, ctx);
+}
+
+int ADDCALL airspyhf_set_hf_agc_async(airspyhf_device_t* device, uint8_t flag, airspyhf_command_cb_fn callback, void* ctx)
+{
+	return command_enqueue(device, AIRSPYHF_SET_AGC, (uint16_t) flag, 0, callback, ctx);
+}
+
+int ADDCALL airspyhf_set_hf_agc_threshold_async(airspyhf_device_t* device, uint8_t flag, airspyhf_command_cb_fn callback, void* ctx)
+{
+	return command_enqueue(device, AIRSPYHF_SET_AGC_THRESHOLD, (uint16_t) flag, 0, callback, ctx);
+}
+
+int ADDCALL airspyhf_set_hf_att_async(airspyhf_device_t* device, uint8_t att_index, airspyhf_command_cb_fn callback, void* ctx)
+{
+	return command_enqueue(device, AIRSPYHF_SET_ATT, (uint16_t) att_index, 0, callback, ctx);
+}
+
+int ADDCALL airspyhf_set_hf_lna_async(airspyhf_device_t* device, uint8_t flag, airspyhf_command_cb_fn callback, void* ctx)
+{
+	return command_enqueue(device, AIRSPYHF_SET_LNA, (uint16_t) flag, 0, callback, ctx);
+}
+
+int ADDCALL airspyhf_wait_commands(airspyhf_device_t* device)
+{
+	// If streaming stops meanwhile, the transfer thread fails the leftovers before it parks
+	pthread_mutex_lock(&device->command_mp);
+	while (device->command_head != NULL)
+	{
+		pthread_cond_wait(&device->command_cv, &device->command_mp);
+	}
+	pthread_mutex_unlock(&device->command_mp);
+
 	return AIRSPYHF_SUCCESS;
 }
@@ -73,6 +73,21 @@ typedef struct {
 	float im;
 } airspyhf_complex_float_t;
 
+typedef struct {
+	uint16_t re;
+	uint16_t im;
+} airspyhf_complex_float16_t; /* IEEE 754 half precision */
+
+typedef struct {
+	int8_t re;
+	int8_t im;
+} airspyhf_complex_int8_t;
+
+typedef struct {
+	int16_t re;
+	int16_t im;
+} airspyhf_complex_int16_t;
+
 typedef struct {
 	uint32_t part_id;
 	uint32_t serial_no[4];
@@ -87,16 +102,69 @@ enum airspyhf_board_id
 	AIRSPYHF_BOARD_ID_INVALID = 0xFF,
 };
 
+enum airspyhf_nco_mode
+{
+	AIRSPYHF_NCO_RECURSIVE = 0,           /* Recursive phasor, the historical default */
+	AIRSPYHF_NCO_PHASE_ACCUMULATOR = 1    /* 32-bit phase accumulator with lookup table: exact frequency, no drift */
+};
+
+enum airspyhf_sample_type
+{
+	AIRSPYHF_SAMPLE_FLOAT32_IQ = 0,   /* airspyhf_complex_float_t, the default */
+	AIRSPYHF_SAMPLE_FLOAT16_IQ = 1,   /* airspyhf_complex_float16_t */
+	AIRSPYHF_SAMPLE_INT8_IQ = 2,      /* airspyhf_complex_int8_t, scaled per block: value = sample * 2^scale_exponent */
+	AIRSPYHF_SAMPLE_INT16_IQ = 3      /* airspyhf_complex_int16_t, fixed scale: value = sample * 2^-15, saturated */
+};
+
+enum airspyhf_thread
+{
+	AIRSPYHF_THREAD_TRANSFER = 0,     /* Runs the libusb event loop */
+	AIRSPYHF_THREAD_CONSUMER = 1      /* Converts the samples and calls the callback */
+};
+
+enum airspyhf_sched_policy
+{
+	AIRSPYHF_SCHED_DEFAULT = 0,       /* Left as created */
+	AIRSPYHF_SCHED_FIFO = 1,
+	AIRSPYHF_SCHED_RR = 2
+};
+
+typedef struct {
+	enum airspyhf_sched_policy policy;
+	int priority; /* sched_priority for AIRSPYHF_SCHED_FIFO and AIRSPYHF_SCHED_RR, 1 to 99 on Linux */
+	uint64_t cpu_mask; /* Bit n allows CPU n, 0 leaves the affinity alone */
+	char name[16]; /* Thread name, empty leaves it alone */
+} airspyhf_thread_policy_t;
+
 typedef struct airspyhf_device airspyhf_device_t;
+typedef struct airspyhf_hub airspyhf_hub_t;
 
 typedef struct {
 	airspyhf_device_t* device;
 	void* ctx;
-	airspyhf_complex_float_t* samples;
+	airspyhf_complex_float_t* samples; /* Cast according to sample_type */
 	int sample_count;
 	uint64_t dropped_samples;
+	enum airspyhf_sample_type sample_type;
+	int scale_exponent; /* AIRSPYHF_SAMPLE_INT8_IQ and AIRSPYHF_SAMPLE_INT16_IQ only, see ldexpf() */
+	uint64_t gated_samples; /* Samples withheld by the squelch since the previous callback */
+	uint32_t flags; /* AIRSPYHF_TRANSFER_FLAG_* */
+	uint64_t sample_index; /* Position of samples[0] since airspyhf_start(), dropped and gated samples included */
 } airspyhf_transfer_t;
 
+#define AIRSPYHF_TRANSFER_FLAG_GAP (1 << 0) /* First block after the receiver was reattached, the samples before it are not contiguous */
+#define AIRSPYHF_TRANSFER_FLAG_RETUNE (1 << 1) /* Block entirely at the frequency set last, the samples before it may belong to the previous one. Conservative, a few blocks before it may already be at the new frequency */
+
+typedef struct {
+	uint32_t transfer_depth; /* USB transfers currently kept in flight */
+	uint32_t transfer_depth_min;
+	uint32_t transfer_depth_max;
+	uint32_t completion_jitter_us; /* Worst delay between two transfer completions beyond the block period, last window */
+	uint32_t queue_peak; /* Most blocks waiting for the callback, last window */
+	uint64_t transfers_completed;
+	uint64_t dropped_buffers; /* Blocks lost because the callback fell behind */
+} airspyhf_stats_t;
+
 typedef struct {
 	uint32_t major_version;
 	uint32_t minor_version;
@@ -111,21 +179,38 @@ typedef struct {
 #define AIRSPYHF_FLAGS_OPTIMIZE_PLL_INT_BOUNDARY  2
 
 typedef int (*airspyhf_sample_block_cb_fn) (airspyhf_transfer_t* transfer_fn);
+typedef void (*airspyhf_command_cb_fn) (airspyhf_device_t* device, int result, void* ctx); /* Result of an asynchronous command, runs on the transfer thread while streaming */
 
 extern ADDAPI void ADDCALL airspyhf_lib_version(airspyhf_lib_version_t* lib_version);
 extern ADDAPI int ADDCALL airspyhf_list_devices(uint64_t *serials, int count);
+extern ADDAPI int ADDCALL airspyhf_set_capability_cache_dir(const char* path); /* Devices opened afterwards cache their capabilities in path, checked against the firmware version. NULL = off (default) */
 extern ADDAPI int ADDCALL airspyhf_open(airspyhf_device_t** device);
 extern ADDAPI int ADDCALL airspyhf_open_sn(airspyhf_device_t** device, uint64_t serial_number);
 extern ADDAPI int ADDCALL airspyhf_open_fd(airspyhf_device_t** device, int fd);
 extern ADDAPI int ADDCALL airspyhf_close(airspyhf_device_t* device);
+extern ADDAPI int ADDCALL airspyhf_hub_create(airspyhf_hub_t** hub, int consumer_threads); /* One libusb context and event thread for all the devices opened through the hub, callbacks run on a pool of consumer_threads */
+extern ADDAPI int ADDCALL airspyhf_hub_destroy(airspyhf_hub_t* hub); /* Fails while devices opened through the hub are still open */
+extern ADDAPI int ADDCALL airspyhf_hub_open(airspyhf_hub_t* hub, airspyhf_device_t** device);
+extern ADDAPI int ADDCALL airspyhf_hub_open_sn(airspyhf_hub_t* hub, airspyhf_device_t** device, uint64_t serial_number);
 extern ADDAPI int ADDCALL airspyhf_get_output_size(airspyhf_device_t* device); /* Returns the number of IQ samples to expect in the callback */
+extern ADDAPI int ADDCALL airspyhf_set_thread_policy(airspyhf_device_t* device, enum airspyhf_thread thread, const airspyhf_thread_policy_t* policy); /* Linux only (not Android), applied now when streaming and at every start. Not for hub devices */
+extern ADDAPI int ADDCALL airspyhf_set_transfer_depth(airspyhf_device_t* device, uint32_t min_depth, uint32_t max_depth); /* Bounds for the adaptive USB transfer depth, 2 to 32, min = max fixes it. Default is 16 to 32 */
+extern ADDAPI int ADDCALL airspyhf_get_stats(airspyhf_device_t* device, airspyhf_stats_t* stats);
+extern ADDAPI int ADDCALL airspyhf_set_sample_type(airspyhf_device_t* device, enum airspyhf_sample_type sample_type);
 extern ADDAPI int ADDCALL airspyhf_start(airspyhf_device_t* device, airspyhf_sample_block_cb_fn callback, void* ctx);
 extern ADDAPI int ADDCALL airspyhf_stop(airspyhf_device_t* device);
+extern ADDAPI int ADDCALL airspyhf_set_auto_recovery(airspyhf_device_t* device, uint8_t flag); /* 1 = when the stream fails, reattach the receiver by serial number, restore its settings and resume with AIRSPYHF_TRANSFER_FLAG_GAP. Not for hub devices */
 extern ADDAPI int ADDCALL airspyhf_is_streaming(airspyhf_device_t* device);
 extern ADDAPI int ADDCALL airspyhf_is_low_if(airspyhf_device_t* device); /* Tells if the current sample rate is Zero-IF (0) or Low-IF (1) */
 extern ADDAPI int ADDCALL airspyhf_set_freq(airspyhf_device_t* device, const uint32_t freq_hz);
 extern ADDAPI int ADDCALL airspyhf_set_freq_double(airspyhf_device_t* device, const double freq_hz);
+extern ADDAPI int ADDCALL airspyhf_set_tuning_window(airspyhf_device_t* device, uint32_t window_hz); /* Retunes within +/- window_hz of the LO are done in the DSP only, the window plus the IF shift must fit well within samplerate/2. 0 = off */
+extern ADDAPI int ADDCALL airspyhf_set_freq_delta_cache(airspyhf_device_t* device, uint8_t flag); /* Clears the LO delta cache, 1 = revisited frequencies skip the delta query (default), 0 = off */
+extern ADDAPI int ADDCALL airspyhf_load_freq_delta_cache(airspyhf_device_t* device, const char* path); /* Fails when the file was saved with another firmware */
+extern ADDAPI int ADDCALL airspyhf_save_freq_delta_cache(airspyhf_device_t* device, const char* path);
 extern ADDAPI int ADDCALL airspyhf_set_lib_dsp(airspyhf_device_t* device, const uint8_t flag); /* Enables/Disables the IQ Correction, IF shift and Fine Tuning. */
+extern ADDAPI int ADDCALL airspyhf_set_nco_mode(airspyhf_device_t* device, enum airspyhf_nco_mode mode); /* Selects the oscillator used for Fine Tuning. */
+extern ADDAPI int ADDCALL airspyhf_set_squelch(airspyhf_device_t* device, const uint8_t flag, float threshold_db, float hysteresis_db, uint32_t hang_time_ms); /* Skips the callback for blocks below threshold_db (dBFS) */
 extern ADDAPI int ADDCALL airspyhf_get_samplerates(airspyhf_device_t* device, uint32_t* buffer, const uint32_t len);
 extern ADDAPI int ADDCALL airspyhf_set_samplerate(airspyhf_device_t* device, uint32_t samplerate);
 extern ADDAPI int ADDCALL airspyhf_set_att(airspyhf_device_t* device, float value);
@@ -145,6 +230,18 @@ extern ADDAPI int ADDCALL airspyhf_flash_configuration(airspyhf_device_t* device
 extern ADDAPI int ADDCALL airspyhf_board_partid_serialno_read(airspyhf_device_t* device, airspyhf_read_partid_serialno_t* read_partid_serialno);
 extern ADDAPI int ADDCALL airspyhf_version_string_read(airspyhf_device_t* device, char* version, uint8_t length);
 
+// Asynchronous commands: queued while streaming and completed in order through the callback (may be NULL).
+// AIRSPYHF_ERROR means the command was not queued and the callback will not run.
+
+extern ADDAPI int ADDCALL airspyhf_set_freq_async(airspyhf_device_t* device, const double freq_hz, airspyhf_command_cb_fn callback, void* ctx);
+extern ADDAPI int ADDCALL airspyhf_set_att_async(airspyhf_device_t* device, float value, airspyhf_command_cb_fn callback, void* ctx);
+extern ADDAPI int ADDCALL airspyhf_set_bias_tee_async(airspyhf_device_t* device, int8_t value, airspyhf_command_cb_fn callback, void* ctx);
+extern ADDAPI int ADDCALL airspyhf_set_hf_agc_async(airspyhf_device_t* device, uint8_t flag, airspyhf_command_cb_fn callback, void* ctx);
+extern ADDAPI int ADDCALL airspyhf_set_hf_agc_threshold_async(airspyhf_device_t* device, uint8_t flag, airspyhf_command_cb_fn callback, void* ctx);
+extern ADDAPI int ADDCALL airspyhf_set_hf_att_async(airspyhf_device_t* device, uint8_t att_index, airspyhf_command_cb_fn callback, void* ctx);
+extern ADDAPI int ADDCALL airspyhf_set_hf_lna_async(airspyhf_device_t* device, uint8_t flag, airspyhf_command_cb_fn callback, void* ctx);
+extern ADDAPI int ADDCALL airspyhf_wait_commands(airspyhf_device_t* device); /* Blocks until the queued commands completed, not to be called from a command callback */
+
 // Legacy stuff for backward compatibility
 
 typedef enum
@@ -0,0 +1,280 @@
+/*
+ * This file is part of AirSpyHF+.
+ *
+ * Decompresses captures written by airspyhf_rx -C into raw CS16 or WAV.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdint.h>
+
+#include "iq_codec.h"
+
+#ifdef _MSC_VER
+#define fseeko _fseeki64
+#define ftello _ftelli64
+#define strtoull _strtoui64
+typedef int64_t off_t;
+#endif
+
+typedef struct
+{
+	char groupID[4]; /* 'RIFF' */
+	uint32_t size;
+	char riffType[4]; /* 'WAVE' */
+	char fmtID[4]; /* 'fmt ' */
+	uint32_t fmtSize; /* 16 */
+	uint16_t wFormatTag; /* 1=PCM */
+	uint16_t wChannels;
+	uint32_t dwSamplesPerSec;
+	uint32_t dwAvgBytesPerSec;
+	uint16_t wBlockAlign;
+	uint16_t wBitsPerSample;
+	char dataID[4]; /* 'data' */
+	uint32_t dataSize;
+} t_wav_hdr;
+
+static void usage(void)
+{
+	fprintf(stderr,
+	"airspyhf_decompress\n"
+	"Usage:\n"
+	"\t-i <filename>\t\tCompressed capture written by airspyhf_rx -C\n"
+	"\t-o <filename>\t\tOutput CS16 IQ file; stdout emits values on standard output\n"
+	"\t-w\t\t\tWrite a WAV header\n"
+	"\t-t <seconds>\t\tStart offset in seconds\n"
+	"\t-n <#samples>\t\tNumber of samples to extract (default is all)\n"
+	);
+}
+
+/* Uses the index when the capture was closed properly, walks the blocks otherwise */
+static uint64_t* load_index(FILE* in, const iq_codec_file_hdr_t* hdr, uint32_t* block_count)
+{
+	iq_codec_index_hdr_t index_hdr;
+	iq_codec_block_hdr_t block_hdr;
+	uint64_t* index = NULL;
+	uint64_t* grown;
+	uint32_t size = 0;
+	off_t offset;
+
+	*block_count = 0;
+
+	if (hdr->index_offset != 0) {
+		if (fseeko(in, (off_t) hdr->index_offset, SEEK_SET) != 0 ||
+			fread(&index_hdr, sizeof(index_hdr), 1, in) != 1 ||
+			memcmp(index_hdr.magic, "AHFI", 4) != 0)
+			return NULL;
+		index = (uint64_t*) malloc(((size_t) index_hdr.block_count + 1) * sizeof(uint64_t));
+		if (index == NULL || fread(index, sizeof(uint64_t), index_hdr.block_count, in) != index_hdr.block_count) {
+			free(index);
+			return NULL;
+		}
+		*block_count = index_hdr.block_count;
+		return index;
+	}
+
+	fprintf(stderr, "No index, the capture was not closed properly: scanning blocks\n");
+	offset = (off_t) sizeof(iq_codec_file_hdr_t);
+	while (fseeko(in, offset, SEEK_SET) == 0 &&
+		fread(&block_hdr, sizeof(block_hdr), 1, in) == 1 &&
+		memcmp(block_hdr.magic, "AHFB", 4) == 0) {
+		if (*block_count == size) {
+			size = size ? size * 2 : 1024;
+			grown = (uint64_t*) realloc(index, size * sizeof(uint64_t));
+			if (grown == NULL) {
+				free(index);
+				return NULL;
+			}
+			index = grown;
+		}
+		index[(*block_count)++] = (uint64_t) offset;
+		offset += (off_t) (sizeof(block_hdr) + block_hdr.payload_size);
+	}
+
+	return index;
+}
+
+int main(int argc, char** argv)
+{
+	int opt;
+	const char* in_path = NULL;
+	const char* out_path = NULL;
+	int wav = 0;
+	double start_seconds = 0.0;
+	uint64_t samples_left = UINT64_MAX;
+
+	FILE* in = NULL;
+	FILE* out = NULL;
+	iq_codec_file_hdr_t hdr;
+	iq_codec_block_hdr_t block_hdr;
+	t_wav_hdr wav_hdr;
+	uint64_t* index = NULL;
+	uint32_t block_count;
+	uint32_t block;
+	uint64_t start_frame;
+	uint32_t skip;
+	uint32_t count;
+	uint64_t written = 0;
+	uint8_t* payload = NULL;
+	int16_t* iq = NULL;
+	int result = EXIT_FAILURE;
+
+	while( (opt = getopt(argc, argv, "i:o:wt:n:h")) != EOF )
+	{
+		switch( opt )
+		{
+			case 'i':
+				in_path = optarg;
+			break;
+
+			case 'o':
+				out_path = optarg;
+			break;
+
+			case 'w':
+				wav = 1;
+			break;
+
+			case 't':
+				start_seconds = atof(optarg);
+				if (start_seconds < 0.0)
+					goto exit_usage;
+			break;
+
+			case 'n':
+				samples_left = strtoull(optarg, NULL, 10);
+			break;
+
+			default:
+				goto exit_usage;
+		}
+	}
+
+	if (in_path == NULL || out_path == NULL)
+		goto exit_usage;
+
+	if (!(in = fopen(in_path, "rb"))) {
+		perror(in_path);
+		goto exit;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, in) != 1 || memcmp(hdr.magic, "AHFZ", 4) != 0 || hdr.version != IQ_CODEC_VERSION ||
+		hdr.block_frames == 0 || hdr.block_frames > 16 * IQ_CODEC_BLOCK_FRAMES) {
+		fprintf(stderr, "%s: not an airspyhf compressed capture\n", in_path);
+		goto exit;
+	}
+
+	index = load_index(in, &hdr, &block_count);
+	if (index == NULL) {
+		fprintf(stderr, "%s: unreadable block index\n", in_path);
+		goto exit;
+	}
+
+	if (strcmp(out_path, "stdout") == 0) {
+		if (wav) {
+			fprintf(stderr, "WAV output needs a file\n");
+			goto exit;
+		}
+		out = stdout;
+	} else if (!(out = fopen(out_path, "wb"))) {
+		perror(out_path);
+		goto exit;
+	}
+
+	memset(&wav_hdr, 0, sizeof(wav_hdr));
+	if (wav && fwrite(&wav_hdr, sizeof(wav_hdr), 1, out) != 1) {
+		perror(out_path);
+		goto exit;
+	}
+
+	payload = (uint8_t*) malloc(iq_codec_max_block_size(hdr.block_frames));
+	iq = (int16_t*) malloc((size_t) hdr.block_frames * 2 * sizeof(int16_t));
+	if (payload == NULL || iq == NULL)
+		goto exit;
+
+	/* Every block but the last one holds block_frames, so the start block is found directly */
+	start_frame = (uint64_t) (start_seconds * hdr.sample_rate);
+	block = (uint32_t) (start_frame / hdr.block_frames);
+	skip = (uint32_t) (start_frame % hdr.block_frames);
+
+	for (; block < block_count && samples_left > 0; block++) {
+		if (fseeko(in, (off_t) index[block], SEEK_SET) != 0 ||
+			fread(&block_hdr, sizeof(block_hdr), 1, in) != 1 ||
+			block_hdr.frame_count > hdr.block_frames ||
+			block_hdr.payload_size > iq_codec_max_block_size(hdr.block_frames) ||
+			fread(payload, 1, block_hdr.payload_size, in) != block_hdr.payload_size ||
+			iq_codec_decode(&block_hdr, payload, iq) != 0) {
+			fprintf(stderr, "Block %u is corrupted, stopping\n", block);
+			break;
+		}
+		if (skip >= block_hdr.frame_count) {
+			skip -= block_hdr.frame_count;
+			continue;
+		}
+
+		count = block_hdr.frame_count - skip;
+		if (count > samples_left)
+			count = (uint32_t) samples_left;
+		if (fwrite(iq + 2 * skip, 2 * sizeof(int16_t), count, out) != count) {
+			perror(out_path);
+			goto exit;
+		}
+		written += count;
+		samples_left -= count;
+		skip = 0;
+	}
+
+	if (wav) {
+		memcpy(wav_hdr.groupID, "RIFF", 4);
+		memcpy(wav_hdr.riffType, "WAVE", 4);
+		memcpy(wav_hdr.fmtID, "fmt ", 4);
+		memcpy(wav_hdr.dataID, "data", 4);
+		wav_hdr.fmtSize = 16;
+		wav_hdr.wFormatTag = 1;
+		wav_hdr.wChannels = 2;
+		wav_hdr.dwSamplesPerSec = hdr.sample_rate;
+		wav_hdr.wBlockAlign = 2 * sizeof(int16_t);
+		wav_hdr.dwAvgBytesPerSec = hdr.sample_rate * wav_hdr.wBlockAlign;
+		wav_hdr.wBitsPerSample = 16;
+		wav_hdr.dataSize = (uint32_t) (written * wav_hdr.wBlockAlign);
+		wav_hdr.size = (uint32_t) (sizeof(wav_hdr) - 8 + written * wav_hdr.wBlockAlign);
+		rewind(out);
+		if (fwrite(&wav_hdr, sizeof(wav_hdr), 1, out) != 1) {
+			perror(out_path);
+			goto exit;
+		}
+	}
+
+	fprintf(stderr, "%llu samples at %u S/s\n", (unsigned long long) written, hdr.sample_rate);
+	result = EXIT_SUCCESS;
+
+exit:
+	free(payload);
+	free(iq);
+	free(index);
+	if (in)
+		fclose(in);
+	if (out && out != stdout && fclose(out) != 0)
+		result = EXIT_FAILURE;
+	return result;
+
+exit_usage:
+	usage();
+	return EXIT_FAILURE;
+}
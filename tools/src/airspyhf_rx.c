@@ -21,21 +21,29 @@
  * Boston, MA 02110-1301, USA.
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* fallocate(), vmsplice() */
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
 #include <time.h>
+#include <math.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include <airspyhf.h>
 
+#include "direct_io.h"
+#include "iq_codec.h"
+
 #if !defined __cplusplus
 #if __STDC_VERSION__ < 202311L
 #ifndef bool
@@ -85,6 +93,10 @@ int gettimeofday(struct timeval *tv, void* ignored)
 #include <sys/time.h>
 #endif
 
+#if defined(__linux__)
+#include <sys/uio.h>
+#endif
+
 #include <signal.h>
 
 #if defined _WIN32
@@ -96,6 +108,20 @@ int gettimeofday(struct timeval *tv, void* ignored)
 #define FD_BUFFER_SIZE (16*1024)
 #define DEFAULT_FREQ_HZ (7100000ul) /* 7.1 MHz */
 #define SAMPLES_TO_XFER_MAX_U64 (0x8000000000000000ull) /* Max value */
+#define DEFAULT_RING_SIZE_MB (64)
+#define WRITE_CHUNK_SIZE (1024*1024)
+#define OUTPUT_PATH_SIZE (256+16)
+#define COMPRESS_JOBS_PER_THREAD (2)
+#define PIPE_BUFFER_SIZE (1024*1024) /* Requested with F_SETPIPE_SZ, capped by /proc/sys/fs/pipe-max-size */
+#define RING_ALIGNMENT (4096)
+#define TRIGGER_MAX_PENDING (64) /* Finished events not yet closed by the writer */
+
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#endif
 
 /* WAVE or RIFF WAVE file format containing data for AirSpy compatible with SDR# Wav IQ file */
 typedef struct
@@ -126,6 +152,20 @@ typedef struct
 	/* For IQ samples I(16 or 32bits) then Q(16 or 32bits), I, Q ... */
 } t_DataChunk;
 
+/* RF64 (EBU Tech 3306) 64-bit sizes, reserved as a 'JUNK' chunk until the file outgrows 4 GB */
+typedef struct
+{
+	char chunkID[4]; /* 'JUNK' then 'ds64' */
+	uint32_t chunkSize; /* 28 fixed */
+	uint32_t riffSizeLow;
+	uint32_t riffSizeHigh;
+	uint32_t dataSizeLow;
+	uint32_t dataSizeHigh;
+	uint32_t sampleCountLow;
+	uint32_t sampleCountHigh;
+	uint32_t tableLength; /* 0 fixed */
+} t_DS64Chunk;
+
 typedef struct
 {
 	t_WAVRIFF_hdr hdr;
@@ -133,6 +173,14 @@ typedef struct
 	t_DataChunk data_chunk;
 } t_wav_file_hdr;
 
+typedef struct
+{
+	t_WAVRIFF_hdr hdr;
+	t_DS64Chunk ds64_chunk;
+	t_FormatChunk fmt_chunk;
+	t_DataChunk data_chunk;
+} t_rf64_file_hdr;
+
 t_wav_file_hdr wave_file_hdr =
 {
 	/* t_WAVRIFF_hdr */
@@ -159,6 +207,129 @@ t_wav_file_hdr wave_file_hdr =
 	}
 };
 
+t_rf64_file_hdr rf64_file_hdr =
+{
+	{ { 'R', 'I', 'F', 'F' }, 0, { 'W', 'A', 'V', 'E' } },
+	{ { 'J', 'U', 'N', 'K' }, 28, 0, 0, 0, 0, 0, 0, 0 },
+	{ { 'f', 'm', 't', ' ' }, 16, 0, 0, 0, 0, 0, 0 },
+	{ { 'd', 'a', 't', 'a' }, 0 }
+};
+
+/* One output file: the whole capture or one of its segments */
+typedef struct
+{
+	FILE* fd;
+	direct_writer_t* dio;
+	bool splice; /* stdout is a pipe fed with vmsplice() */
+	uint64_t size; /* Bytes written, header included */
+	char path[OUTPUT_PATH_SIZE];
+} t_output;
+
+/*
+ * Segments are rotated by the writer thread. Closing the finished one (header patch,
+ * release of the preallocated space) and opening the next one are left to a finalizer
+ * thread so that rotation is a pointer swap.
+ */
+typedef struct
+{
+	t_output* next; /* Opened ahead of time by the finalizer */
+	t_output* closing; /* Handed over by the writer */
+	uint32_t next_index;
+	uint64_t remaining; /* Data bytes left in the current segment */
+	bool error;
+	bool stop;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} t_segments;
+
+enum codec_job_state
+{
+	JOB_FREE = 0,
+	JOB_QUEUED,
+	JOB_BUSY,
+	JOB_DONE
+};
+
+typedef struct
+{
+	int16_t* input;
+	uint8_t* output;
+	uint32_t frame_count;
+	size_t output_size;
+	enum codec_job_state state;
+} t_codec_job;
+
+/*
+ * Compressed output: the writer thread fills fixed size blocks, a worker pool encodes
+ * them and the writer thread writes them back in order. Block offsets are kept for the
+ * index written at the end of the file.
+ */
+typedef struct
+{
+	t_codec_job* jobs;
+	uint32_t job_count;
+	uint32_t fill_seq; /* Job being filled by the writer */
+	uint32_t write_seq; /* Oldest job not yet written */
+	size_t fill_bytes;
+	pthread_t* threads;
+	uint32_t thread_count;
+	uint64_t* index;
+	uint32_t index_count;
+	uint32_t index_size;
+	uint64_t frame_count;
+	bool stop;
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+} t_compressor;
+
+/*
+ * Samples are copied by the callback into this ring and written out by writer_threadproc(),
+ * so a stalled file system never blocks the library consumer thread.
+ *
+ * In pipe mode the ring pages are handed to the pipe by reference: they are only reused
+ * once pipe_size newer bytes went into the pipe, which guarantees it no longer holds them.
+ */
+typedef struct
+{
+	uint8_t* buffer;
+	size_t size;
+	size_t read_pos;
+	size_t write_pos;
+	size_t used;
+	size_t spliced; /* Bytes from read_pos the pipe may still reference */
+	size_t peak_used;
+	uint64_t overruns;
+	uint64_t overrun_bytes;
+	volatile bool write_error;
+	bool flush;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} t_ring;
+
+/*
+ * Trigger mode: the callback keeps the last pre-trigger seconds in history and only pushes
+ * blocks into the write ring around events. Every event ends up in its own file: the
+ * callback records where each event ends in the ring byte stream, and the writer rotates
+ * to the next file once it wrote that far.
+ */
+typedef struct
+{
+	uint8_t* history;
+	size_t history_size;
+	size_t history_pos;
+	size_t history_used;
+	float threshold; /* Mean power per block, linear */
+	uint64_t post_bytes;
+	uint64_t post_remaining; /* 0 between events */
+	uint64_t pushed; /* Bytes of events accepted by the write ring */
+	uint64_t written; /* Writer thread only */
+	uint64_t boundaries[TRIGGER_MAX_PENDING]; /* Value of pushed at the end of each event, under ring.mutex */
+	uint32_t boundary_head;
+	uint32_t boundary_count;
+	uint32_t events;
+} t_trigger;
+
 #define U64TOA_MAX_DIGIT (31)
 typedef struct
 {
@@ -171,11 +342,41 @@ typedef struct
 
 volatile bool do_exit = false;
 
-FILE* fd = NULL;
+t_output* output = NULL;
+bool direct_io = false;
+bool pipe_mode = false;
+size_t pipe_size = 0; /* Pipe capacity when stdout is fed with vmsplice() */
+
+const char* segment_base_path = NULL;
+uint32_t segment_seconds = 0;
+uint32_t segment_mb = 0;
+uint64_t segment_bytes = 0; /* 0 = single file */
+bool segment_rf64 = false;
+t_segments segments;
+pthread_t segment_thread;
+bool segment_thread_running = false;
+
+uint32_t compress_threads = 0; /* 0 = not compressed */
+t_compressor compressor;
+
+bool trigger_mode = false;
+float trigger_dbfs = 0.0f;
+float trigger_pre_seconds = 1.0f;
+float trigger_post_seconds = 1.0f;
+volatile bool trigger_external = false;
+t_trigger trigger;
+
+t_ring ring;
+pthread_t writer_thread;
+bool writer_thread_running = false;
+uint32_t ring_size_mb = DEFAULT_RING_SIZE_MB;
 
 bool verbose = false;
+enum airspyhf_sample_type sample_type = AIRSPYHF_SAMPLE_FLOAT32_IQ;
+uint32_t bits_per_sample = 32;
 bool receive = false;
 bool receive_wav = false;
+uint32_t wav_sample_per_sec;
 bool limit_num_samples = false;
 uint64_t samples_to_xfer = 0;
 uint64_t bytes_to_xfer = 0;
@@ -298,17 +499,841 @@ char* u64toa(uint64_t val, t_u64toa* str)
 	return res;
 }
 
+static int ring_init(t_ring* r, size_t size)
+{
+	memset(r, 0, sizeof(t_ring));
+#if defined(__linux__)
+	/* Whole pages, vmsplice() maps them into the pipe */
+	if (posix_memalign((void**) &r->buffer, RING_ALIGNMENT, size) != 0)
+		r->buffer = NULL;
+#else
+	r->buffer = (uint8_t *) malloc(size);
+#endif
+	if (r->buffer == NULL)
+		return AIRSPYHF_ERROR;
+	r->size = size;
+	pthread_mutex_init(&r->mutex, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	return AIRSPYHF_SUCCESS;
+}
+
+static void ring_free(t_ring* r)
+{
+	if (r->buffer == NULL)
+		return;
+	free(r->buffer);
+	r->buffer = NULL;
+	pthread_mutex_destroy(&r->mutex);
+	pthread_cond_destroy(&r->cond);
+}
+
+/* Called from the sample callback only. Drops the whole block when the ring is full. */
+static bool ring_push(t_ring* r, const void* data, size_t length)
+{
+	size_t pos;
+	size_t first;
+
+	pthread_mutex_lock(&r->mutex);
+	if (r->size - r->used < length) {
+		r->overruns++;
+		r->overrun_bytes += length;
+		pthread_mutex_unlock(&r->mutex);
+		return false;
+	}
+	pos = r->write_pos;
+	pthread_mutex_unlock(&r->mutex);
+
+	/* The free region belongs to the producer, no need to hold the lock while copying */
+	first = MIN(length, r->size - pos);
+	memcpy(r->buffer + pos, data, first);
+	memcpy(r->buffer, (const uint8_t *) data + first, length - first);
+
+	pthread_mutex_lock(&r->mutex);
+	r->write_pos = (pos + length) % r->size;
+	r->used += length;
+	r->peak_used = MAX(r->peak_used, r->used);
+	pthread_cond_signal(&r->cond);
+	pthread_mutex_unlock(&r->mutex);
+
+	return true;
+}
+
+static void wav_format_update(t_FormatChunk* fmt_chunk)
+{
+	fmt_chunk->wFormatTag = (bits_per_sample == 16) ? 1 : 3;  // 1=PCM16, 3=Float32
+	fmt_chunk->wChannels = 2;   // I + Q
+	fmt_chunk->dwSamplesPerSec = wav_sample_per_sec;
+	fmt_chunk->wBlockAlign = 2 * (bits_per_sample / 8);
+	fmt_chunk->dwAvgBytesPerSec = fmt_chunk->dwSamplesPerSec * fmt_chunk->wBlockAlign;
+	fmt_chunk->wBitsPerSample = bits_per_sample;
+}
+
+static void wav_header_update(t_wav_file_hdr* header, uint64_t file_size)
+{
+	header->hdr.size = (uint32_t) (file_size - 8);
+	wav_format_update(&header->fmt_chunk);
+	header->data_chunk.chunkSize = (uint32_t) (file_size - sizeof(t_wav_file_hdr));
+}
+
+static void rf64_header_update(t_rf64_file_hdr* header, uint64_t file_size)
+{
+	uint64_t riff_size = file_size - 8;
+	uint64_t data_size = file_size - sizeof(t_rf64_file_hdr);
+	uint64_t sample_count = data_size / (2 * (bits_per_sample / 8));
+
+	wav_format_update(&header->fmt_chunk);
+
+	header->ds64_chunk.riffSizeLow = (uint32_t) riff_size;
+	header->ds64_chunk.riffSizeHigh = (uint32_t) (riff_size >> 32);
+	header->ds64_chunk.dataSizeLow = (uint32_t) data_size;
+	header->ds64_chunk.dataSizeHigh = (uint32_t) (data_size >> 32);
+	header->ds64_chunk.sampleCountLow = (uint32_t) sample_count;
+	header->ds64_chunk.sampleCountHigh = (uint32_t) (sample_count >> 32);
+
+	if (riff_size > 0xFFFFFFFFull) {
+		memcpy(header->hdr.groupID, "RF64", 4);
+		memcpy(header->ds64_chunk.chunkID, "ds64", 4);
+		header->hdr.size = 0xFFFFFFFF;
+		header->data_chunk.chunkSize = 0xFFFFFFFF;
+	} else {
+		header->hdr.size = (uint32_t) riff_size;
+		header->data_chunk.chunkSize = (uint32_t) data_size;
+	}
+}
+
+#if defined(__linux__)
+
+/* Returns the pipe capacity, 0 when fd is not a pipe */
+static size_t pipe_setup(int fd)
+{
+	struct stat st;
+	int size;
+
+	if (fstat(fd, &st) != 0 || !S_ISFIFO(st.st_mode))
+		return 0;
+	fcntl(fd, F_SETPIPE_SZ, PIPE_BUFFER_SIZE);
+	size = fcntl(fd, F_GETPIPE_SZ);
+	return size > 0 ? (size_t) size : 0;
+}
+
+static bool splice_write(int fd, const uint8_t* data, size_t length)
+{
+	struct iovec iov;
+	ssize_t n;
+
+	while (length > 0) {
+		iov.iov_base = (void*) data;
+		iov.iov_len = length;
+		n = vmsplice(fd, &iov, 1, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data += n;
+		length -= (size_t) n;
+	}
+	return true;
+}
+
+#endif
+
+static bool output_write(t_output* out, const void* data, size_t length)
+{
+	bool ok;
+
+#if defined(__linux__)
+	if (out->splice)
+		ok = splice_write(fileno(out->fd), (const uint8_t*) data, length);
+	else
+#endif
+	if (out->dio)
+		ok = direct_writer_write(out->dio, data, length) == 0;
+	else
+		ok = fwrite(data, 1, length, out->fd) == length;
+	if (ok)
+		out->size += length;
+	return ok;
+}
+
+static t_output* output_open(const char* path, uint64_t preallocate)
+{
+	t_output* out;
+
+	out = (t_output*) calloc(1, sizeof(t_output));
+	if (out == NULL)
+		return NULL;
+	snprintf(out->path, sizeof(out->path), "%s", path);
+
+	if (strcmp(path, "stdout") == 0) {
+		out->fd = stdout;
+#if defined(__linux__)
+		/* Only raw samples come straight from the ring, a regular file keeps fwrite() */
+		if (pipe_mode && compress_threads == 0 && !receive_wav) {
+			pipe_size = pipe_setup(fileno(stdout));
+			out->splice = pipe_size > 0;
+		}
+#endif
+	} else if (direct_io) {
+		if (direct_writer_open(&out->dio, path) != 0)
+			goto failure;
+		if (preallocate > 0)
+			direct_writer_preallocate(out->dio, preallocate);
+	} else {
+		if (!(out->fd = fopen(path, "wb")))
+			goto failure;
+#if defined(__linux__)
+		/* Best effort, not every file system supports it */
+		if (preallocate > 0)
+			fallocate(fileno(out->fd), FALLOC_FL_KEEP_SIZE, 0, (off_t) preallocate);
+#endif
+	}
+
+	/* Change fd buffer to have bigger one to store data to file */
+	if (out->fd && setvbuf(out->fd, NULL, _IOFBF, FD_BUFFER_SIZE) != 0)
+		goto failure;
+
+	/* Write Wav or compressed file header, the sizes are filled in by output_close() */
+	if (compress_threads > 0) {
+		iq_codec_file_hdr_t codec_header;
+
+		iq_codec_file_hdr_init(&codec_header, wav_sample_per_sec);
+		if (!output_write(out, &codec_header, sizeof(iq_codec_file_hdr_t)))
+			goto failure;
+	} else if (receive_wav) {
+		if (segment_rf64) {
+			if (!output_write(out, &rf64_file_hdr, sizeof(t_rf64_file_hdr)))
+				goto failure;
+		} else {
+			if (!output_write(out, &wave_file_hdr, sizeof(t_wav_file_hdr)))
+				goto failure;
+		}
+	}
+
+	return out;
+
+failure:
+	perror(path);
+	if (out->dio)
+		direct_writer_close(out->dio, NULL, 0);
+	if (out->fd && out->fd != stdout)
+		fclose(out->fd);
+	free(out);
+	return NULL;
+}
+
+static bool output_close(t_output* out, bool discard)
+{
+	t_wav_file_hdr wav_header = wave_file_hdr;
+	t_rf64_file_hdr rf64_header = rf64_file_hdr;
+	iq_codec_file_hdr_t codec_header;
+	iq_codec_index_hdr_t index_header;
+	const void* header = NULL;
+	size_t header_size = 0;
+	bool ok = true;
+
+	if (compress_threads > 0 && !discard) {
+		/* Block index at the end, the file header points to it */
+		iq_codec_file_hdr_init(&codec_header, wav_sample_per_sec);
+		codec_header.frame_count = compressor.frame_count;
+		codec_header.index_offset = out->size;
+		memcpy(index_header.magic, "AHFI", 4);
+		index_header.block_count = compressor.index_count;
+		ok = output_write(out, &index_header, sizeof(iq_codec_index_hdr_t)) &&
+			output_write(out, compressor.index, compressor.index_count * sizeof(uint64_t));
+		header = &codec_header;
+		header_size = sizeof(iq_codec_file_hdr_t);
+	} else if (receive_wav && !discard) {
+		if (segment_rf64) {
+			rf64_header_update(&rf64_header, out->size);
+			header = &rf64_header;
+			header_size = sizeof(t_rf64_file_hdr);
+		} else {
+			wav_header_update(&wav_header, out->size);
+			header = &wav_header;
+			header_size = sizeof(t_wav_file_hdr);
+		}
+	}
+
+	if (out->dio) {
+		ok = direct_writer_close(out->dio, header, header_size) == 0 && ok;
+	} else if (out->fd != stdout) {
+		if (header) {
+			/* Overwrite header with updated data */
+			ok = fflush(out->fd) == 0;
+			rewind(out->fd);
+			ok = ok && fwrite(header, 1, header_size, out->fd) == header_size;
+		}
+		ok = fflush(out->fd) == 0 && ok;
+#if defined(__linux__)
+		/* Releases any preallocated space past the end of the data */
+		if (segment_bytes > 0)
+			ok = ftruncate(fileno(out->fd), (off_t) out->size) == 0 && ok;
+#endif
+		ok = fclose(out->fd) == 0 && ok;
+	} else {
+		ok = fflush(out->fd) == 0;
+	}
+
+	if (discard)
+		remove(out->path);
+	free(out);
+
+	return ok;
+}
+
+/* Inserts the segment index before the extension: name.wav -> name_0001.wav */
+static void segment_path(char* dest, size_t size, const char* path, uint32_t index)
+{
+	const char* ext = strrchr(path, '.');
+	const char* sep = strrchr(path, '/');
+
+	if (ext == NULL || (sep != NULL && ext < sep))
+		ext = path + strlen(path);
+	snprintf(dest, size, "%.*s_%04u%s", (int) (ext - path), path, index, ext);
+}
+
+static t_output* segment_open(uint32_t index)
+{
+	char path[OUTPUT_PATH_SIZE];
+	uint64_t header_size = 0;
+
+	if (receive_wav)
+		header_size = segment_rf64 ? sizeof(t_rf64_file_hdr) : sizeof(t_wav_file_hdr);
+	segment_path(path, sizeof(path), segment_base_path, index);
+	return output_open(path, header_size + segment_bytes);
+}
+
+static void* segment_threadproc(void* arg)
+{
+	t_output* closing;
+	t_output* next;
+	bool open_next;
+	uint32_t index;
+
+	pthread_mutex_lock(&segments.mutex);
+	while (true) {
+		while (segments.closing == NULL && (segments.next != NULL || segments.error) && !segments.stop)
+			pthread_cond_wait(&segments.cond, &segments.mutex);
+
+		closing = segments.closing;
+		open_next = segments.next == NULL && !segments.error && !segments.stop;
+		index = segments.next_index;
+		pthread_mutex_unlock(&segments.mutex);
+
+		if (closing && !output_close(closing, false)) {
+			fprintf(stderr, "Unable to finalize segment\n");
+			pthread_mutex_lock(&segments.mutex);
+			segments.error = true;
+			pthread_mutex_unlock(&segments.mutex);
+		}
+		next = open_next ? segment_open(index) : NULL;
+
+		pthread_mutex_lock(&segments.mutex);
+		if (closing)
+			segments.closing = NULL;
+		if (open_next) {
+			if (next) {
+				segments.next = next;
+				segments.next_index++;
+			} else {
+				segments.error = true;
+			}
+		}
+		pthread_cond_broadcast(&segments.cond);
+		if (segments.stop && segments.closing == NULL)
+			break;
+	}
+	next = segments.next;
+	segments.next = NULL;
+	pthread_mutex_unlock(&segments.mutex);
+
+	/* The segment opened ahead of time was never used */
+	if (next)
+		output_close(next, true);
+
+	return NULL;
+}
+
+/* Called from the writer thread when the current segment is full */
+static bool segment_rotate(void)
+{
+	pthread_mutex_lock(&segments.mutex);
+	while ((segments.closing != NULL || segments.next == NULL) && !segments.error)
+		pthread_cond_wait(&segments.cond, &segments.mutex);
+	if (segments.error) {
+		pthread_mutex_unlock(&segments.mutex);
+		return false;
+	}
+	segments.closing = output;
+	output = segments.next;
+	segments.next = NULL;
+	segments.remaining = segment_bytes;
+	pthread_cond_broadcast(&segments.cond);
+	pthread_mutex_unlock(&segments.mutex);
+
+	if (verbose)
+		fprintf(stderr, "Segment %s\n", output->path);
+
+	return true;
+}
+
+static int segment_start(void)
+{
+	segments.remaining = segment_bytes;
+	segments.next_index = 1;
+	pthread_mutex_init(&segments.mutex, NULL);
+	pthread_cond_init(&segments.cond, NULL);
+
+	if (pthread_create(&segment_thread, NULL, segment_threadproc, NULL) != 0)
+		return AIRSPYHF_ERROR;
+	segment_thread_running = true;
+	return AIRSPYHF_SUCCESS;
+}
+
+static void segment_stop(void)
+{
+	if (!segment_thread_running)
+		return;
+
+	pthread_mutex_lock(&segments.mutex);
+	segments.stop = true;
+	pthread_cond_broadcast(&segments.cond);
+	pthread_mutex_unlock(&segments.mutex);
+
+	pthread_join(segment_thread, NULL);
+	segment_thread_running = false;
+	pthread_mutex_destroy(&segments.mutex);
+	pthread_cond_destroy(&segments.cond);
+}
+
+/* Splits the data at segment boundaries when rotating */
+static bool output_write_segmented(const uint8_t* data, size_t length)
+{
+	size_t n;
+
+	while (length > 0) {
+		n = length;
+		if (segment_bytes > 0) {
+			if (segments.remaining == 0 && !segment_rotate())
+				return false;
+			n = (size_t) MIN((uint64_t) n, segments.remaining);
+			segments.remaining -= n;
+		}
+		if (!output_write(output, data, n))
+			return false;
+		data += n;
+		length -= n;
+	}
+
+	return true;
+}
+
+static void* compress_threadproc(void* arg)
+{
+	t_codec_job* job;
+	uint32_t i;
+
+	pthread_mutex_lock(&compressor.mutex);
+	while (true) {
+		job = NULL;
+		while (!compressor.stop) {
+			/* Oldest first, so that the writer is not kept waiting */
+			for (i = 0; i < compressor.job_count && job == NULL; i++) {
+				if (compressor.jobs[(compressor.write_seq + i) % compressor.job_count].state == JOB_QUEUED)
+					job = &compressor.jobs[(compressor.write_seq + i) % compressor.job_count];
+			}
+			if (job)
+				break;
+			pthread_cond_wait(&compressor.work_cond, &compressor.mutex);
+		}
+		if (job == NULL)
+			break;
+
+		job->state = JOB_BUSY;
+		pthread_mutex_unlock(&compressor.mutex);
+
+		job->output_size = iq_codec_encode(job->input, job->frame_count, job->output);
+
+		pthread_mutex_lock(&compressor.mutex);
+		job->state = JOB_DONE;
+		pthread_cond_broadcast(&compressor.done_cond);
+	}
+	pthread_mutex_unlock(&compressor.mutex);
+
+	return NULL;
+}
+
+static int compress_start(void)
+{
+	uint32_t i;
+
+	memset(&compressor, 0, sizeof(t_compressor));
+	pthread_mutex_init(&compressor.mutex, NULL);
+	pthread_cond_init(&compressor.work_cond, NULL);
+	pthread_cond_init(&compressor.done_cond, NULL);
+
+	compressor.job_count = compress_threads * COMPRESS_JOBS_PER_THREAD;
+	compressor.jobs = (t_codec_job*) calloc(compressor.job_count, sizeof(t_codec_job));
+	compressor.threads = (pthread_t*) calloc(compress_threads, sizeof(pthread_t));
+	if (compressor.jobs == NULL || compressor.threads == NULL)
+		return AIRSPYHF_ERROR;
+
+	for (i = 0; i < compressor.job_count; i++) {
+		compressor.jobs[i].input = (int16_t*) malloc(IQ_CODEC_BLOCK_FRAMES * 2 * sizeof(int16_t));
+		compressor.jobs[i].output = (uint8_t*) malloc(iq_codec_max_block_size(IQ_CODEC_BLOCK_FRAMES));
+		if (compressor.jobs[i].input == NULL || compressor.jobs[i].output == NULL)
+			return AIRSPYHF_ERROR;
+	}
+
+	for (i = 0; i < compress_threads; i++) {
+		if (pthread_create(&compressor.threads[i], NULL, compress_threadproc, NULL) != 0)
+			return AIRSPYHF_ERROR;
+		compressor.thread_count++;
+	}
+
+	return AIRSPYHF_SUCCESS;
+}
+
+/* Writes the encoded blocks in order. With wait set, blocks until at least one is written. */
+static bool compress_write_done(bool wait)
+{
+	t_codec_job* job;
+	uint64_t* index;
+	bool ok = true;
+
+	pthread_mutex_lock(&compressor.mutex);
+	while (ok && compressor.write_seq != compressor.fill_seq) {
+		job = &compressor.jobs[compressor.write_seq % compressor.job_count];
+		if (job->state != JOB_DONE) {
+			if (!wait)
+				break;
+			pthread_cond_wait(&compressor.done_cond, &compressor.mutex);
+			continue;
+		}
+		pthread_mutex_unlock(&compressor.mutex);
+
+		if (compressor.index_count == compressor.index_size) {
+			compressor.index_size = MAX(1024, compressor.index_size * 2);
+			index = (uint64_t*) realloc(compressor.index, compressor.index_size * sizeof(uint64_t));
+			if (index == NULL)
+				ok = false;
+			else
+				compressor.index = index;
+		}
+		if (ok) {
+			compressor.index[compressor.index_count++] = output->size;
+			compressor.frame_count += job->frame_count;
+			ok = job->output_size > 0 && output_write(output, job->output, job->output_size);
+		}
+
+		pthread_mutex_lock(&compressor.mutex);
+		job->state = JOB_FREE;
+		compressor.write_seq++;
+		wait = false;
+	}
+	pthread_mutex_unlock(&compressor.mutex);
+
+	return ok;
+}
+
+static void compress_queue(uint32_t frame_count)
+{
+	pthread_mutex_lock(&compressor.mutex);
+	compressor.jobs[compressor.fill_seq % compressor.job_count].frame_count = frame_count;
+	compressor.jobs[compressor.fill_seq % compressor.job_count].state = JOB_QUEUED;
+	compressor.fill_seq++;
+	compressor.fill_bytes = 0;
+	pthread_cond_signal(&compressor.work_cond);
+	pthread_mutex_unlock(&compressor.mutex);
+}
+
+/* Called from the writer thread in place of output_write_segmented() */
+static bool compress_write(const uint8_t* data, size_t length)
+{
+	const size_t block_bytes = IQ_CODEC_BLOCK_FRAMES * 2 * sizeof(int16_t);
+	t_codec_job* job;
+	size_t n;
+
+	while (length > 0) {
+		/* The job to fill is still in use while the pool is saturated */
+		if (compressor.fill_bytes == 0 && compressor.fill_seq - compressor.write_seq == compressor.job_count) {
+			if (!compress_write_done(true))
+				return false;
+		}
+
+		job = &compressor.jobs[compressor.fill_seq % compressor.job_count];
+		n = MIN(length, block_bytes - compressor.fill_bytes);
+		memcpy((uint8_t*) job->input + compressor.fill_bytes, data, n);
+		compressor.fill_bytes += n;
+		data += n;
+		length -= n;
+
+		if (compressor.fill_bytes == block_bytes)
+			compress_queue(IQ_CODEC_BLOCK_FRAMES);
+	}
+
+	return compress_write_done(false);
+}
+
+/* Encodes and writes what is left, then stops the pool. The writer thread must be stopped. */
+static bool compress_stop(void)
+{
+	uint32_t i;
+	bool ok = true;
+
+	if (compressor.jobs == NULL)
+		return true;
+
+	if (compressor.thread_count > 0 && output) {
+		if (compressor.fill_bytes >= 2 * sizeof(int16_t))
+			compress_queue((uint32_t) (compressor.fill_bytes / (2 * sizeof(int16_t))));
+		while (ok && compressor.write_seq != compressor.fill_seq)
+			ok = compress_write_done(true);
+	}
+
+	pthread_mutex_lock(&compressor.mutex);
+	compressor.stop = true;
+	pthread_cond_broadcast(&compressor.work_cond);
+	pthread_mutex_unlock(&compressor.mutex);
+
+	for (i = 0; i < compressor.thread_count; i++)
+		pthread_join(compressor.threads[i], NULL);
+
+	for (i = 0; i < compressor.job_count; i++) {
+		free(compressor.jobs[i].input);
+		free(compressor.jobs[i].output);
+	}
+	free(compressor.jobs);
+	free(compressor.threads);
+	compressor.jobs = NULL;
+	pthread_mutex_destroy(&compressor.mutex);
+	pthread_cond_destroy(&compressor.work_cond);
+	pthread_cond_destroy(&compressor.done_cond);
+
+	return ok;
+}
+
+static int trigger_init(void)
+{
+	const size_t frame_size = 2 * (bits_per_sample / 8);
+
+	memset(&trigger, 0, sizeof(t_trigger));
+	trigger.threshold = powf(10.0f, trigger_dbfs / 10.0f);
+	trigger.history_size = (size_t) (trigger_pre_seconds * wav_sample_per_sec) * frame_size;
+	trigger.post_bytes = (uint64_t) (trigger_post_seconds * wav_sample_per_sec) * frame_size;
+	if (trigger.history_size > 0) {
+		trigger.history = (uint8_t*) malloc(trigger.history_size);
+		if (trigger.history == NULL)
+			return AIRSPYHF_ERROR;
+	}
+	return AIRSPYHF_SUCCESS;
+}
+
+/* Mean |z|^2 of the block, full scale is 1.0 */
+static float block_power(const void* data, uint32_t count)
+{
+	uint32_t i;
+
+	if (count == 0)
+		return 0.0f;
+
+	if (bits_per_sample == 16) {
+		const int16_t* iq = (const int16_t*) data;
+		int64_t sum = 0;
+		for (i = 0; i < 2 * count; i++)
+			sum += (int32_t) iq[i] * iq[i];
+		return (float) sum / (1073741824.0f * count);
+	} else {
+		const float* iq = (const float*) data;
+		float sum = 0.0f;
+		for (i = 0; i < 2 * count; i++)
+			sum += iq[i] * iq[i];
+		return sum / count;
+	}
+}
+
+static void trigger_push(const uint8_t* data, size_t length)
+{
+	if (length > 0 && ring_push(&ring, data, length))
+		trigger.pushed += length;
+}
+
+static void history_append(const uint8_t* data, size_t length)
+{
+	size_t first;
+
+	if (trigger.history_size == 0)
+		return;
+	if (length > trigger.history_size) {
+		data += length - trigger.history_size;
+		length = trigger.history_size;
+	}
+	first = MIN(length, trigger.history_size - trigger.history_pos);
+	memcpy(trigger.history + trigger.history_pos, data, first);
+	memcpy(trigger.history, data + first, length - first);
+	trigger.history_pos = (trigger.history_pos + length) % trigger.history_size;
+	trigger.history_used = MIN(trigger.history_used + length, trigger.history_size);
+}
+
+/* Oldest first, the history is empty afterwards */
+static void history_flush(void)
+{
+	size_t start;
+	size_t first;
+
+	if (trigger.history_used == 0)
+		return;
+	start = (trigger.history_pos + trigger.history_size - trigger.history_used) % trigger.history_size;
+	first = MIN(trigger.history_used, trigger.history_size - start);
+	trigger_push(trigger.history + start, first);
+	trigger_push(trigger.history, trigger.history_used - first);
+	trigger.history_used = 0;
+}
+
+static void trigger_end_event(void)
+{
+	pthread_mutex_lock(&ring.mutex);
+	/* When the writer lags that far, the event is merged with the next one */
+	if (trigger.boundary_count < TRIGGER_MAX_PENDING) {
+		trigger.boundaries[(trigger.boundary_head + trigger.boundary_count) % TRIGGER_MAX_PENDING] = trigger.pushed;
+		trigger.boundary_count++;
+	}
+	pthread_cond_signal(&ring.cond);
+	pthread_mutex_unlock(&ring.mutex);
+}
+
+/* Called from the sample callback, a trigger during the post-trigger time extends the event */
+static void trigger_process(const uint8_t* data, size_t length, uint32_t count)
+{
+	bool fire = trigger_external || block_power(data, count) >= trigger.threshold;
+
+	trigger_external = false;
+	if (fire) {
+		if (trigger.post_remaining == 0) {
+			trigger.events++;
+			if (verbose)
+				fprintf(stderr, "Trigger %u\n", trigger.events);
+			history_flush();
+		}
+		/* The post-trigger time starts after this block */
+		trigger.post_remaining = trigger.post_bytes + length;
+	}
+
+	if (trigger.post_remaining > 0) {
+		trigger_push(data, length);
+		trigger.post_remaining -= MIN(trigger.post_remaining, (uint64_t) length);
+		if (trigger.post_remaining == 0)
+			trigger_end_event();
+	} else {
+		history_append(data, length);
+	}
+}
+
+/* With ring.mutex held: the writer reached the end of an event */
+static bool trigger_event_complete(void)
+{
+	return trigger_mode && trigger.boundary_count > 0 && trigger.boundaries[trigger.boundary_head] == trigger.written;
+}
+
+/* Writer side: one file per event, the next one is opened ahead by the segment thread */
+static bool output_write_events(const uint8_t* data, size_t length)
+{
+	uint64_t boundary;
+	size_t n;
+
+	do {
+		pthread_mutex_lock(&ring.mutex);
+		boundary = trigger.boundary_count > 0 ? trigger.boundaries[trigger.boundary_head] : UINT64_MAX;
+		pthread_mutex_unlock(&ring.mutex);
+
+		n = (size_t) MIN((uint64_t) length, boundary - trigger.written);
+		if (n > 0 && !output_write(output, data, n))
+			return false;
+		trigger.written += n;
+		data += n;
+		length -= n;
+
+		if (trigger.written == boundary) {
+			pthread_mutex_lock(&ring.mutex);
+			trigger.boundary_head = (trigger.boundary_head + 1) % TRIGGER_MAX_PENDING;
+			trigger.boundary_count--;
+			pthread_mutex_unlock(&ring.mutex);
+			if (!segment_rotate())
+				return false;
+		}
+	} while (length > 0);
+
+	return true;
+}
+
+static void* writer_threadproc(void* arg)
+{
+	size_t pos;
+	size_t chunk;
+	size_t written;
+
+	pthread_mutex_lock(&ring.mutex);
+	while (true) {
+		while (ring.used == ring.spliced && !ring.flush && !trigger_event_complete())
+			pthread_cond_wait(&ring.cond, &ring.mutex);
+		if (ring.used == ring.spliced && !trigger_event_complete())
+			break;
+
+		pos = (ring.read_pos + ring.spliced) % ring.size;
+		chunk = MIN(MIN(ring.used - ring.spliced, ring.size - pos), WRITE_CHUNK_SIZE);
+		pthread_mutex_unlock(&ring.mutex);
+
+		if (compress_threads > 0)
+			written = compress_write(ring.buffer + pos, chunk) ? chunk : 0;
+		else if (trigger_mode)
+			written = output_write_events(ring.buffer + pos, chunk) ? chunk : 0;
+		else
+			written = output_write_segmented(ring.buffer + pos, chunk) ? chunk : 0;
+
+		pthread_mutex_lock(&ring.mutex);
+		if (written != chunk) {
+			ring.write_error = true;
+			break;
+		}
+		ring.spliced += chunk;
+		if (ring.spliced > pipe_size) {
+			chunk = ring.spliced - pipe_size;
+			ring.read_pos = (ring.read_pos + chunk) % ring.size;
+			ring.used -= chunk;
+			ring.spliced -= chunk;
+		}
+	}
+	pthread_mutex_unlock(&ring.mutex);
+
+	return NULL;
+}
+
+static void writer_stop(void)
+{
+	if (!writer_thread_running)
+		return;
+
+	/* Let the writer drain whatever is left in the ring */
+	pthread_mutex_lock(&ring.mutex);
+	ring.flush = true;
+	pthread_cond_signal(&ring.cond);
+	pthread_mutex_unlock(&ring.mutex);
+
+	pthread_join(writer_thread, NULL);
+	writer_thread_running = false;
+}
+
 int rx_callback(airspyhf_transfer_t* transfer)
 {
 	uint32_t bytes_to_write;
 	void* pt_rx_buffer;
-	ssize_t bytes_written;
 	struct timeval time_now;
 	float time_difference, rate;
 
-	if( fd ) {
-		// #sample * float size * I+Q
-		bytes_to_write = transfer->sample_count * 4 * 2;
+	if( output ) {
+		// #sample * sample size * I+Q
+		bytes_to_write = transfer->sample_count * (bits_per_sample / 8) * 2;
 		pt_rx_buffer = transfer->samples;
 
 		gettimeofday(&time_now, NULL);
@@ -340,11 +1365,12 @@ int rx_callback(airspyhf_transfer_t* transfer)
 		}
 
 		if(pt_rx_buffer) {
-			bytes_written = fwrite(pt_rx_buffer, 1, bytes_to_write, fd);
-		} else {
-			bytes_written = 0;
+			if (trigger_mode)
+				trigger_process((const uint8_t*) pt_rx_buffer, bytes_to_write, bytes_to_write / ((bits_per_sample / 8) * 2));
+			else
+				ring_push(&ring, pt_rx_buffer, bytes_to_write);
 		}
-		if  ( (bytes_written != bytes_to_write) ||
+		if  ( ring.write_error ||
 			  ((limit_num_samples == true) && (bytes_to_xfer == 0))
 			)
 			return -1;
@@ -371,6 +1397,8 @@ static void usage(void)
 
 	"\t-n <#samples>\t\tNumber of samples to transfer (default is unlimited)\n"
 
+	"\t-F float|cs16\t\tOutput format: 32-bit float (default) or 16-bit signed integer IQ\n"
+
 	"\t-d\t\t\tVerbose mode\n"
 
 	"\t-w\t\t\tReceive data into file with WAV header and automatic name\n"
@@ -385,7 +1413,23 @@ static void usage(void)
 	"\t-z\t\t\tDo not attempt to use manual AGC/LNA commands\n"
 	"\t\t\t\t(useful in order to avoid errors with old firmware)\n"
 
-	);
+	"\t-b <size>\t\tWrite buffer size in MB (default %u)\n"
+	"\t\t\t\tAbsorbs file system stalls; blocks are dropped when full\n"
+	"\t-S <seconds>\t\tSplit the capture into segments of the given duration\n"
+	"\t-M <size>\t\tSplit the capture into segments of the given size in MB\n"
+	"\t\t\t\tSegments are named <file>_NNNN.<ext>, WAV segments over 4 GB use RF64\n"
+	"\t-C <threads>\t\tLosslessly compress the output (implies -F cs16) using a pool of threads\n"
+	"\t\t\t\tRead it back with airspyhf_decompress\n"
+	"\t-D\t\t\tWrite the file with direct I/O, bypassing the page cache (Linux only)\n"
+	"\t\t\t\tUses io_uring when the kernel supports it\n"
+	"\t-T <dBFS>\t\tTrigger mode: only record around blocks whose mean power reaches the threshold\n"
+	"\t\t\t\tEvery event goes to its own file <file>_NNNN.<ext>, SIGUSR1 triggers too\n"
+	"\t-B <seconds>\t\tPre-trigger time kept in memory (default 1)\n"
+	"\t-A <seconds>\t\tPost-trigger time, extended by later triggers (default 1)\n"
+	"\t-P\t\t\tWhen stdout is a pipe, hand the samples to it with vmsplice() (Linux only)\n"
+	"\t\t\t\tThe reader must consume them with read(), not splice() them further\n"
+
+	, DEFAULT_RING_SIZE_MB);
 }
 
 
@@ -406,6 +1450,11 @@ void sigint_callback_handler(int signum)
 	fprintf(stdout, "Caught signal %d\n", signum);
 	do_exit = true;
 }
+
+void sigusr1_callback_handler(int signum)
+{
+	trigger_external = true;
+}
 #endif
 
 
@@ -418,8 +1467,6 @@ int main(int argc, char** argv)
 	int result;
 
 	struct timeval t_end;
-	uint32_t file_pos;
-	uint32_t wav_sample_per_sec;
 	uint32_t nsrates;
 	uint32_t *supported_samplerates;
 	uint32_t sample_rate_u32 = 768000;
@@ -440,7 +1487,7 @@ int main(int argc, char** argv)
 
 	bool do_not_use_manual_commands = false;
 
-	while( (opt = getopt(argc, argv, "r:ws:f:a:n:g:l:t:m:dhz")) != EOF )
+	while( (opt = getopt(argc, argv, "r:ws:f:a:n:F:g:l:t:m:dhzb:S:M:C:DPT:B:A:")) != EOF )
 	{
 		result = AIRSPYHF_SUCCESS;
 		switch( opt )
@@ -479,6 +1526,18 @@ int main(int argc, char** argv)
 				result = parse_u64(optarg, &samples_to_xfer);
 			break;
 
+			case 'F':
+				if (strcmp(optarg, "float") == 0) {
+					sample_type = AIRSPYHF_SAMPLE_FLOAT32_IQ;
+					bits_per_sample = 32;
+				} else if (strcmp(optarg, "cs16") == 0) {
+					sample_type = AIRSPYHF_SAMPLE_INT16_IQ;
+					bits_per_sample = 16;
+				} else {
+					result = AIRSPYHF_ERROR;
+				}
+			break;
+
 			case 'g':
 			if (strcmp(optarg, "off") == 0) hf_agc = false;
 			break;
@@ -513,6 +1572,54 @@ int main(int argc, char** argv)
 				do_not_use_manual_commands = true;
 			break;
 
+			case 'b':
+				result = parse_u32(optarg, &ring_size_mb);
+				if (result == AIRSPYHF_SUCCESS && ring_size_mb == 0)
+					result = AIRSPYHF_ERROR;
+			break;
+
+			case 'S':
+				result = parse_u32(optarg, &segment_seconds);
+				if (result == AIRSPYHF_SUCCESS && segment_seconds == 0)
+					result = AIRSPYHF_ERROR;
+			break;
+
+			case 'M':
+				result = parse_u32(optarg, &segment_mb);
+				if (result == AIRSPYHF_SUCCESS && segment_mb == 0)
+					result = AIRSPYHF_ERROR;
+			break;
+
+			case 'C':
+				result = parse_u32(optarg, &compress_threads);
+				if (result == AIRSPYHF_SUCCESS && compress_threads == 0)
+					result = AIRSPYHF_ERROR;
+			break;
+
+			case 'D':
+				direct_io = true;
+			break;
+
+			case 'P':
+				pipe_mode = true;
+			break;
+
+			case 'T':
+				trigger_mode = true;
+				if (sscanf(optarg, "%f", &trigger_dbfs) != 1)
+					result = AIRSPYHF_ERROR;
+			break;
+
+			case 'B':
+				if (sscanf(optarg, "%f", &trigger_pre_seconds) != 1 || trigger_pre_seconds < 0.0f)
+					result = AIRSPYHF_ERROR;
+			break;
+
+			case 'A':
+				if (sscanf(optarg, "%f", &trigger_post_seconds) != 1 || trigger_post_seconds < 0.0f)
+					result = AIRSPYHF_ERROR;
+			break;
+
 			default:
 				fprintf(stderr, "unknown argument '-%c %s'\n", opt, optarg);
 				goto exit_usage;
@@ -526,7 +1633,21 @@ int main(int argc, char** argv)
 
 	if (sample_rate) sample_rate_val = sample_rate_u32;
 
-	bytes_to_xfer = samples_to_xfer * (32 * 2 / 8);  // 32 bits per sample / 2 channels (I+Q) / 8 bits per byte
+	if (compress_threads > 0) {
+		if (receive_wav || segment_seconds > 0 || segment_mb > 0) {
+			fprintf(stderr, "argument error: -C cannot be combined with -w, -S or -M\n");
+			goto exit_usage;
+		}
+		sample_type = AIRSPYHF_SAMPLE_INT16_IQ;
+		bits_per_sample = 16;
+	}
+
+	if (trigger_mode && (compress_threads > 0 || segment_seconds > 0 || segment_mb > 0)) {
+		fprintf(stderr, "argument error: -T cannot be combined with -C, -S or -M\n");
+		goto exit_usage;
+	}
+
+	bytes_to_xfer = samples_to_xfer * (bits_per_sample * 2 / 8);  // bits per sample / 2 channels (I+Q) / 8 bits per byte
 
 	if (samples_to_xfer >= SAMPLES_TO_XFER_MAX_U64) {
 		fprintf(stderr, "argument error: num_samples must be less than %s/%sMio\n",
@@ -640,6 +1761,11 @@ int main(int argc, char** argv)
 		fprintf(stderr, "%f MS/s %s\n", wav_sample_per_sec * 0.000001f, "IQ");
 	}
 
+	if (airspyhf_set_sample_type(device, sample_type) != AIRSPYHF_SUCCESS) {
+		fprintf(stderr, "airspyhf_set_sample_type() failed\n");
+		goto exit_failure;
+	}
+
 	{ // print receiver serial number
 		airspyhf_read_partid_serialno_t read_partid_serialno;
 
@@ -695,23 +1821,83 @@ int main(int argc, char** argv)
 	}
 
 	// output file management
-	if (strcmp (path, "stdout") == 0) {
-		fd = stdout;
-	} else {
-		if( !(fd = fopen(path, "wb")) ) {
-			perror (path);
+	if (segment_seconds > 0 || segment_mb > 0) {
+		uint64_t frame_size = 2 * (bits_per_sample / 8);
+
+		if (strcmp (path, "stdout") == 0) {
+			fprintf(stderr, "Segments cannot be written to stdout\n");
 			goto exit_failure;
 		}
+		segment_bytes = UINT64_MAX;
+		if (segment_seconds > 0)
+			segment_bytes = (uint64_t) segment_seconds * wav_sample_per_sec * frame_size;
+		if (segment_mb > 0)
+			segment_bytes = MIN(segment_bytes, (uint64_t) segment_mb * 1024 * 1024 / frame_size * frame_size);
+		segment_rf64 = segment_bytes + sizeof(t_wav_file_hdr) - 8 > 0xFFFFFFFFull;
+		segment_base_path = path;
+
+		output = segment_open(0);
+	} else if (trigger_mode) {
+		if (strcmp (path, "stdout") == 0) {
+			fprintf(stderr, "Events cannot be written to stdout\n");
+			goto exit_failure;
+		}
+		if (trigger_init() != AIRSPYHF_SUCCESS) {
+			fprintf(stderr, "Unable to allocate the pre-trigger buffer\n");
+			goto exit_failure;
+		}
+		/* Typical event size for preallocation, RF64 placeholder as events can grow */
+		segment_bytes = trigger.history_size + trigger.post_bytes + 1;
+		segment_rf64 = true;
+		segment_base_path = path;
+
+		/* The write ring takes a whole history at once */
+		ring_size_mb = MAX(ring_size_mb, (uint32_t) ((2 * trigger.history_size) / (1024 * 1024) + 1));
+
+		output = segment_open(0);
+	} else {
+		output = output_open(path, 0);
+	}
+	if (output == NULL) {
+		goto exit_failure;
+	}
+	if (verbose && output->dio) {
+		fprintf(stderr, "Direct I/O using %s\n", direct_writer_uses_io_uring(output->dio) ? "io_uring" : "pwrite");
+	}
+	if (pipe_mode && verbose) {
+		if (output->splice)
+			fprintf(stderr, "Pipe mode: vmsplice() with a %u kB pipe\n", (unsigned) (pipe_size / 1024));
+		else
+			fprintf(stderr, "Pipe mode: stdout is not a pipe, using fwrite()\n");
 	}
 
-	/* Change fd buffer to have bigger one to store data to file */
-	if( setvbuf(fd , NULL , _IOFBF , FD_BUFFER_SIZE) != 0 ) {
-		perror("setvbuf() failed:");
+	if (segment_bytes > 0 && segment_start() != AIRSPYHF_SUCCESS) {
+		fprintf(stderr, "Unable to start the segment thread\n");
+		goto exit_failure;
+	}
+
+	if (compress_threads > 0 && compress_start() != AIRSPYHF_SUCCESS) {
+		fprintf(stderr, "Unable to start the compression threads\n");
 		goto exit_failure;
 	}
 
-	/* Write Wav header */
-	if( receive_wav ) fwrite(&wave_file_hdr, 1, sizeof(t_wav_file_hdr), fd);
+	if (ring_init(&ring, (size_t) ring_size_mb * 1024 * 1024) != AIRSPYHF_SUCCESS) {
+		fprintf(stderr, "Unable to allocate a %u MB write buffer\n", ring_size_mb);
+		goto exit_failure;
+	}
+	if (output->splice && ring.size < 2 * pipe_size) {
+		/* The pipe pins up to pipe_size bytes of the ring */
+		fprintf(stderr, "Pipe mode needs a write buffer of at least %u MB, using fwrite()\n",
+				(unsigned) (2 * pipe_size / (1024 * 1024)));
+		output->splice = false;
+		pipe_size = 0;
+	}
+
+	if (pthread_create(&writer_thread, NULL, writer_threadproc, NULL) != 0) {
+		fprintf(stderr, "Unable to start the writer thread\n");
+		goto exit_failure;
+	}
+	writer_thread_running = true;
 
 
 #ifdef _MSC_VER
@@ -723,6 +1909,9 @@ int main(int argc, char** argv)
 	signal(SIGSEGV, &sigint_callback_handler);
 	signal(SIGTERM, &sigint_callback_handler);
 	signal(SIGABRT, &sigint_callback_handler);
+#ifdef SIGUSR1
+	signal(SIGUSR1, &sigusr1_callback_handler);
+#endif
 #endif
 
 	if( airspyhf_start(device, rx_callback, NULL) != AIRSPYHF_SUCCESS ) {
@@ -751,9 +1940,22 @@ int main(int argc, char** argv)
 		float average_rate_now = average_rate * 1e-6f;
 
 		if (verbose) {
+			size_t used, peak_used;
+			uint64_t overruns;
+
+			pthread_mutex_lock(&ring.mutex);
+			used = ring.used;
+			peak_used = ring.peak_used;
+			overruns = ring.overruns;
+			pthread_mutex_unlock(&ring.mutex);
+
 			snprintf(buf, sizeof(buf),"%2.3f", average_rate_now);
 			//average_rate_now = 9.5f;
-			fprintf(stderr, "Streaming at %5s MS/s\n", buf);
+			fprintf(stderr, "Streaming at %5s MS/s, buffer %3.0f%% (peak %3.0f%%), %s overruns\n",
+					buf,
+					100.0 * used / ring.size,
+					100.0 * peak_used / ring.size,
+					u64toa(overruns, &ascii_u64_data1));
 		}
 		if ((limit_num_samples == true) && (bytes_to_xfer == 0))
 			do_exit = true;
@@ -787,30 +1989,48 @@ int main(int argc, char** argv)
 		}
 	}
 
-	if (fd && receive_wav ) {
-			/* Get size of file */
-			file_pos = ftell(fd);
-			/* Wav Header */
-			wave_file_hdr.hdr.size = file_pos - 8;
-			/* Wav Format Chunk */
-			wave_file_hdr.fmt_chunk.wFormatTag = 3;  // 3=Float32
-			wave_file_hdr.fmt_chunk.wChannels = 2;   // I + Q
-			wave_file_hdr.fmt_chunk.dwSamplesPerSec = wav_sample_per_sec;
-			wave_file_hdr.fmt_chunk.dwAvgBytesPerSec = wave_file_hdr.fmt_chunk.dwSamplesPerSec * 4;
-			wave_file_hdr.fmt_chunk.wBlockAlign = 2 * (32 / 8);
-			wave_file_hdr.fmt_chunk.wBitsPerSample = 32;
-			/* Wav Data Chunk */
-			wave_file_hdr.data_chunk.chunkSize = file_pos - sizeof(t_wav_file_hdr);
-			/* Overwrite header with updated data */
-			rewind(fd);
-			fwrite(&wave_file_hdr, 1, sizeof(t_wav_file_hdr), fd);
+	writer_stop();
+	if (!compress_stop()) {
+		fprintf(stderr, "Write error, the output is incomplete\n");
+	}
+	segment_stop();
+
+	if (ring.overruns > 0) {
+		fprintf(stderr, "Write buffer overruns: %s blocks (%sMB) dropped\n",
+				u64toa(ring.overruns, &ascii_u64_data1),
+				u64toa(ring.overrun_bytes / (1024 * 1024), &ascii_u64_data2));
+	}
+	if (ring.write_error) {
+		fprintf(stderr, "Write error, the output is incomplete\n");
+	}
+	ring_free(&ring);
+
+	if (output) {
+		if (compress_threads > 0 && compressor.frame_count > 0) {
+			fprintf(stderr, "Compressed to %.1f%%\n",
+					100.0 * output->size / (compressor.frame_count * 2 * sizeof(int16_t)));
+		}
+		/* Trigger mode leaves an empty file opened for the next event */
+		if (!output_close(output, trigger_mode && output->size <= (receive_wav ? sizeof(t_rf64_file_hdr) : 0)))
+			fprintf(stderr, "Write error, the output is incomplete\n");
+		output = NULL;
 	}
-	if (fd != stdout) fclose(fd);
+	if (trigger_mode)
+		fprintf(stderr, "%u events recorded\n", trigger.events);
+	free(trigger.history);
+	free(compressor.index);
 	fprintf(stderr, "done\n");
 	return EXIT_SUCCESS;
 
 exit_failure:
 	airspyhf_close(device);
+	writer_stop();
+	compress_stop();
+	segment_stop();
+	ring_free(&ring);
+	if (output) output_close(output, false);
+	free(trigger.history);
+	free(compressor.index);
 	return EXIT_FAILURE;
 
 exit_usage:
@@ -0,0 +1,286 @@
+/*
+ * This file is part of AirSpyHF+.
+ *
+ * Publishes the IQ stream into a shared memory ring for any number of local readers.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <airspyhf.h>
+
+#include "shm_ring.h"
+
+#if !defined __cplusplus
+#if __STDC_VERSION__ < 202311L
+#ifndef bool
+typedef int bool;
+#define true 1
+#define false 0
+#endif
+#endif
+#endif
+
+#define DEFAULT_NAME "airspyhf"
+#define DEFAULT_FREQ_HZ (7100000ul) /* 7.1 MHz */
+#define DEFAULT_SLOTS (256) /* About 1.3 s at 768 kS/s */
+
+volatile bool do_exit = false;
+
+shm_ring_t* ring = NULL;
+size_t frame_size = 2 * sizeof(float);
+uint64_t published = 0;
+uint64_t oversized = 0;
+
+/* The only copy of the stream, readers use the ring in place */
+int rx_callback(airspyhf_transfer_t* transfer)
+{
+	const size_t length = transfer->sample_count * frame_size;
+	void* payload;
+
+	if (length > shm_ring_info(ring)->slot_size) {
+		oversized++;
+		return 0;
+	}
+
+	payload = shm_ring_claim(ring);
+	memcpy(payload, transfer->samples, length);
+	shm_ring_publish(ring, (uint32_t) length, (uint32_t) transfer->sample_count, transfer->scale_exponent, transfer->dropped_samples);
+	published++;
+
+	return 0;
+}
+
+static void sigint_callback_handler(int signum)
+{
+	(void) signum;
+	do_exit = true;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+	"airspyhf_shm\n"
+	"Usage:\n"
+	"\t-n <name>\t\tShared memory ring name (default is " DEFAULT_NAME ")\n"
+	"\t-s <serial>\t\tOpen device with specified 64bits serial number\n"
+	"\t-f <frequency>\t\tFrequency in MHz (default is 7.1)\n"
+	"\t-r <samplerate>\t\tSample rate in S/s (default is 768000)\n"
+	"\t-F float|fp16|cs8|cs16\tSample format (default is float)\n"
+	"\t-b <slots>\t\tBlocks held by the ring (default is %d)\n"
+	"\t-R <filename>\t\tRead the ring into a file instead of publishing; stdout emits values on standard output\n"
+	"\t-d\t\t\tVerbose mode\n",
+	DEFAULT_SLOTS);
+}
+
+/* Reference reader: copies every block to a file and reports overruns */
+static int read_ring(const char* name, const char* path, bool verbose)
+{
+	const shm_ring_hdr_t* info;
+	shm_ring_block_t block;
+	FILE* out;
+	uint64_t lost = 0;
+	uint64_t blocks = 0;
+	int status;
+	int result = EXIT_FAILURE;
+
+	if (shm_ring_open(&ring, name) != SHM_RING_OK) {
+		fprintf(stderr, "No airspyhf_shm ring named %s\n", name);
+		return EXIT_FAILURE;
+	}
+	info = shm_ring_info(ring);
+	fprintf(stderr, "Reading %s: %u S/s, sample type %u, %u bytes per sample\n",
+		name, info->sample_rate, info->sample_type, info->frame_size);
+
+	if (strcmp(path, "stdout") == 0) {
+		out = stdout;
+	} else if (!(out = fopen(path, "wb"))) {
+		perror(path);
+		goto exit;
+	}
+
+	while (!do_exit) {
+		status = shm_ring_read(ring, &block, 500);
+		if (status == SHM_RING_TIMEOUT)
+			continue;
+		if (status != SHM_RING_OK) {
+			fprintf(stderr, "Publisher closed\n");
+			break;
+		}
+
+		if (block.lost) {
+			lost += block.lost;
+			fprintf(stderr, "Overrun: %llu blocks lost\n", (unsigned long long) block.lost);
+		}
+		if (fwrite(block.data, 1, block.length, out) != block.length) {
+			perror(path);
+			goto exit;
+		}
+		if (shm_ring_release(ring, &block) != SHM_RING_OK) {
+			lost++;
+			fprintf(stderr, "Overrun: block %llu overwritten while being written out\n", (unsigned long long) block.seq);
+		}
+		blocks++;
+		if (verbose && blocks % 1000 == 0)
+			fprintf(stderr, "%llu blocks, %llu lost\n", (unsigned long long) blocks, (unsigned long long) lost);
+	}
+	result = EXIT_SUCCESS;
+
+exit:
+	fprintf(stderr, "%llu blocks read, %llu lost\n", (unsigned long long) blocks, (unsigned long long) lost);
+	if (out && out != stdout && fclose(out) != 0)
+		result = EXIT_FAILURE;
+	shm_ring_close(ring);
+	return result;
+}
+
+int main(int argc, char** argv)
+{
+	int opt;
+	const char* name = DEFAULT_NAME;
+	const char* read_path = NULL;
+	uint64_t serial_number = 0;
+	bool serial = false;
+	bool verbose = false;
+	double freq_mhz = DEFAULT_FREQ_HZ / 1e6;
+	uint32_t samplerate = 768000;
+	uint32_t slots = DEFAULT_SLOTS;
+	enum airspyhf_sample_type sample_type = AIRSPYHF_SAMPLE_FLOAT32_IQ;
+	airspyhf_device_t* device = NULL;
+	int result = EXIT_FAILURE;
+
+	while( (opt = getopt(argc, argv, "n:s:f:r:F:b:R:dh")) != EOF )
+	{
+		switch( opt )
+		{
+			case 'n':
+				name = optarg;
+			break;
+
+			case 's':
+				serial = true;
+				serial_number = strtoull(optarg, NULL, 0);
+			break;
+
+			case 'f':
+				freq_mhz = atof(optarg);
+			break;
+
+			case 'r':
+				samplerate = (uint32_t) strtoul(optarg, NULL, 10);
+			break;
+
+			case 'F':
+				if (strcmp(optarg, "float") == 0) sample_type = AIRSPYHF_SAMPLE_FLOAT32_IQ;
+				else if (strcmp(optarg, "fp16") == 0) sample_type = AIRSPYHF_SAMPLE_FLOAT16_IQ;
+				else if (strcmp(optarg, "cs8") == 0) sample_type = AIRSPYHF_SAMPLE_INT8_IQ;
+				else if (strcmp(optarg, "cs16") == 0) sample_type = AIRSPYHF_SAMPLE_INT16_IQ;
+				else goto exit_usage;
+			break;
+
+			case 'b':
+				slots = (uint32_t) strtoul(optarg, NULL, 10);
+				if (slots < 4)
+					goto exit_usage;
+			break;
+
+			case 'R':
+				read_path = optarg;
+			break;
+
+			case 'd':
+				verbose = true;
+			break;
+
+			default:
+				goto exit_usage;
+		}
+	}
+
+	signal(SIGINT, &sigint_callback_handler);
+	signal(SIGTERM, &sigint_callback_handler);
+
+	if (read_path != NULL)
+		return read_ring(name, read_path, verbose);
+
+	switch (sample_type)
+	{
+	case AIRSPYHF_SAMPLE_FLOAT16_IQ:
+		frame_size = sizeof(airspyhf_complex_float16_t);
+		break;
+	case AIRSPYHF_SAMPLE_INT8_IQ:
+		frame_size = sizeof(airspyhf_complex_int8_t);
+		break;
+	case AIRSPYHF_SAMPLE_INT16_IQ:
+		frame_size = sizeof(airspyhf_complex_int16_t);
+		break;
+	default:
+		frame_size = sizeof(airspyhf_complex_float_t);
+		break;
+	}
+
+	if ((serial ? airspyhf_open_sn(&device, serial_number) : airspyhf_open(&device)) != AIRSPYHF_SUCCESS) {
+		fprintf(stderr, "airspyhf_open() failed\n");
+		return EXIT_FAILURE;
+	}
+
+	if (airspyhf_set_sample_type(device, sample_type) != AIRSPYHF_SUCCESS ||
+		airspyhf_set_samplerate(device, samplerate) != AIRSPYHF_SUCCESS ||
+		airspyhf_set_freq_double(device, freq_mhz * 1e6) != AIRSPYHF_SUCCESS) {
+		fprintf(stderr, "Unable to configure the receiver\n");
+		goto exit;
+	}
+
+	if (shm_ring_create(&ring, name, slots, (uint32_t) (airspyhf_get_output_size(device) * frame_size),
+		sample_type, samplerate, (uint32_t) frame_size) != SHM_RING_OK) {
+		fprintf(stderr, "Unable to create the shared memory ring %s\n", name);
+		goto exit;
+	}
+
+	if (airspyhf_start(device, rx_callback, NULL) != AIRSPYHF_SUCCESS) {
+		fprintf(stderr, "airspyhf_start() failed\n");
+		goto exit;
+	}
+
+	fprintf(stderr, "Publishing on %s, stop with Ctrl-C\n", name);
+
+	while (!do_exit && airspyhf_is_streaming(device)) {
+		sleep(1);
+		if (verbose)
+			fprintf(stderr, "%llu blocks published\n", (unsigned long long) published);
+	}
+
+	airspyhf_stop(device);
+	if (oversized)
+		fprintf(stderr, "%llu blocks too large for the ring were dropped\n", (unsigned long long) oversized);
+	result = EXIT_SUCCESS;
+
+exit:
+	shm_ring_close(ring);
+	airspyhf_close(device);
+	fprintf(stderr, "done\n");
+	return result;
+
+exit_usage:
+	usage();
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,892 @@
+/*
+ * This file is part of AirSpyHF+.
+ *
+ * rtl_tcp compatible IQ server.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <airspyhf.h>
+
+#if defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#define USE_ZEROCOPY
+#include <linux/errqueue.h>
+#endif
+
+#if !defined __cplusplus
+#if __STDC_VERSION__ < 202311L
+#ifndef bool
+typedef int bool;
+#define true 1
+#define false 0
+#endif
+#endif
+#endif
+
+#define DEFAULT_PORT "1234"
+#define DEFAULT_FREQ_HZ (7100000ul) /* 7.1 MHz */
+#define CLIENT_QUEUE_BLOCKS (256) /* About 1.3 s at 768 kS/s */
+#define MAX_BLOCKS (4096)
+#define MAX_IOV (32) /* Blocks per send */
+#define MAX_ZEROCOPY_PENDING (64) /* Sends waiting for their completion */
+#define MAX_ATT_STEPS (16)
+
+#define CMD_SET_FREQ (0x01)
+#define CMD_SET_SAMPLE_RATE (0x02)
+#define CMD_SET_GAIN_MODE (0x03)
+#define CMD_SET_GAIN (0x04)
+#define CMD_SET_AGC_MODE (0x08)
+#define CMD_SET_GAIN_BY_INDEX (0x0d)
+#define CMD_SET_BIAS_TEE (0x0e)
+
+enum sample_format
+{
+	FORMAT_U8 = 0,
+	FORMAT_CS8,
+	FORMAT_CS16,
+	FORMAT_FLOAT
+};
+
+/* One callback worth of converted samples, shared by every client queue */
+typedef struct t_block
+{
+	struct t_block* next_free;
+	uint32_t refs;
+	size_t length;
+	uint8_t data[1];
+} t_block;
+
+#ifdef USE_ZEROCOPY
+typedef struct
+{
+	uint32_t last_id; /* Notification id of the last sendmsg() of the batch */
+	uint32_t count;
+	t_block* blocks[MAX_IOV];
+} t_zc_batch;
+#endif
+
+typedef struct t_client
+{
+	int sock;
+	char name[NI_MAXHOST + NI_MAXSERV + 1];
+	pthread_t reader;
+	pthread_t sender;
+	t_block* queue[CLIENT_QUEUE_BLOCKS];
+	uint32_t head;
+	uint32_t count;
+	uint64_t dropped;
+	bool closing;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct t_client* next;
+#ifdef USE_ZEROCOPY
+	bool zerocopy;
+	uint32_t zc_next_id;
+	t_zc_batch zc_pending[MAX_ZEROCOPY_PENDING];
+	uint32_t zc_head;
+	uint32_t zc_count;
+#endif
+} t_client;
+
+/* Same layout as the rtl_tcp dongle info */
+typedef struct
+{
+	char magic[4]; /* 'RTL0' */
+	uint32_t tuner_type; /* Big endian */
+	uint32_t gain_count; /* Big endian */
+} t_dongle_info;
+
+volatile bool do_exit = false;
+
+airspyhf_device_t* device = NULL;
+pthread_mutex_t device_mutex = PTHREAD_MUTEX_INITIALIZER;
+uint32_t* samplerates = NULL;
+uint32_t samplerate_count = 0;
+float att_steps[MAX_ATT_STEPS];
+uint32_t att_step_count = 0;
+
+enum sample_format format = FORMAT_U8;
+float gain_8bit = 1.0f;
+size_t frame_size = 2;
+size_t block_size = 0;
+bool zerocopy = false;
+bool verbose = false;
+
+t_client* clients = NULL;
+uint32_t client_count = 0;
+pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t clients_cond = PTHREAD_COND_INITIALIZER;
+
+t_block* free_blocks = NULL;
+uint32_t block_count = 0;
+pthread_mutex_t blocks_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static t_block* block_alloc(void)
+{
+	t_block* block = NULL;
+
+	pthread_mutex_lock(&blocks_mutex);
+	if (free_blocks) {
+		block = free_blocks;
+		free_blocks = block->next_free;
+	} else if (block_count < MAX_BLOCKS) {
+		block = (t_block*) malloc(sizeof(t_block) + block_size);
+		if (block)
+			block_count++;
+	}
+	if (block)
+		block->refs = 1;
+	pthread_mutex_unlock(&blocks_mutex);
+
+	return block;
+}
+
+static void block_release(t_block* block)
+{
+	pthread_mutex_lock(&blocks_mutex);
+	if (--block->refs == 0) {
+		block->next_free = free_blocks;
+		free_blocks = block;
+	}
+	pthread_mutex_unlock(&blocks_mutex);
+}
+
+static void block_retain(t_block* block)
+{
+	pthread_mutex_lock(&blocks_mutex);
+	block->refs++;
+	pthread_mutex_unlock(&blocks_mutex);
+}
+
+static void convert_block(const airspyhf_transfer_t* transfer, t_block* block)
+{
+	const float* src = (const float*) transfer->samples;
+	const int count = transfer->sample_count * 2;
+	const float scale = 127.0f * gain_8bit;
+	long value;
+	int i;
+
+	switch (format)
+	{
+	case FORMAT_U8:
+		for (i = 0; i < count; i++) {
+			value = lrintf(src[i] * scale);
+			block->data[i] = (uint8_t) (128 + (value < -128 ? -128 : value > 127 ? 127 : value));
+		}
+		break;
+
+	case FORMAT_CS8:
+		for (i = 0; i < count; i++) {
+			value = lrintf(src[i] * scale);
+			((int8_t*) block->data)[i] = (int8_t) (value < -128 ? -128 : value > 127 ? 127 : value);
+		}
+		break;
+
+	default:
+		/* The library already delivers CS16 and float */
+		memcpy(block->data, transfer->samples, transfer->sample_count * frame_size);
+		break;
+	}
+	block->length = transfer->sample_count * frame_size;
+}
+
+/* Never blocks on a client: a full queue drops the block for that client only */
+int rx_callback(airspyhf_transfer_t* transfer)
+{
+	t_block* block;
+	t_client* client;
+
+	if (transfer->sample_count * frame_size > block_size)
+		return 0;
+
+	pthread_mutex_lock(&clients_mutex);
+	if (clients == NULL) {
+		pthread_mutex_unlock(&clients_mutex);
+		return 0;
+	}
+	pthread_mutex_unlock(&clients_mutex);
+
+	block = block_alloc();
+	if (block == NULL)
+		return 0;
+	convert_block(transfer, block);
+
+	pthread_mutex_lock(&clients_mutex);
+	for (client = clients; client != NULL; client = client->next) {
+		pthread_mutex_lock(&client->mutex);
+		if (client->closing) {
+			/* Nothing */
+		} else if (client->count == CLIENT_QUEUE_BLOCKS) {
+			client->dropped++;
+		} else {
+			block_retain(block);
+			client->queue[(client->head + client->count) % CLIENT_QUEUE_BLOCKS] = block;
+			client->count++;
+			pthread_cond_signal(&client->cond);
+		}
+		pthread_mutex_unlock(&client->mutex);
+	}
+	pthread_mutex_unlock(&clients_mutex);
+
+	block_release(block);
+
+	return 0;
+}
+
+static void client_close(t_client* client)
+{
+	pthread_mutex_lock(&client->mutex);
+	client->closing = true;
+	pthread_cond_signal(&client->cond);
+	pthread_mutex_unlock(&client->mutex);
+	shutdown(client->sock, SHUT_RDWR);
+}
+
+#ifdef USE_ZEROCOPY
+
+/* Releases the blocks of every batch the kernel is done with */
+static void zerocopy_reap(t_client* client, bool wait)
+{
+	struct msghdr msg;
+	struct cmsghdr* cm;
+	struct sock_extended_err* serr;
+	struct pollfd pfd;
+	char control[128];
+	t_zc_batch* batch;
+	uint32_t hi;
+	uint32_t i;
+
+	while (client->zc_count > 0) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(client->sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if (errno != EAGAIN || !wait)
+				return;
+			pfd.fd = client->sock;
+			pfd.events = 0;
+			if (poll(&pfd, 1, 100) < 0 || client->closing)
+				return;
+			continue;
+		}
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+			serr = (struct sock_extended_err*) CMSG_DATA(cm);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			/* TCP completes in order, everything up to hi is done */
+			hi = serr->ee_data;
+			while (client->zc_count > 0) {
+				batch = &client->zc_pending[client->zc_head];
+				if ((int32_t) (batch->last_id - hi) > 0)
+					break;
+				for (i = 0; i < batch->count; i++)
+					block_release(batch->blocks[i]);
+				client->zc_head = (client->zc_head + 1) % MAX_ZEROCOPY_PENDING;
+				client->zc_count--;
+			}
+		}
+		wait = false;
+	}
+}
+
+#endif
+
+/* Takes ownership of the blocks, whether the batch went out or not */
+static bool send_batch(t_client* client, t_block** blocks, uint32_t count)
+{
+	struct iovec iov[MAX_IOV];
+	struct iovec* next = iov;
+	struct msghdr msg;
+	uint32_t remaining = count;
+	ssize_t sent;
+	uint32_t i;
+	int flags = MSG_NOSIGNAL;
+	bool result = true;
+#ifdef USE_ZEROCOPY
+	bool zerocopy_sent = false;
+#endif
+
+	for (i = 0; i < count; i++) {
+		iov[i].iov_base = blocks[i]->data;
+		iov[i].iov_len = blocks[i]->length;
+	}
+
+#ifdef USE_ZEROCOPY
+	if (client->zerocopy) {
+		/* A slot is needed before anything is pinned, the blocks can't be recycled until it completes */
+		while (client->zc_count == MAX_ZEROCOPY_PENDING && !client->closing)
+			zerocopy_reap(client, true);
+		if (client->zc_count < MAX_ZEROCOPY_PENDING)
+			flags |= MSG_ZEROCOPY;
+	}
+#endif
+
+	while (remaining > 0) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = next;
+		msg.msg_iovlen = remaining;
+
+		sent = sendmsg(client->sock, &msg, flags);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+#ifdef USE_ZEROCOPY
+			/* Out of pinned memory: this one goes through the copy path */
+			if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+				flags &= ~MSG_ZEROCOPY;
+				continue;
+			}
+#endif
+			result = false;
+			break;
+		}
+#ifdef USE_ZEROCOPY
+		if (flags & MSG_ZEROCOPY) {
+			client->zc_next_id++;
+			zerocopy_sent = true;
+		}
+#endif
+
+		while (remaining > 0 && (size_t) sent >= next->iov_len) {
+			sent -= next->iov_len;
+			next++;
+			remaining--;
+		}
+		if (remaining > 0) {
+			next->iov_base = (uint8_t*) next->iov_base + sent;
+			next->iov_len -= sent;
+		}
+	}
+
+#ifdef USE_ZEROCOPY
+	if (zerocopy_sent) {
+		/* The kernel still references the blocks until the completion, even if a later part went through the copy path */
+		t_zc_batch* batch = &client->zc_pending[(client->zc_head + client->zc_count) % MAX_ZEROCOPY_PENDING];
+		batch->last_id = client->zc_next_id - 1;
+		batch->count = count;
+		memcpy(batch->blocks, blocks, count * sizeof(t_block*));
+		client->zc_count++;
+		if (result)
+			zerocopy_reap(client, false);
+		return result;
+	}
+#endif
+
+	for (i = 0; i < count; i++)
+		block_release(blocks[i]);
+
+	return result;
+}
+
+static void* sender_threadproc(void* arg)
+{
+	t_client* client = (t_client*) arg;
+	t_block* blocks[MAX_IOV];
+	uint32_t count;
+	uint32_t i;
+
+	while (true) {
+		pthread_mutex_lock(&client->mutex);
+		while (client->count == 0 && !client->closing)
+			pthread_cond_wait(&client->cond, &client->mutex);
+		if (client->closing) {
+			pthread_mutex_unlock(&client->mutex);
+			break;
+		}
+		/* Everything queued goes out in a single call */
+		count = client->count < MAX_IOV ? client->count : MAX_IOV;
+		for (i = 0; i < count; i++)
+			blocks[i] = client->queue[(client->head + i) % CLIENT_QUEUE_BLOCKS];
+		client->head = (client->head + count) % CLIENT_QUEUE_BLOCKS;
+		client->count -= count;
+		pthread_mutex_unlock(&client->mutex);
+
+		if (!send_batch(client, blocks, count)) {
+			client_close(client);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static void set_gain_by_index(uint32_t index)
+{
+	/* The gain table is the attenuator table upside down */
+	if (att_step_count == 0)
+		return;
+	if (index >= att_step_count)
+		index = att_step_count - 1;
+	airspyhf_set_att(device, att_steps[att_step_count - 1 - index]);
+}
+
+static void handle_command(t_client* client, uint8_t cmd, uint32_t param)
+{
+	uint32_t i;
+	uint32_t best;
+	float att;
+
+	pthread_mutex_lock(&device_mutex);
+	switch (cmd)
+	{
+	case CMD_SET_FREQ:
+		if (airspyhf_set_freq(device, param) != AIRSPYHF_SUCCESS)
+			fprintf(stderr, "%s: airspyhf_set_freq(%u) failed\n", client->name, param);
+		else if (verbose)
+			fprintf(stderr, "%s: frequency %u Hz\n", client->name, param);
+		break;
+
+	case CMD_SET_SAMPLE_RATE:
+		/* Closest supported rate */
+		best = 0;
+		for (i = 1; i < samplerate_count; i++) {
+			if (labs((long) samplerates[i] - (long) param) < labs((long) samplerates[best] - (long) param))
+				best = i;
+		}
+		if (samplerate_count > 0 && airspyhf_set_samplerate(device, samplerates[best]) == AIRSPYHF_SUCCESS) {
+			if (verbose)
+				fprintf(stderr, "%s: sample rate %u S/s\n", client->name, samplerates[best]);
+		} else {
+			fprintf(stderr, "%s: airspyhf_set_samplerate(%u) failed\n", client->name, param);
+		}
+		break;
+
+	case CMD_SET_GAIN_MODE:
+		/* 0 = automatic */
+		airspyhf_set_hf_agc(device, param == 0 ? 1 : 0);
+		break;
+
+	case CMD_SET_AGC_MODE:
+		airspyhf_set_hf_agc(device, param != 0 ? 1 : 0);
+		break;
+
+	case CMD_SET_GAIN:
+		/* Tenths of dB, the gain is the headroom left by the attenuator */
+		if (att_step_count > 0) {
+			att = att_steps[att_step_count - 1] - (int32_t) param / 10.0f;
+			airspyhf_set_att(device, att < 0.0f ? 0.0f : att);
+		}
+		break;
+
+	case CMD_SET_GAIN_BY_INDEX:
+		set_gain_by_index(param);
+		break;
+
+	case CMD_SET_BIAS_TEE:
+		airspyhf_set_bias_tee(device, param != 0 ? 1 : 0);
+		break;
+
+	default:
+		if (verbose)
+			fprintf(stderr, "%s: unsupported command 0x%02x\n", client->name, cmd);
+		break;
+	}
+	pthread_mutex_unlock(&device_mutex);
+}
+
+static bool recv_all(int sock, uint8_t* buffer, size_t length)
+{
+	ssize_t n;
+
+	while (length > 0) {
+		n = recv(sock, buffer, length, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		buffer += n;
+		length -= (size_t) n;
+	}
+	return true;
+}
+
+/* Owns the client: reads the commands, then tears everything down */
+static void* reader_threadproc(void* arg)
+{
+	t_client* client = (t_client*) arg;
+	t_client** link;
+	uint8_t cmd[5];
+
+	while (recv_all(client->sock, cmd, sizeof(cmd))) {
+		handle_command(client, cmd[0],
+			((uint32_t) cmd[1] << 24) | ((uint32_t) cmd[2] << 16) | ((uint32_t) cmd[3] << 8) | cmd[4]);
+	}
+
+	client_close(client);
+	pthread_join(client->sender, NULL);
+
+	pthread_mutex_lock(&clients_mutex);
+	for (link = &clients; *link != NULL; link = &(*link)->next) {
+		if (*link == client) {
+			*link = client->next;
+			break;
+		}
+	}
+	client_count--;
+	pthread_cond_broadcast(&clients_cond);
+	pthread_mutex_unlock(&clients_mutex);
+
+	/* No more producers, the queues can be emptied without the lock */
+	while (client->count > 0) {
+		block_release(client->queue[client->head]);
+		client->head = (client->head + 1) % CLIENT_QUEUE_BLOCKS;
+		client->count--;
+	}
+#ifdef USE_ZEROCOPY
+	/* shutdown() leaves the send queue alone and the kernel may still read the pinned
+	   blocks, a reset purges it before they go back to the pool */
+	if (client->zc_count > 0) {
+		struct linger reset = { 1, 0 };
+		setsockopt(client->sock, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+	}
+#endif
+	close(client->sock);
+#ifdef USE_ZEROCOPY
+	while (client->zc_count > 0) {
+		uint32_t i;
+		t_zc_batch* batch = &client->zc_pending[client->zc_head];
+		for (i = 0; i < batch->count; i++)
+			block_release(batch->blocks[i]);
+		client->zc_head = (client->zc_head + 1) % MAX_ZEROCOPY_PENDING;
+		client->zc_count--;
+	}
+#endif
+
+	fprintf(stderr, "%s: disconnected", client->name);
+	if (client->dropped > 0)
+		fprintf(stderr, ", %llu blocks dropped", (unsigned long long) client->dropped);
+	fprintf(stderr, "\n");
+
+	pthread_mutex_destroy(&client->mutex);
+	pthread_cond_destroy(&client->cond);
+	free(client);
+
+	return NULL;
+}
+
+static void client_start(int sock, const struct sockaddr_storage* addr)
+{
+	t_client* client;
+	t_dongle_info info;
+	char host[NI_MAXHOST];
+	char port[NI_MAXSERV];
+	int one = 1;
+
+	client = (t_client*) calloc(1, sizeof(t_client));
+	if (client == NULL) {
+		close(sock);
+		return;
+	}
+	client->sock = sock;
+	pthread_mutex_init(&client->mutex, NULL);
+	pthread_cond_init(&client->cond, NULL);
+
+	if (getnameinfo((const struct sockaddr*) addr, sizeof(*addr), host, sizeof(host), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+		snprintf(client->name, sizeof(client->name), "%s:%s", host, port);
+	else
+		snprintf(client->name, sizeof(client->name), "client");
+
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef USE_ZEROCOPY
+	if (zerocopy)
+		client->zerocopy = setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+#endif
+
+	memcpy(info.magic, "RTL0", 4);
+	info.tuner_type = htonl(0);
+	info.gain_count = htonl(att_step_count);
+	if (send(sock, &info, sizeof(info), MSG_NOSIGNAL) != sizeof(info)) {
+		close(sock);
+		free(client);
+		return;
+	}
+
+	if (pthread_create(&client->sender, NULL, sender_threadproc, client) != 0) {
+		close(sock);
+		free(client);
+		return;
+	}
+
+	pthread_mutex_lock(&clients_mutex);
+	client->next = clients;
+	clients = client;
+	client_count++;
+	pthread_mutex_unlock(&clients_mutex);
+
+	if (pthread_create(&client->reader, NULL, reader_threadproc, client) != 0) {
+		client_close(client);
+		pthread_join(client->sender, NULL);
+		pthread_mutex_lock(&clients_mutex);
+		clients = client->next;
+		client_count--;
+		pthread_mutex_unlock(&clients_mutex);
+		close(sock);
+		free(client);
+		return;
+	}
+	pthread_detach(client->reader);
+
+	fprintf(stderr, "%s: connected%s\n", client->name,
+#ifdef USE_ZEROCOPY
+		client->zerocopy ? " (zero copy)" :
+#endif
+		"");
+}
+
+static int listen_on(const char* address, const char* port)
+{
+	struct addrinfo hints;
+	struct addrinfo* result;
+	struct addrinfo* ai;
+	int sock = -1;
+	int one = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	if (getaddrinfo(address, port, &hints, &result) != 0)
+		return -1;
+
+	for (ai = result; ai != NULL; ai = ai->ai_next) {
+		sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (sock < 0)
+			continue;
+		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(sock, ai->ai_addr, ai->ai_addrlen) == 0 && listen(sock, 4) == 0)
+			break;
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(result);
+
+	return sock;
+}
+
+static void sigint_callback_handler(int signum)
+{
+	do_exit = true;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+	"airspyhf_tcp\n"
+	"Usage:\n"
+	"\t-a <address>\t\tListen address (default all)\n"
+	"\t-p <port>\t\tListen port (default %s)\n"
+	"\t-s <serial number>\tOpen device with specified 64bits serial number\n"
+	"\t-f <frequency>\t\tInitial frequency in MHz (default 7.1)\n"
+	"\t-r <sample_rate>\tInitial sample rate (default 768000)\n"
+	"\t-F u8|cs8|cs16|float\tSample format (default u8, as rtl_tcp)\n"
+	"\t-G <dB>\t\t\tDigital gain applied to the 8-bit formats (default 0)\n"
+	"\t-Z\t\t\tSend with MSG_ZEROCOPY (Linux)\n"
+	"\t-d\t\t\tVerbose mode\n"
+	"Commands: set frequency, sample rate, gain (mapped to the attenuator), AGC, bias tee\n"
+	, DEFAULT_PORT);
+}
+
+int main(int argc, char** argv)
+{
+	int opt;
+	const char* address = NULL;
+	const char* port = DEFAULT_PORT;
+	uint64_t serial_number = 0;
+	bool serial = false;
+	double freq_mhz = DEFAULT_FREQ_HZ / 1e6;
+	uint32_t samplerate = 768000;
+	enum airspyhf_sample_type sample_type;
+	int listen_sock = -1;
+	int sock;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	struct pollfd pfd;
+	t_client* client;
+	t_block* block;
+	int result = EXIT_FAILURE;
+
+	while( (opt = getopt(argc, argv, "a:p:s:f:r:F:G:Zdh")) != EOF )
+	{
+		switch( opt )
+		{
+			case 'a':
+				address = optarg;
+			break;
+
+			case 'p':
+				port = optarg;
+			break;
+
+			case 's':
+				serial = true;
+				serial_number = strtoull(optarg, NULL, 0);
+			break;
+
+			case 'f':
+				freq_mhz = atof(optarg);
+			break;
+
+			case 'r':
+				samplerate = (uint32_t) strtoul(optarg, NULL, 10);
+			break;
+
+			case 'F':
+				if (strcmp(optarg, "u8") == 0) format = FORMAT_U8;
+				else if (strcmp(optarg, "cs8") == 0) format = FORMAT_CS8;
+				else if (strcmp(optarg, "cs16") == 0) format = FORMAT_CS16;
+				else if (strcmp(optarg, "float") == 0) format = FORMAT_FLOAT;
+				else goto exit_usage;
+			break;
+
+			case 'G':
+				gain_8bit = powf(10.0f, (float) atof(optarg) / 20.0f);
+			break;
+
+			case 'Z':
+				zerocopy = true;
+			break;
+
+			case 'd':
+				verbose = true;
+			break;
+
+			default:
+				goto exit_usage;
+		}
+	}
+
+	switch (format)
+	{
+	case FORMAT_CS16:
+		sample_type = AIRSPYHF_SAMPLE_INT16_IQ;
+		frame_size = 2 * sizeof(int16_t);
+		break;
+	case FORMAT_FLOAT:
+		sample_type = AIRSPYHF_SAMPLE_FLOAT32_IQ;
+		frame_size = 2 * sizeof(float);
+		break;
+	default:
+		/* Converted here with a fixed scale, the library int8 type is scaled per block */
+		sample_type = AIRSPYHF_SAMPLE_FLOAT32_IQ;
+		frame_size = 2 * sizeof(int8_t);
+		break;
+	}
+
+	if ((serial ? airspyhf_open_sn(&device, serial_number) : airspyhf_open(&device)) != AIRSPYHF_SUCCESS) {
+		fprintf(stderr, "airspyhf_open() failed\n");
+		return EXIT_FAILURE;
+	}
+
+	airspyhf_get_samplerates(device, &samplerate_count, 0);
+	samplerates = (uint32_t*) malloc(samplerate_count * sizeof(uint32_t));
+	if (samplerates == NULL || airspyhf_get_samplerates(device, samplerates, samplerate_count) != AIRSPYHF_SUCCESS)
+		goto exit;
+
+	airspyhf_get_att_steps(device, &att_step_count, 0);
+	if (att_step_count > MAX_ATT_STEPS || airspyhf_get_att_steps(device, att_steps, att_step_count) != AIRSPYHF_SUCCESS)
+		att_step_count = 0;
+
+	block_size = (size_t) airspyhf_get_output_size(device) * frame_size;
+
+	if (airspyhf_set_sample_type(device, sample_type) != AIRSPYHF_SUCCESS ||
+		airspyhf_set_samplerate(device, samplerate) != AIRSPYHF_SUCCESS ||
+		airspyhf_set_freq_double(device, freq_mhz * 1e6) != AIRSPYHF_SUCCESS) {
+		fprintf(stderr, "Unable to configure the receiver\n");
+		goto exit;
+	}
+
+	listen_sock = listen_on(address, port);
+	if (listen_sock < 0) {
+		fprintf(stderr, "Unable to listen on port %s\n", port);
+		goto exit;
+	}
+
+	signal(SIGINT, &sigint_callback_handler);
+	signal(SIGTERM, &sigint_callback_handler);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (airspyhf_start(device, rx_callback, NULL) != AIRSPYHF_SUCCESS) {
+		fprintf(stderr, "airspyhf_start() failed\n");
+		goto exit;
+	}
+
+	fprintf(stderr, "Listening on port %s, stop with Ctrl-C\n", port);
+
+	while (!do_exit && airspyhf_is_streaming(device)) {
+		pfd.fd = listen_sock;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 500) <= 0)
+			continue;
+
+		addr_len = sizeof(addr);
+		sock = accept(listen_sock, (struct sockaddr*) &addr, &addr_len);
+		if (sock >= 0)
+			client_start(sock, &addr);
+	}
+
+	airspyhf_stop(device);
+	result = EXIT_SUCCESS;
+
+exit:
+	if (listen_sock >= 0)
+		close(listen_sock);
+
+	/* Readers exit once their socket is shut down */
+	pthread_mutex_lock(&clients_mutex);
+	for (client = clients; client != NULL; client = client->next)
+		client_close(client);
+	while (client_count > 0)
+		pthread_cond_wait(&clients_cond, &clients_mutex);
+	pthread_mutex_unlock(&clients_mutex);
+
+	while (free_blocks) {
+		block = free_blocks;
+		free_blocks = block->next_free;
+		free(block);
+	}
+
+	airspyhf_close(device);
+	free(samplerates);
+	fprintf(stderr, "done\n");
+	return result;
+
+exit_usage:
+	usage();
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,515 @@
+/*
+ * This file is part of AirSpyHF+.
+ *
+ * Streams the receiver as VITA-49 (VRT) signal data and context packets over UDP.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* sendmmsg() */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include <airspyhf.h>
+
+#if !defined __cplusplus
+#if __STDC_VERSION__ < 202311L
+#ifndef bool
+typedef int bool;
+#define true 1
+#define false 0
+#endif
+#endif
+#endif
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT "4991"
+#define DEFAULT_FREQ_HZ (7100000ul) /* 7.1 MHz */
+#define DEFAULT_STREAM_ID (1)
+#define MAX_DATAGRAM (1472) /* Ethernet MTU less the IPv4 and UDP headers */
+#define MAX_PACKETS (256) /* Data packets per block */
+
+/* VRT packet header, VITA 49.0 */
+#define VRT_TYPE_DATA_SID (0x1u << 28) /* IF data packet with stream identifier */
+#define VRT_TYPE_CONTEXT (0x4u << 28)
+#define VRT_TSI_UTC (0x1u << 22)
+#define VRT_TSF_REAL_TIME (0x2u << 20) /* Picoseconds */
+#define VRT_HEADER_WORDS (5) /* Header, stream id, integer and fractional timestamp */
+
+/* Context indicator field 0 */
+#define CIF0_CHANGE (1u << 31)
+#define CIF0_BANDWIDTH (1u << 29)
+#define CIF0_RF_FREQ (1u << 27)
+#define CIF0_SAMPLE_RATE (1u << 21)
+#define CIF0_PAYLOAD_FORMAT (1u << 15)
+#define CONTEXT_WORDS (VRT_HEADER_WORDS + 1 + 2 + 2 + 2 + 2)
+
+enum sample_format
+{
+	FORMAT_CS16 = 0,
+	FORMAT_FLOAT
+};
+
+volatile bool do_exit = false;
+
+airspyhf_device_t* device = NULL;
+int sock = -1;
+enum sample_format format = FORMAT_CS16;
+uint32_t stream_id = DEFAULT_STREAM_ID;
+uint32_t packet_samples = 0;
+uint32_t packet_words = 0;
+bool verbose = false;
+
+/* Packets of the current block, sent with a single sendmmsg() */
+uint32_t* packets = NULL;
+uint32_t packets_per_block = 0;
+uint8_t data_count = 0;
+uint8_t context_count = 0;
+
+/* Sample n is at time_base + (n - sample_base) / rate */
+uint64_t sample_counter = 0;
+uint64_t sample_base = 0;
+uint64_t time_base_sec = 0;
+uint64_t time_base_ps = 0;
+uint64_t next_context = 0;
+
+/* Settings changed by the control loop, picked up by the callback */
+pthread_mutex_t settings_mutex = PTHREAD_MUTEX_INITIALIZER;
+uint32_t samplerate = 768000;
+double freq_hz = DEFAULT_FREQ_HZ;
+bool context_changed = false;
+uint32_t stream_samplerate = 0;
+double stream_freq_hz = 0;
+
+uint64_t packets_sent = 0;
+uint64_t packets_failed = 0;
+
+static void put_u64(uint32_t* dest, uint64_t value)
+{
+	dest[0] = htonl((uint32_t) (value >> 32));
+	dest[1] = htonl((uint32_t) value);
+}
+
+/* 64 bits two's complement, radix point after bit 20 */
+static uint64_t hz_to_fixed(double hz)
+{
+	return (uint64_t) (int64_t) (hz * 1048576.0 + (hz < 0 ? -0.5 : 0.5));
+}
+
+static void sample_time(uint64_t sample, uint32_t rate, uint32_t* sec, uint64_t* ps)
+{
+	const uint64_t delta = sample - sample_base;
+	uint64_t frac;
+
+	/* delta % rate < 2^20, the product fits */
+	frac = time_base_ps + (delta % rate) * 1000000000000ull / rate;
+	*sec = (uint32_t) (time_base_sec + delta / rate + frac / 1000000000000ull);
+	*ps = frac % 1000000000000ull;
+}
+
+static uint32_t* write_header(uint32_t* p, uint32_t type, uint8_t count, uint32_t words, uint64_t sample, uint32_t rate)
+{
+	uint32_t sec;
+	uint64_t ps;
+
+	sample_time(sample, rate, &sec, &ps);
+	p[0] = htonl(type | VRT_TSI_UTC | VRT_TSF_REAL_TIME | ((uint32_t) (count & 0xf) << 16) | words);
+	p[1] = htonl(stream_id);
+	p[2] = htonl(sec);
+	put_u64(p + 3, ps);
+
+	return p + VRT_HEADER_WORDS;
+}
+
+static void write_context(uint32_t* p, bool changed, uint32_t rate, double freq)
+{
+	uint32_t word;
+
+	p = write_header(p, VRT_TYPE_CONTEXT, context_count++, CONTEXT_WORDS, sample_counter, rate);
+	p[0] = htonl((changed ? CIF0_CHANGE : 0) | CIF0_BANDWIDTH | CIF0_RF_FREQ | CIF0_SAMPLE_RATE | CIF0_PAYLOAD_FORMAT);
+	put_u64(p + 1, hz_to_fixed(rate));
+	put_u64(p + 3, hz_to_fixed(freq));
+	put_u64(p + 5, hz_to_fixed(rate));
+
+	/* Link efficient, complex cartesian, 16 bits signed fixed point or 32 bits IEEE-754 */
+	word = (0x1u << 31) | (0x1u << 29);
+	if (format == FORMAT_FLOAT)
+		word |= (0x0eu << 24) | (31u << 6) | 31u;
+	else
+		word |= (15u << 6) | 15u;
+	p[7] = htonl(word);
+	p[8] = htonl(0);
+}
+
+static void send_packets(const uint32_t* first, uint32_t count, uint32_t words)
+{
+	struct iovec iov[MAX_PACKETS];
+	uint32_t i;
+#if defined(__linux__)
+	struct mmsghdr msgs[MAX_PACKETS];
+	uint32_t sent = 0;
+	int result;
+
+	memset(msgs, 0, count * sizeof(msgs[0]));
+	for (i = 0; i < count; i++) {
+		iov[i].iov_base = (void*) (first + (size_t) i * words);
+		iov[i].iov_len = words * sizeof(uint32_t);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (sent < count) {
+		result = sendmmsg(sock, msgs + sent, count - sent, 0);
+		if (result < 0) {
+			if (errno == EINTR)
+				continue;
+			/* Nobody listening on a connected socket, or a full queue: drop the packet */
+			sent++;
+			packets_failed++;
+			continue;
+		}
+		sent += (uint32_t) result;
+		packets_sent += (uint32_t) result;
+	}
+#else
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	for (i = 0; i < count; i++) {
+		iov[i].iov_base = (void*) (first + (size_t) i * words);
+		iov[i].iov_len = words * sizeof(uint32_t);
+		msg.msg_iov = &iov[i];
+		msg.msg_iovlen = 1;
+		if (sendmsg(sock, &msg, 0) < 0)
+			packets_failed++;
+		else
+			packets_sent++;
+	}
+#endif
+}
+
+/* Payloads are big endian like the rest of the packet */
+static void convert_payload(uint32_t* dest, const airspyhf_transfer_t* transfer, uint32_t offset)
+{
+	uint32_t i;
+
+	if (format == FORMAT_FLOAT) {
+		const uint32_t* src = (const uint32_t*) transfer->samples + (size_t) offset * 2;
+		for (i = 0; i < packet_samples * 2; i++)
+			dest[i] = htonl(src[i]);
+	} else {
+		const airspyhf_complex_int16_t* src = (const airspyhf_complex_int16_t*) transfer->samples + offset;
+		uint16_t* out = (uint16_t*) dest;
+		for (i = 0; i < packet_samples; i++) {
+			out[2 * i] = htons((uint16_t) src[i].re);
+			out[2 * i + 1] = htons((uint16_t) src[i].im);
+		}
+	}
+}
+
+int rx_callback(airspyhf_transfer_t* transfer)
+{
+	uint32_t* p = packets;
+	uint32_t count = 0;
+	uint32_t rate;
+	uint32_t offset;
+	bool changed;
+	uint32_t sec;
+	uint64_t ps;
+
+	/* Dropped samples still count, timestamps stay aligned with the air */
+	sample_counter += transfer->dropped_samples;
+
+	pthread_mutex_lock(&settings_mutex);
+	changed = context_changed;
+	context_changed = false;
+	if (changed && stream_samplerate != samplerate) {
+		/* Rebase the clock at this block for the new rate */
+		sample_time(sample_counter, stream_samplerate, &sec, &ps);
+		time_base_sec = sec;
+		time_base_ps = ps;
+		sample_base = sample_counter;
+	}
+	stream_samplerate = samplerate;
+	stream_freq_hz = freq_hz;
+	pthread_mutex_unlock(&settings_mutex);
+	rate = stream_samplerate;
+
+	/* On changes and once a second, with the same timestamp as the data that follows */
+	if (changed || sample_counter >= next_context) {
+		write_context(p, changed, rate, stream_freq_hz);
+		send_packets(p, 1, CONTEXT_WORDS);
+		next_context = sample_counter + rate;
+	}
+
+	for (offset = 0; offset + packet_samples <= (uint32_t) transfer->sample_count; offset += packet_samples) {
+		convert_payload(write_header(p, VRT_TYPE_DATA_SID, data_count++, packet_words, sample_counter + offset, rate), transfer, offset);
+		p += packet_words;
+		count++;
+	}
+	send_packets(packets, count, packet_words);
+	sample_counter += (uint64_t) transfer->sample_count;
+
+	return 0;
+}
+
+static int connect_to(const char* host, const char* port)
+{
+	struct addrinfo hints;
+	struct addrinfo* result;
+	struct addrinfo* ai;
+	int s = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	if (getaddrinfo(host, port, &hints, &result) != 0)
+		return -1;
+
+	for (ai = result; ai != NULL; ai = ai->ai_next) {
+		s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (s < 0)
+			continue;
+		if (connect(s, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(s);
+		s = -1;
+	}
+	freeaddrinfo(result);
+
+	return s;
+}
+
+/* One command per line on stdin: "f <MHz>" or "r <sample rate>" */
+static void handle_command(char* line)
+{
+	double value;
+
+	if (sscanf(line + 1, "%lf", &value) != 1)
+		return;
+
+	if (line[0] == 'f' && airspyhf_set_freq_double(device, value * 1e6) == AIRSPYHF_SUCCESS) {
+		pthread_mutex_lock(&settings_mutex);
+		freq_hz = value * 1e6;
+		context_changed = true;
+		pthread_mutex_unlock(&settings_mutex);
+	} else if (line[0] == 'r' && airspyhf_set_samplerate(device, (uint32_t) value) == AIRSPYHF_SUCCESS) {
+		pthread_mutex_lock(&settings_mutex);
+		samplerate = (uint32_t) value;
+		context_changed = true;
+		pthread_mutex_unlock(&settings_mutex);
+	} else {
+		fprintf(stderr, "Command failed: %s", line);
+	}
+}
+
+static void sigint_callback_handler(int signum)
+{
+	(void) signum;
+	do_exit = true;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+	"airspyhf_vita\n"
+	"Usage:\n"
+	"\t-a <host>\t\tDestination host (default %s)\n"
+	"\t-p <port>\t\tDestination port (default %s)\n"
+	"\t-s <serial number>\tOpen device with specified 64bits serial number\n"
+	"\t-f <frequency>\t\tInitial frequency in MHz (default 7.1)\n"
+	"\t-r <sample_rate>\tInitial sample rate (default 768000)\n"
+	"\t-F cs16|float\t\tPayload format (default cs16)\n"
+	"\t-P <samples>\t\tSamples per packet, divides the samples of a block (default fits a 1500 bytes MTU)\n"
+	"\t-i <stream id>\t\tVRT stream identifier (default %d)\n"
+	"\t-d\t\t\tVerbose mode\n"
+	"Commands on stdin: f <MHz>, r <sample rate>\n"
+	, DEFAULT_HOST, DEFAULT_PORT, DEFAULT_STREAM_ID);
+}
+
+int main(int argc, char** argv)
+{
+	int opt;
+	const char* host = DEFAULT_HOST;
+	const char* port = DEFAULT_PORT;
+	uint64_t serial_number = 0;
+	bool serial = false;
+	uint32_t output_size;
+	uint32_t sample_size;
+	struct timeval now;
+	struct pollfd pfd;
+	char line[128];
+	bool control = true;
+	int result = EXIT_FAILURE;
+
+	while( (opt = getopt(argc, argv, "a:p:s:f:r:F:P:i:dh")) != EOF )
+	{
+		switch( opt )
+		{
+			case 'a':
+				host = optarg;
+			break;
+
+			case 'p':
+				port = optarg;
+			break;
+
+			case 's':
+				serial = true;
+				serial_number = strtoull(optarg, NULL, 0);
+			break;
+
+			case 'f':
+				freq_hz = atof(optarg) * 1e6;
+			break;
+
+			case 'r':
+				samplerate = (uint32_t) strtoul(optarg, NULL, 10);
+			break;
+
+			case 'F':
+				if (strcmp(optarg, "cs16") == 0) format = FORMAT_CS16;
+				else if (strcmp(optarg, "float") == 0) format = FORMAT_FLOAT;
+				else goto exit_usage;
+			break;
+
+			case 'P':
+				packet_samples = (uint32_t) strtoul(optarg, NULL, 10);
+				if (packet_samples == 0)
+					goto exit_usage;
+			break;
+
+			case 'i':
+				stream_id = (uint32_t) strtoul(optarg, NULL, 0);
+			break;
+
+			case 'd':
+				verbose = true;
+			break;
+
+			default:
+				goto exit_usage;
+		}
+	}
+
+	sock = connect_to(host, port);
+	if (sock < 0) {
+		fprintf(stderr, "Unable to reach %s:%s\n", host, port);
+		goto exit;
+	}
+
+	if ((serial ? airspyhf_open_sn(&device, serial_number) : airspyhf_open(&device)) != AIRSPYHF_SUCCESS) {
+		fprintf(stderr, "airspyhf_open() failed\n");
+		goto exit;
+	}
+
+	if (airspyhf_set_sample_type(device, format == FORMAT_FLOAT ? AIRSPYHF_SAMPLE_FLOAT32_IQ : AIRSPYHF_SAMPLE_INT16_IQ) != AIRSPYHF_SUCCESS ||
+		airspyhf_set_samplerate(device, samplerate) != AIRSPYHF_SUCCESS ||
+		airspyhf_set_freq_double(device, freq_hz) != AIRSPYHF_SUCCESS) {
+		fprintf(stderr, "Unable to configure the receiver\n");
+		goto exit;
+	}
+
+	sample_size = format == FORMAT_FLOAT ? sizeof(airspyhf_complex_float_t) : sizeof(airspyhf_complex_int16_t);
+	output_size = (uint32_t) airspyhf_get_output_size(device);
+	if (packet_samples == 0) {
+		/* Largest divisor of the block that fits a datagram */
+		packet_samples = output_size;
+		while (packet_samples > 1 && VRT_HEADER_WORDS * sizeof(uint32_t) + packet_samples * sample_size > MAX_DATAGRAM)
+			packet_samples /= 2;
+	}
+	if (output_size % packet_samples != 0 || output_size / packet_samples > MAX_PACKETS) {
+		fprintf(stderr, "%u samples per packet do not divide the %u samples of a block\n", packet_samples, output_size);
+		goto exit;
+	}
+	packet_words = VRT_HEADER_WORDS + packet_samples * sample_size / sizeof(uint32_t);
+	packets_per_block = output_size / packet_samples;
+	if (packet_words > 0xffff) {
+		fprintf(stderr, "Packets are limited to 65535 words\n");
+		goto exit;
+	}
+
+	packets = (uint32_t*) malloc((size_t) packets_per_block * packet_words * sizeof(uint32_t) + CONTEXT_WORDS * sizeof(uint32_t));
+	if (packets == NULL)
+		goto exit;
+
+	/* The host clock at start anchors every timestamp, sample counts do the rest */
+	gettimeofday(&now, NULL);
+	time_base_sec = (uint64_t) now.tv_sec;
+	time_base_ps = (uint64_t) now.tv_usec * 1000000ull;
+	stream_samplerate = samplerate;
+
+	signal(SIGINT, &sigint_callback_handler);
+	signal(SIGTERM, &sigint_callback_handler);
+
+	if (airspyhf_start(device, rx_callback, NULL) != AIRSPYHF_SUCCESS) {
+		fprintf(stderr, "airspyhf_start() failed\n");
+		goto exit;
+	}
+
+	fprintf(stderr, "Streaming to %s:%s, %u samples per packet, stop with Ctrl-C\n", host, port, packet_samples);
+
+	while (!do_exit && airspyhf_is_streaming(device)) {
+		pfd.fd = STDIN_FILENO;
+		pfd.events = POLLIN;
+		if (!control || poll(&pfd, 1, 1000) <= 0) {
+			if (!control)
+				sleep(1);
+			if (verbose)
+				fprintf(stderr, "%llu packets sent, %llu failed\n", (unsigned long long) packets_sent, (unsigned long long) packets_failed);
+			continue;
+		}
+		if (fgets(line, sizeof(line), stdin) == NULL)
+			control = false;
+		else
+			handle_command(line);
+	}
+
+	airspyhf_stop(device);
+	result = EXIT_SUCCESS;
+
+exit:
+	if (sock >= 0)
+		close(sock);
+	if (device)
+		airspyhf_close(device);
+	free(packets);
+	fprintf(stderr, "%llu packets sent, %llu failed\ndone\n", (unsigned long long) packets_sent, (unsigned long long) packets_failed);
+	return result;
+
+exit_usage:
+	usage();
+	return EXIT_FAILURE;
+}
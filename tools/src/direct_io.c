@@ -0,0 +1,414 @@
+/*
+ * This file is part of AirSpyHF+.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* O_DIRECT */
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "direct_io.h"
+
+#if defined(__linux__)
+
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define USE_IO_URING
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+
+#define DIRECT_IO_ALIGNMENT (4096)
+#define DIRECT_IO_BLOCK_SIZE (1024 * 1024)
+#define DIRECT_IO_BLOCK_COUNT (8)
+
+#ifdef USE_IO_URING
+
+typedef struct
+{
+	int fd;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+	void* sq_ring;
+	void* cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	size_t sqes_size;
+} t_uring;
+
+#endif
+
+struct direct_writer
+{
+	int fd;
+	uint8_t* blocks[DIRECT_IO_BLOCK_COUNT];
+	bool in_flight[DIRECT_IO_BLOCK_COUNT];
+	int pending;
+	int current;
+	size_t fill;
+	uint64_t offset;
+	bool error;
+#ifdef USE_IO_URING
+	bool uring_open;
+	bool use_uring; /* Cleared when the kernel turns the writes down, pwrite() takes over */
+	t_uring uring;
+	struct iovec iov[DIRECT_IO_BLOCK_COUNT];
+	uint64_t block_offset[DIRECT_IO_BLOCK_COUNT];
+#endif
+};
+
+#ifdef USE_IO_URING
+
+static int uring_setup(t_uring* u, unsigned entries)
+{
+	struct io_uring_params params;
+
+	memset(&params, 0, sizeof(params));
+	u->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+	if (u->fd < 0)
+		return -1;
+
+	u->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	u->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+	u->sqes = (struct io_uring_sqe*) mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+
+	if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+		if (u->sq_ring != MAP_FAILED) munmap(u->sq_ring, u->sq_ring_size);
+		if (u->cq_ring != MAP_FAILED) munmap(u->cq_ring, u->cq_ring_size);
+		if (u->sqes != MAP_FAILED) munmap(u->sqes, u->sqes_size);
+		close(u->fd);
+		return -1;
+	}
+
+	u->sq_head = (unsigned*) ((uint8_t*) u->sq_ring + params.sq_off.head);
+	u->sq_tail = (unsigned*) ((uint8_t*) u->sq_ring + params.sq_off.tail);
+	u->sq_mask = (unsigned*) ((uint8_t*) u->sq_ring + params.sq_off.ring_mask);
+	u->sq_array = (unsigned*) ((uint8_t*) u->sq_ring + params.sq_off.array);
+	u->cq_head = (unsigned*) ((uint8_t*) u->cq_ring + params.cq_off.head);
+	u->cq_tail = (unsigned*) ((uint8_t*) u->cq_ring + params.cq_off.tail);
+	u->cq_mask = (unsigned*) ((uint8_t*) u->cq_ring + params.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe*) ((uint8_t*) u->cq_ring + params.cq_off.cqes);
+
+	return 0;
+}
+
+static void uring_destroy(t_uring* u)
+{
+	munmap(u->sqes, u->sqes_size);
+	munmap(u->cq_ring, u->cq_ring_size);
+	munmap(u->sq_ring, u->sq_ring_size);
+	close(u->fd);
+}
+
+/* IORING_OP_WRITEV rather than IORING_OP_WRITE, which needs Linux 5.6 while io_uring itself is 5.1 */
+static int uring_submit_write(t_uring* u, int fd, const struct iovec* iov, uint64_t offset, uint64_t user_data)
+{
+	unsigned tail;
+	unsigned index;
+	struct io_uring_sqe* sqe;
+
+	tail = *u->sq_tail;
+	index = tail & *u->sq_mask;
+	sqe = &u->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t) (uintptr_t) iov;
+	sqe->len = 1;
+	sqe->off = offset;
+	sqe->user_data = user_data;
+
+	u->sq_array[index] = index;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	return syscall(__NR_io_uring_enter, u->fd, 1, 0, 0, NULL, 0) == 1 ? 0 : -1;
+}
+
+/* Waits for at least one completion, then reaps all that are available */
+static int uring_reap(direct_writer_t* w)
+{
+	unsigned head;
+	struct io_uring_cqe* cqe;
+	int block;
+
+	if (syscall(__NR_io_uring_enter, w->uring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+		w->error = true;
+		return -1;
+	}
+
+	head = *w->uring.cq_head;
+	while (head != __atomic_load_n(w->uring.cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &w->uring.cqes[head & *w->uring.cq_mask];
+		block = (int) cqe->user_data;
+		if (cqe->res == -EINVAL) {
+			/* Opcode or flags not supported by this kernel: write the block again the plain way */
+			w->use_uring = false;
+			if (pwrite(w->fd, w->blocks[block], DIRECT_IO_BLOCK_SIZE, (off_t) w->block_offset[block]) != DIRECT_IO_BLOCK_SIZE)
+				w->error = true;
+		} else if (cqe->res != DIRECT_IO_BLOCK_SIZE) {
+			w->error = true;
+		}
+		w->in_flight[block] = false;
+		w->pending--;
+		head++;
+	}
+	__atomic_store_n(w->uring.cq_head, head, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+#endif
+
+static void wait_block(direct_writer_t* w, int block)
+{
+#ifdef USE_IO_URING
+	while (w->in_flight[block] && uring_reap(w) == 0)
+		;
+#endif
+	(void) w;
+	(void) block;
+}
+
+static void wait_all(direct_writer_t* w)
+{
+#ifdef USE_IO_URING
+	/* Completions are reaped even after an error: the kernel still owns the blocks */
+	while (w->pending > 0 && uring_reap(w) == 0)
+		;
+#endif
+	(void) w;
+}
+
+static void submit_block(direct_writer_t* w)
+{
+	int block = w->current;
+
+#ifdef USE_IO_URING
+	if (w->use_uring) {
+		w->in_flight[block] = true;
+		w->pending++;
+		w->iov[block].iov_base = w->blocks[block];
+		w->iov[block].iov_len = DIRECT_IO_BLOCK_SIZE;
+		w->block_offset[block] = w->offset;
+		if (uring_submit_write(&w->uring, w->fd, &w->iov[block], w->offset, (uint64_t) block) != 0) {
+			w->in_flight[block] = false;
+			w->pending--;
+			w->error = true;
+		}
+	} else
+#endif
+	if (pwrite(w->fd, w->blocks[block], DIRECT_IO_BLOCK_SIZE, (off_t) w->offset) != DIRECT_IO_BLOCK_SIZE) {
+		w->error = true;
+	}
+
+	w->offset += DIRECT_IO_BLOCK_SIZE;
+	w->fill = 0;
+	w->current = (w->current + 1) % DIRECT_IO_BLOCK_COUNT;
+
+	/* The next block may still be on its way to the disk */
+	wait_block(w, w->current);
+}
+
+int direct_writer_open(direct_writer_t** writer, const char* path)
+{
+	direct_writer_t* w;
+	int i;
+
+	*writer = NULL;
+
+	w = (direct_writer_t*) calloc(1, sizeof(direct_writer_t));
+	if (w == NULL)
+		return -1;
+
+	for (i = 0; i < DIRECT_IO_BLOCK_COUNT; i++) {
+		if (posix_memalign((void**) &w->blocks[i], DIRECT_IO_ALIGNMENT, DIRECT_IO_BLOCK_SIZE) != 0) {
+			w->blocks[i] = NULL;
+			goto failure;
+		}
+	}
+
+	w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	if (w->fd < 0)
+		goto failure;
+
+#ifdef USE_IO_URING
+	w->uring_open = uring_setup(&w->uring, DIRECT_IO_BLOCK_COUNT) == 0;
+	w->use_uring = w->uring_open;
+#endif
+
+	*writer = w;
+	return 0;
+
+failure:
+	for (i = 0; i < DIRECT_IO_BLOCK_COUNT; i++)
+		free(w->blocks[i]);
+	free(w);
+	return -1;
+}
+
+int direct_writer_preallocate(direct_writer_t* w, uint64_t length)
+{
+	return fallocate(w->fd, FALLOC_FL_KEEP_SIZE, 0, (off_t) length);
+}
+
+int direct_writer_write(direct_writer_t* w, const void* data, size_t length)
+{
+	size_t n;
+	const uint8_t* p = (const uint8_t*) data;
+
+	while (length > 0 && !w->error) {
+		n = DIRECT_IO_BLOCK_SIZE - w->fill;
+		if (n > length)
+			n = length;
+		memcpy(w->blocks[w->current] + w->fill, p, n);
+		w->fill += n;
+		p += n;
+		length -= n;
+
+		if (w->fill == DIRECT_IO_BLOCK_SIZE)
+			submit_block(w);
+	}
+
+	return w->error ? -1 : 0;
+}
+
+int direct_writer_uses_io_uring(direct_writer_t* w)
+{
+#ifdef USE_IO_URING
+	return w->use_uring;
+#else
+	(void) w;
+	return 0;
+#endif
+}
+
+uint64_t direct_writer_size(direct_writer_t* w)
+{
+	return w->offset + w->fill;
+}
+
+int direct_writer_close(direct_writer_t* w, const void* header, size_t header_length)
+{
+	int i;
+	int flags;
+	bool error;
+
+	wait_all(w);
+
+	/*
+	 * The partial last block and the header are not aligned: drop O_DIRECT for them
+	 * rather than padding the file and truncating it afterwards.
+	 */
+	flags = fcntl(w->fd, F_GETFL);
+	if (flags == -1 || fcntl(w->fd, F_SETFL, flags & ~O_DIRECT) == -1)
+		w->error = true;
+
+	if (!w->error && w->fill > 0 && pwrite(w->fd, w->blocks[w->current], w->fill, (off_t) w->offset) != (ssize_t) w->fill)
+		w->error = true;
+
+	if (!w->error && header != NULL && pwrite(w->fd, header, header_length, 0) != (ssize_t) header_length)
+		w->error = true;
+
+	/* Releases any preallocated space past the end of the data */
+	if (!w->error && ftruncate(w->fd, (off_t) direct_writer_size(w)) != 0)
+		w->error = true;
+
+	if (close(w->fd) != 0)
+		w->error = true;
+
+#ifdef USE_IO_URING
+	if (w->uring_open)
+		uring_destroy(&w->uring);
+#endif
+
+	for (i = 0; i < DIRECT_IO_BLOCK_COUNT; i++)
+		free(w->blocks[i]);
+
+	error = w->error;
+	free(w);
+
+	return error ? -1 : 0;
+}
+
+#else
+
+int direct_writer_open(direct_writer_t** writer, const char* path)
+{
+	(void) path;
+	*writer = NULL;
+	return -1;
+}
+
+int direct_writer_preallocate(direct_writer_t* writer, uint64_t length)
+{
+	(void) writer;
+	(void) length;
+	return -1;
+}
+
+int direct_writer_write(direct_writer_t* writer, const void* data, size_t length)
+{
+	(void) writer;
+	(void) data;
+	(void) length;
+	return -1;
+}
+
+int direct_writer_uses_io_uring(direct_writer_t* writer)
+{
+	(void) writer;
+	return 0;
+}
+
+uint64_t direct_writer_size(direct_writer_t* writer)
+{
+	(void) writer;
+	return 0;
+}
+
+int direct_writer_close(direct_writer_t* writer, const void* header, size_t header_length)
+{
+	(void) writer;
+	(void) header;
+	(void) header_length;
+	return -1;
+}
+
+#endif
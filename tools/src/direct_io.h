@@ -0,0 +1,44 @@
+/*
+ * This file is part of AirSpyHF+.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __DIRECT_IO_H__
+#define __DIRECT_IO_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Sequential file writer bypassing the page cache (O_DIRECT).
+ * Data is staged in aligned blocks which are written with io_uring when the
+ * kernel provides it, or with pwrite() otherwise.
+ * Linux only: direct_writer_open() fails elsewhere.
+ */
+
+typedef struct direct_writer direct_writer_t;
+
+int direct_writer_open(direct_writer_t** writer, const char* path);
+/* Reserves disk space without changing the file size; the excess is released on close */
+int direct_writer_preallocate(direct_writer_t* writer, uint64_t length);
+int direct_writer_write(direct_writer_t* writer, const void* data, size_t length);
+int direct_writer_uses_io_uring(direct_writer_t* writer);
+uint64_t direct_writer_size(direct_writer_t* writer);
+/* Flushes everything, then optionally overwrites the start of the file with header and closes it */
+int direct_writer_close(direct_writer_t* writer, const void* header, size_t header_length);
+
+#endif
@@ -0,0 +1,466 @@
+/*
+ * This file is part of AirSpyHF+.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "iq_codec.h"
+
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
+#define PARTITION_SIZE (256)
+#define MAX_ORDER (3)
+#define RICE_ESCAPE (31)
+#define RAW_BITS (20) /* Enough for any order 3 residual of 16-bit input */
+
+typedef struct
+{
+	uint8_t* p;
+	uint64_t acc;
+	int bits;
+} t_bitwriter;
+
+typedef struct
+{
+	const uint8_t* p;
+	const uint8_t* end;
+	uint64_t acc; /* Left aligned */
+	int bits;
+	int overrun; /* Bytes read past the end */
+} t_bitreader;
+
+static const uint32_t crc_table[256] =
+{
+	0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F,
+	0xE963A535, 0x9E6495A3, 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988,
+	0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91, 0x1DB71064, 0x6AB020F2,
+	0xF3B97148, 0x84BE41DE, 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
+	0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC, 0x14015C4F, 0x63066CD9,
+	0xFA0F3D63, 0x8D080DF5, 0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172,
+	0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B, 0x35B5A8FA, 0x42B2986C,
+	0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
+	0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423,
+	0xCFBA9599, 0xB8BDA50F, 0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924,
+	0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D, 0x76DC4190, 0x01DB7106,
+	0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
+	0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D,
+	0x91646C97, 0xE6635C01, 0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E,
+	0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457, 0x65B0D9C6, 0x12B7E950,
+	0x8BBEB8EA, 0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
+	0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7,
+	0xA4D1C46D, 0xD3D6F4FB, 0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0,
+	0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9, 0x5005713C, 0x270241AA,
+	0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
+	0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81,
+	0xB7BD5C3B, 0xC0BA6CAD, 0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A,
+	0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683, 0xE3630B12, 0x94643B84,
+	0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
+	0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D, 0x806567CB,
+	0x196C3671, 0x6E6B06E7, 0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC,
+	0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5, 0xD6D6A3E8, 0xA1D1937E,
+	0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
+	0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55,
+	0x316E8EEF, 0x4669BE79, 0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236,
+	0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F, 0xC5BA3BBE, 0xB2BD0B28,
+	0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
+	0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F,
+	0x72076785, 0x05005713, 0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38,
+	0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21, 0x86D3D2D4, 0xF1D4E242,
+	0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
+	0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69,
+	0x616BFFD3, 0x166CCF45, 0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2,
+	0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB, 0xAED16A4A, 0xD9D65ADC,
+	0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
+	0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693,
+	0x54DE5729, 0x23D967BF, 0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
+	0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
+};
+
+static uint32_t crc32(const uint8_t* data, size_t length)
+{
+	uint32_t crc = 0xFFFFFFFF;
+
+	while (length--)
+		crc = crc_table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+
+	return crc ^ 0xFFFFFFFF;
+}
+
+static int clz64(uint64_t x)
+{
+#if defined(__GNUC__)
+	return __builtin_clzll(x);
+#elif defined(_MSC_VER) && defined(_M_X64)
+	unsigned long index;
+	_BitScanReverse64(&index, x);
+	return 63 - (int) index;
+#else
+	int n = 0;
+	while (!(x & 0x8000000000000000ull)) {
+		x <<= 1;
+		n++;
+	}
+	return n;
+#endif
+}
+
+static void put_bits(t_bitwriter* w, uint32_t value, int n)
+{
+	/* n <= 32, fewer than 8 bits are ever left pending */
+	if (n == 0)
+		return;
+	w->acc = (w->acc << n) | (value & (0xFFFFFFFFu >> (32 - n)));
+	w->bits += n;
+	while (w->bits >= 8) {
+		w->bits -= 8;
+		*w->p++ = (uint8_t) (w->acc >> w->bits);
+	}
+}
+
+static void put_rice(t_bitwriter* w, uint32_t value, int k)
+{
+	uint32_t q = value >> k;
+
+	while (q >= 32) {
+		put_bits(w, 0, 32);
+		q -= 32;
+	}
+	put_bits(w, 1, (int) q + 1);
+	put_bits(w, value, k);
+}
+
+static void flush_bits(t_bitwriter* w)
+{
+	if (w->bits > 0)
+		put_bits(w, 0, 8 - w->bits);
+}
+
+static void refill(t_bitreader* r)
+{
+	while (r->bits <= 56) {
+		if (r->p < r->end) {
+			r->acc |= (uint64_t) *r->p++ << (56 - r->bits);
+		} else {
+			r->overrun++;
+		}
+		r->bits += 8;
+	}
+}
+
+static uint32_t get_bits(t_bitreader* r, int n)
+{
+	uint32_t value;
+
+	if (n == 0)
+		return 0;
+	refill(r);
+	value = (uint32_t) (r->acc >> (64 - n));
+	r->acc <<= n;
+	r->bits -= n;
+	return value;
+}
+
+static uint32_t get_rice(t_bitreader* r, int k)
+{
+	uint32_t q = 0;
+	int z;
+
+	refill(r);
+	while (r->acc == 0) {
+		if (r->overrun > 8)
+			return 0;
+		q += r->bits;
+		r->bits = 0;
+		refill(r);
+	}
+	z = clz64(r->acc);
+	q += z;
+	r->acc <<= z + 1;
+	r->bits -= z + 1;
+
+	return (q << k) | get_bits(r, k);
+}
+
+static uint32_t zigzag(int32_t value)
+{
+	return ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+}
+
+static int32_t unzigzag(uint32_t value)
+{
+	return (int32_t) (value >> 1) ^ -(int32_t) (value & 1);
+}
+
+static int32_t residual(const int32_t* x, int n, int order)
+{
+	switch (order)
+	{
+	case 0: return x[n];
+	case 1: return x[n] - x[n - 1];
+	case 2: return x[n] - 2 * x[n - 1] + x[n - 2];
+	default: return x[n] - 3 * x[n - 1] + 3 * x[n - 2] - x[n - 3];
+	}
+}
+
+static int select_order(const int32_t* x, uint32_t count)
+{
+	uint64_t cost[MAX_ORDER + 1] = { 0 };
+	int32_t e0, e1, e2, e3;
+	uint32_t n;
+	int order;
+	int best = 0;
+
+	for (n = MAX_ORDER; n < count; n++) {
+		e0 = x[n];
+		e1 = e0 - x[n - 1];
+		e2 = e1 - (x[n - 1] - x[n - 2]);
+		e3 = e2 - (x[n - 1] - 2 * x[n - 2] + x[n - 3]);
+		cost[0] += (uint32_t) abs(e0);
+		cost[1] += (uint32_t) abs(e1);
+		cost[2] += (uint32_t) abs(e2);
+		cost[3] += (uint32_t) abs(e3);
+	}
+
+	for (order = 1; order <= MAX_ORDER; order++) {
+		if (cost[order] < cost[best])
+			best = order;
+	}
+
+	return (int) count > best ? best : 0;
+}
+
+static uint64_t rice_cost(const uint32_t* u, uint32_t count, int k)
+{
+	uint64_t bits = (uint64_t) count * (k + 1);
+	uint32_t i;
+
+	for (i = 0; i < count; i++)
+		bits += u[i] >> k;
+	return bits;
+}
+
+static void encode_partition(t_bitwriter* w, const uint32_t* u, uint32_t count)
+{
+	uint64_t sum = 0;
+	uint64_t cost;
+	uint64_t best_cost;
+	uint32_t max = 0;
+	uint32_t i;
+	int estimate;
+	int k;
+	int best_k;
+	int width;
+
+	for (i = 0; i < count; i++) {
+		sum += u[i];
+		max |= u[i];
+	}
+
+	/* The optimal parameter is close to log2 of the mean, only its neighbours are tried */
+	estimate = 0;
+	while (estimate < RAW_BITS && ((uint64_t) count << (estimate + 1)) <= sum)
+		estimate++;
+
+	best_k = estimate;
+	best_cost = rice_cost(u, count, estimate);
+	for (k = estimate - 1; k <= estimate + 1; k += 2) {
+		if (k < 0 || k >= RAW_BITS)
+			continue;
+		cost = rice_cost(u, count, k);
+		if (cost < best_cost) {
+			best_cost = cost;
+			best_k = k;
+		}
+	}
+
+	width = 0;
+	while (width < 32 && (max >> width) != 0)
+		width++;
+
+	if ((uint64_t) count * width + 5 < best_cost) {
+		put_bits(w, RICE_ESCAPE, 5);
+		put_bits(w, (uint32_t) width, 5);
+		for (i = 0; i < count; i++)
+			put_bits(w, u[i], width);
+	} else {
+		put_bits(w, (uint32_t) best_k, 5);
+		for (i = 0; i < count; i++)
+			put_rice(w, u[i], best_k);
+	}
+}
+
+static void encode_channel(t_bitwriter* w, const int16_t* iq, uint32_t count, int32_t* x, uint32_t* u)
+{
+	uint32_t n;
+	uint32_t start;
+	int order;
+
+	for (n = 0; n < count; n++)
+		x[n] = iq[2 * n];
+
+	order = select_order(x, count);
+	put_bits(w, (uint32_t) order, 2);
+	for (n = 0; n < (uint32_t) order; n++)
+		put_bits(w, (uint16_t) x[n], 16);
+
+	for (n = order; n < count; n++)
+		u[n - order] = zigzag(residual(x, n, order));
+
+	for (start = 0; start < count - order; start += PARTITION_SIZE) {
+		n = count - order - start;
+		encode_partition(w, u + start, n < PARTITION_SIZE ? n : PARTITION_SIZE);
+	}
+}
+
+static int decode_channel(t_bitreader* r, int16_t* iq, uint32_t count, int32_t* x)
+{
+	uint32_t n;
+	uint32_t end;
+	uint32_t value;
+	int32_t prediction;
+	int order;
+	int k;
+	int width;
+
+	order = (int) get_bits(r, 2);
+	if ((uint32_t) order > count)
+		return -1;
+	for (n = 0; n < (uint32_t) order; n++)
+		x[n] = (int16_t) get_bits(r, 16);
+
+	n = order;
+	while (n < count) {
+		end = n + PARTITION_SIZE;
+		if (end > count)
+			end = count;
+
+		k = (int) get_bits(r, 5);
+		width = 0;
+		if (k == RICE_ESCAPE) {
+			width = (int) get_bits(r, 5);
+			if (width > 32)
+				return -1;
+		}
+
+		for (; n < end; n++) {
+			value = (k == RICE_ESCAPE) ? get_bits(r, width) : get_rice(r, k);
+			switch (order)
+			{
+			case 0: prediction = 0; break;
+			case 1: prediction = x[n - 1]; break;
+			case 2: prediction = 2 * x[n - 1] - x[n - 2]; break;
+			default: prediction = 3 * x[n - 1] - 3 * x[n - 2] + x[n - 3]; break;
+			}
+			x[n] = prediction + unzigzag(value);
+		}
+
+		if (r->overrun > 8)
+			return -1;
+	}
+
+	for (n = 0; n < count; n++) {
+		if (x[n] < -32768 || x[n] > 32767)
+			return -1;
+		iq[2 * n] = (int16_t) x[n];
+	}
+
+	return 0;
+}
+
+void iq_codec_file_hdr_init(iq_codec_file_hdr_t* hdr, uint32_t sample_rate)
+{
+	memset(hdr, 0, sizeof(iq_codec_file_hdr_t));
+	memcpy(hdr->magic, "AHFZ", 4);
+	hdr->version = IQ_CODEC_VERSION;
+	hdr->sample_rate = sample_rate;
+	hdr->block_frames = IQ_CODEC_BLOCK_FRAMES;
+}
+
+size_t iq_codec_max_block_size(uint32_t frame_count)
+{
+	size_t partitions = frame_count / PARTITION_SIZE + 1;
+
+	/* Per channel: order, warm-up, partition parameters and escaped residuals */
+	return sizeof(iq_codec_block_hdr_t) + 2 * ((2 + MAX_ORDER * 16 + partitions * 10 + (size_t) frame_count * RAW_BITS) / 8 + 1);
+}
+
+size_t iq_codec_encode(const int16_t* iq, uint32_t frame_count, uint8_t* dest)
+{
+	iq_codec_block_hdr_t hdr;
+	t_bitwriter w;
+	int32_t* x;
+	uint32_t* u;
+	uint8_t* payload = dest + sizeof(iq_codec_block_hdr_t);
+
+	x = (int32_t*) malloc(frame_count * sizeof(int32_t));
+	u = (uint32_t*) malloc(frame_count * sizeof(uint32_t));
+	if (x == NULL || u == NULL) {
+		free(x);
+		free(u);
+		return 0;
+	}
+
+	memset(&w, 0, sizeof(w));
+	w.p = payload;
+	if (frame_count > 0) {
+		encode_channel(&w, iq, frame_count, x, u);
+		encode_channel(&w, iq + 1, frame_count, x, u);
+	}
+	flush_bits(&w);
+
+	free(x);
+	free(u);
+
+	memcpy(hdr.magic, "AHFB", 4);
+	hdr.frame_count = frame_count;
+	hdr.payload_size = (uint32_t) (w.p - payload);
+	hdr.crc = crc32(payload, hdr.payload_size);
+	memcpy(dest, &hdr, sizeof(hdr));
+
+	return sizeof(iq_codec_block_hdr_t) + hdr.payload_size;
+}
+
+int iq_codec_decode(const iq_codec_block_hdr_t* hdr, const uint8_t* payload, int16_t* iq)
+{
+	t_bitreader r;
+	int32_t* x;
+	int result = 0;
+
+	if (memcmp(hdr->magic, "AHFB", 4) != 0 || crc32(payload, hdr->payload_size) != hdr->crc)
+		return -1;
+	if (hdr->frame_count == 0)
+		return 0;
+
+	x = (int32_t*) malloc(hdr->frame_count * sizeof(int32_t));
+	if (x == NULL)
+		return -1;
+
+	memset(&r, 0, sizeof(r));
+	r.p = payload;
+	r.end = payload + hdr->payload_size;
+	if (decode_channel(&r, iq, hdr->frame_count, x) != 0 ||
+		decode_channel(&r, iq + 1, hdr->frame_count, x) != 0)
+		result = -1;
+
+	free(x);
+
+	return result;
+}
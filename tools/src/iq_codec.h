@@ -0,0 +1,73 @@
+/*
+ * This file is part of AirSpyHF+.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __IQ_CODEC_H__
+#define __IQ_CODEC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Lossless compression of CS16 IQ, FLAC style: each block and channel uses the best
+ * fixed polynomial predictor (order 0 to 3) and Rice codes the residual per partition.
+ *
+ * Container layout:
+ *   iq_codec_file_hdr_t
+ *   iq_codec_block_hdr_t + payload, repeated
+ *   iq_codec_index_hdr_t + uint64_t offset of every block
+ * The sizes in the file header are filled in when the capture is closed. A file that
+ * was not closed properly can still be read by walking the block headers.
+ */
+
+#define IQ_CODEC_VERSION (1)
+#define IQ_CODEC_BLOCK_FRAMES (16384) /* IQ pairs per block */
+
+typedef struct
+{
+	char magic[4]; /* 'AHFZ' */
+	uint32_t version;
+	uint32_t sample_rate;
+	uint32_t block_frames; /* The last block may be shorter */
+	uint64_t frame_count; /* 0 until closed */
+	uint64_t index_offset; /* 0 until closed */
+} iq_codec_file_hdr_t;
+
+typedef struct
+{
+	char magic[4]; /* 'AHFB' */
+	uint32_t frame_count;
+	uint32_t payload_size;
+	uint32_t crc; /* CRC-32 of the payload */
+} iq_codec_block_hdr_t;
+
+typedef struct
+{
+	char magic[4]; /* 'AHFI' */
+	uint32_t block_count;
+} iq_codec_index_hdr_t;
+
+void iq_codec_file_hdr_init(iq_codec_file_hdr_t* hdr, uint32_t sample_rate);
+/* Worst case size of an encoded block, header included */
+size_t iq_codec_max_block_size(uint32_t frame_count);
+/* Encodes interleaved IQ into dest (header + payload), returns the number of bytes */
+size_t iq_codec_encode(const int16_t* iq, uint32_t frame_count, uint8_t* dest);
+/* Decodes a payload described by hdr into interleaved IQ, returns 0 or -1 if corrupted */
+int iq_codec_decode(const iq_codec_block_hdr_t* hdr, const uint8_t* payload, int16_t* iq);
+
+#endif
@@ -0,0 +1,323 @@
+/*
+ * This file is part of AirSpyHF+.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#include "shm_ring.h"
+
+#define SHM_RING_ALIGNMENT (64)
+#define SHM_RING_NAME_SIZE (256)
+
+/* Both structures are part of the shared layout */
+typedef char shm_ring_hdr_size_check[sizeof(shm_ring_hdr_t) == SHM_RING_ALIGNMENT ? 1 : -1];
+typedef char shm_ring_slot_size_check[sizeof(shm_ring_slot_t) == SHM_RING_ALIGNMENT ? 1 : -1];
+
+struct shm_ring
+{
+	int fd;
+	uint8_t* map;
+	size_t map_size;
+	shm_ring_hdr_t* hdr;
+	bool publisher;
+	uint64_t next_seq; /* Publisher: block being written, reader: next block to read */
+	uint64_t frame_index;
+	char name[SHM_RING_NAME_SIZE];
+};
+
+static shm_ring_slot_t* slot_at(const shm_ring_t* ring, uint64_t seq)
+{
+	return (shm_ring_slot_t*) (ring->map + sizeof(shm_ring_hdr_t) +
+		(size_t) (seq % ring->hdr->slot_count) * ring->hdr->slot_stride);
+}
+
+/* shm_open() wants a single leading slash */
+static void set_name(shm_ring_t* ring, const char* name)
+{
+	snprintf(ring->name, sizeof(ring->name), "%s%s", name[0] == '/' ? "" : "/", name);
+}
+
+static void wake_readers(shm_ring_hdr_t* hdr)
+{
+	__atomic_add_fetch(&hdr->wake, 1, __ATOMIC_RELEASE);
+#if defined(__linux__)
+	/* Shared futex: the waiters live in other processes */
+	syscall(SYS_futex, &hdr->wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+static void wait_for_publisher(shm_ring_hdr_t* hdr, uint32_t wake, int timeout_ms)
+{
+	struct timespec ts;
+
+#if defined(__linux__)
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (long) (timeout_ms % 1000) * 1000000L;
+	syscall(SYS_futex, &hdr->wake, FUTEX_WAIT, wake, &ts, NULL, 0);
+#else
+	/* Polling, a block is due every few milliseconds anyway */
+	(void) hdr;
+	(void) wake;
+	(void) timeout_ms;
+	ts.tv_sec = 0;
+	ts.tv_nsec = 1000000L;
+	nanosleep(&ts, NULL);
+#endif
+}
+
+static int64_t monotonic_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int shm_ring_create(shm_ring_t** ring, const char* name, uint32_t slot_count, uint32_t slot_size,
+	uint32_t sample_type, uint32_t sample_rate, uint32_t frame_size)
+{
+	shm_ring_t* r;
+	shm_ring_hdr_t* hdr;
+	uint32_t stride;
+	uint32_t i;
+
+	*ring = NULL;
+	if (slot_count < 2 || slot_size == 0)
+		return SHM_RING_ERROR;
+
+	r = (shm_ring_t*) calloc(1, sizeof(shm_ring_t));
+	if (r == NULL)
+		return SHM_RING_ERROR;
+	set_name(r, name);
+
+	stride = (uint32_t) ((sizeof(shm_ring_slot_t) + slot_size + SHM_RING_ALIGNMENT - 1) & ~(SHM_RING_ALIGNMENT - 1));
+	r->map_size = sizeof(shm_ring_hdr_t) + (size_t) slot_count * stride;
+	r->publisher = true;
+
+	/* Readers of a previous instance keep their mapping of the old object */
+	shm_unlink(r->name);
+	r->fd = shm_open(r->name, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (r->fd < 0) {
+		free(r);
+		return SHM_RING_ERROR;
+	}
+	if (ftruncate(r->fd, (off_t) r->map_size) != 0 ||
+		(r->map = (uint8_t*) mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0)) == MAP_FAILED) {
+		close(r->fd);
+		shm_unlink(r->name);
+		free(r);
+		return SHM_RING_ERROR;
+	}
+
+	hdr = (shm_ring_hdr_t*) r->map;
+	r->hdr = hdr;
+	hdr->version = SHM_RING_VERSION;
+	hdr->slot_count = slot_count;
+	hdr->slot_size = slot_size;
+	hdr->slot_stride = stride;
+	hdr->sample_type = sample_type;
+	hdr->sample_rate = sample_rate;
+	hdr->frame_size = frame_size;
+	hdr->publisher_pid = (uint32_t) getpid();
+	for (i = 0; i < slot_count; i++)
+		slot_at(r, i)->seq = SHM_RING_SEQ_BUSY;
+
+	/* Readers check the magic last */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(hdr->magic, SHM_RING_MAGIC, sizeof(hdr->magic));
+
+	*ring = r;
+	return SHM_RING_OK;
+}
+
+void* shm_ring_claim(shm_ring_t* ring)
+{
+	shm_ring_slot_t* slot = slot_at(ring, ring->next_seq);
+
+	/* Readers still using the previous block of this slot see the change on release */
+	__atomic_store_n(&slot->seq, SHM_RING_SEQ_BUSY, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	return (uint8_t*) slot + sizeof(shm_ring_slot_t);
+}
+
+void shm_ring_publish(shm_ring_t* ring, uint32_t length, uint32_t frame_count, int32_t scale_exponent, uint64_t dropped_samples)
+{
+	shm_ring_slot_t* slot = slot_at(ring, ring->next_seq);
+
+	slot->frame_index = ring->frame_index;
+	slot->dropped_samples = dropped_samples;
+	slot->length = length;
+	slot->frame_count = frame_count;
+	slot->scale_exponent = scale_exponent;
+	__atomic_store_n(&slot->seq, ring->next_seq, __ATOMIC_RELEASE);
+
+	ring->frame_index += frame_count;
+	ring->next_seq++;
+	__atomic_store_n(&ring->hdr->write_seq, ring->next_seq, __ATOMIC_RELEASE);
+	wake_readers(ring->hdr);
+}
+
+int shm_ring_open(shm_ring_t** ring, const char* name)
+{
+	shm_ring_t* r;
+	shm_ring_hdr_t hdr;
+	struct stat st;
+
+	*ring = NULL;
+	r = (shm_ring_t*) calloc(1, sizeof(shm_ring_t));
+	if (r == NULL)
+		return SHM_RING_ERROR;
+	set_name(r, name);
+
+	r->fd = shm_open(r->name, O_RDONLY, 0);
+	if (r->fd < 0) {
+		free(r);
+		return SHM_RING_ERROR;
+	}
+	if (fstat(r->fd, &st) != 0 || (size_t) st.st_size < sizeof(shm_ring_hdr_t) ||
+		pread(r->fd, &hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr) ||
+		memcmp(hdr.magic, SHM_RING_MAGIC, sizeof(hdr.magic)) != 0 ||
+		hdr.version != SHM_RING_VERSION ||
+		hdr.slot_count < 2 ||
+		hdr.slot_stride < sizeof(shm_ring_slot_t) + hdr.slot_size ||
+		(size_t) st.st_size < sizeof(shm_ring_hdr_t) + (size_t) hdr.slot_count * hdr.slot_stride) {
+		close(r->fd);
+		free(r);
+		return SHM_RING_ERROR;
+	}
+
+	r->map_size = sizeof(shm_ring_hdr_t) + (size_t) hdr.slot_count * hdr.slot_stride;
+	r->map = (uint8_t*) mmap(NULL, r->map_size, PROT_READ, MAP_SHARED, r->fd, 0);
+	if (r->map == MAP_FAILED) {
+		close(r->fd);
+		free(r);
+		return SHM_RING_ERROR;
+	}
+	r->hdr = (shm_ring_hdr_t*) r->map;
+	r->next_seq = __atomic_load_n(&r->hdr->write_seq, __ATOMIC_ACQUIRE);
+
+	*ring = r;
+	return SHM_RING_OK;
+}
+
+const shm_ring_hdr_t* shm_ring_info(const shm_ring_t* ring)
+{
+	return ring->hdr;
+}
+
+int shm_ring_read(shm_ring_t* ring, shm_ring_block_t* block, int timeout_ms)
+{
+	shm_ring_hdr_t* hdr = ring->hdr;
+	const shm_ring_slot_t* slot;
+	const int64_t deadline = monotonic_ms() + timeout_ms;
+	int64_t left;
+	uint64_t write_seq;
+	uint64_t seq;
+	uint64_t lost = 0;
+	uint32_t wake;
+
+	for (;;) {
+		wake = __atomic_load_n(&hdr->wake, __ATOMIC_ACQUIRE);
+		write_seq = __atomic_load_n(&hdr->write_seq, __ATOMIC_ACQUIRE);
+
+		if (ring->next_seq < write_seq) {
+			/* The slot of write_seq may be half written, resume half a ring back */
+			if (write_seq - ring->next_seq >= hdr->slot_count) {
+				lost += write_seq - hdr->slot_count / 2 - ring->next_seq;
+				ring->next_seq = write_seq - hdr->slot_count / 2;
+			}
+
+			slot = slot_at(ring, ring->next_seq);
+			seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+			if (seq != ring->next_seq) {
+				/* Overwritten since write_seq was read */
+				continue;
+			}
+
+			block->data = (const uint8_t*) slot + sizeof(shm_ring_slot_t);
+			block->length = slot->length;
+			block->frame_count = slot->frame_count;
+			block->scale_exponent = slot->scale_exponent;
+			block->frame_index = slot->frame_index;
+			block->dropped_samples = slot->dropped_samples;
+			block->seq = seq;
+			block->lost = lost;
+			ring->next_seq++;
+
+			/* Same check as the release, the metadata may be torn too */
+			if (shm_ring_release(ring, block) != SHM_RING_OK || block->length > hdr->slot_size) {
+				lost++;
+				continue;
+			}
+			return SHM_RING_OK;
+		}
+
+		if (__atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE))
+			return SHM_RING_CLOSED;
+
+		left = deadline - monotonic_ms();
+		if (left <= 0) {
+			/* A publisher killed before closing leaves the ring behind */
+			if (kill((pid_t) hdr->publisher_pid, 0) != 0 && errno == ESRCH)
+				return SHM_RING_CLOSED;
+			return SHM_RING_TIMEOUT;
+		}
+		wait_for_publisher(hdr, wake, (int) left);
+	}
+}
+
+int shm_ring_release(shm_ring_t* ring, const shm_ring_block_t* block)
+{
+	const shm_ring_slot_t* slot = slot_at(ring, block->seq);
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == block->seq ? SHM_RING_OK : SHM_RING_OVERRUN;
+}
+
+void shm_ring_close(shm_ring_t* ring)
+{
+	if (ring == NULL)
+		return;
+
+	if (ring->publisher) {
+		__atomic_store_n(&ring->hdr->closed, 1, __ATOMIC_RELEASE);
+		wake_readers(ring->hdr);
+		shm_unlink(ring->name);
+	}
+	munmap(ring->map, ring->map_size);
+	close(ring->fd);
+	free(ring);
+}
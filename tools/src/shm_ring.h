@@ -0,0 +1,109 @@
+/*
+ * This file is part of AirSpyHF+.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __SHM_RING_H__
+#define __SHM_RING_H__
+
+#include <stdint.h>
+
+/*
+ * Single publisher, any number of readers, broadcast ring in POSIX shared memory.
+ *
+ * Layout of the shared object:
+ *   shm_ring_hdr_t
+ *   slot_count times shm_ring_slot_t + slot_size payload bytes, every slot_stride bytes
+ *
+ * The publisher never waits for readers. Every slot carries the sequence number of the
+ * block it holds, set once the payload is complete (seqlock style). Readers map the
+ * object read only and use the payload in place, then call shm_ring_release() which
+ * tells whether the publisher overwrote the slot in the meantime.
+ */
+
+#define SHM_RING_MAGIC "AHFSHM1"
+#define SHM_RING_VERSION (1)
+#define SHM_RING_SEQ_BUSY (UINT64_MAX) /* Slot being written */
+
+#define SHM_RING_OK (0)
+#define SHM_RING_TIMEOUT (1)
+#define SHM_RING_CLOSED (-1) /* The publisher is gone */
+#define SHM_RING_OVERRUN (-2) /* The block was overwritten while in use */
+#define SHM_RING_ERROR (-3)
+
+typedef struct
+{
+	char magic[8]; /* SHM_RING_MAGIC */
+	uint32_t version;
+	uint32_t slot_count;
+	uint32_t slot_size; /* Payload bytes per slot */
+	uint32_t slot_stride; /* Bytes from one slot to the next */
+	uint32_t sample_type; /* enum airspyhf_sample_type */
+	uint32_t sample_rate;
+	uint32_t frame_size; /* Bytes per IQ pair */
+	uint32_t publisher_pid;
+	uint32_t closed;
+	uint32_t wake; /* Futex word, bumped for every block */
+	uint64_t write_seq; /* Blocks published so far */
+	uint64_t reserved;
+} shm_ring_hdr_t;
+
+typedef struct
+{
+	uint64_t seq;
+	uint64_t frame_index; /* Stream position of the first frame */
+	uint64_t dropped_samples;
+	uint32_t length; /* Payload bytes */
+	uint32_t frame_count;
+	int32_t scale_exponent;
+	uint32_t reserved[7];
+} shm_ring_slot_t;
+
+/* A block handed to a reader, data points into the shared memory */
+typedef struct
+{
+	const void* data;
+	uint32_t length;
+	uint32_t frame_count;
+	int32_t scale_exponent;
+	uint64_t seq;
+	uint64_t frame_index;
+	uint64_t dropped_samples;
+	uint64_t lost; /* Blocks the reader missed since the previous one */
+} shm_ring_block_t;
+
+typedef struct shm_ring shm_ring_t;
+
+/* Publisher side, replaces any ring left behind with the same name */
+int shm_ring_create(shm_ring_t** ring, const char* name, uint32_t slot_count, uint32_t slot_size,
+	uint32_t sample_type, uint32_t sample_rate, uint32_t frame_size);
+/* Payload of the next slot, to be filled then published */
+void* shm_ring_claim(shm_ring_t* ring);
+void shm_ring_publish(shm_ring_t* ring, uint32_t length, uint32_t frame_count, int32_t scale_exponent, uint64_t dropped_samples);
+
+/* Reader side, starts with the next block published */
+int shm_ring_open(shm_ring_t** ring, const char* name);
+const shm_ring_hdr_t* shm_ring_info(const shm_ring_t* ring);
+/* Waits up to timeout_ms for a block, skips ahead when the reader lagged a full ring behind */
+int shm_ring_read(shm_ring_t* ring, shm_ring_block_t* block, int timeout_ms);
+/* SHM_RING_OK when the block was still intact after use, SHM_RING_OVERRUN otherwise */
+int shm_ring_release(shm_ring_t* ring, const shm_ring_block_t* block);
+
+/* Either side, the publisher marks the ring closed and removes the name */
+void shm_ring_close(shm_ring_t* ring);
+
+#endif